@@ -0,0 +1,2108 @@
+/*
+bench.c
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+
+hts-bench starts hts with --forward-port pointing at an echo or sink
+server of its own, and drives it with clients that speak the tunnel
+protocol the way htc does.  It runs once for every combination of the
+swept parameters, and prints one line of JSON per run.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd_.h>
+#include <signal.h>
+#include <sys/poll_.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <strings.h>
+#include <netinet/tcp.h>
+
+#include "common.h"
+#include "timer.h"
+#include "replay.h"
+
+#define DEFAULT_BENCH_PORT 18888
+#define DEFAULT_DURATION 5
+#define DEFAULT_INFLIGHT 4
+#define START_TIMEOUT_MSEC 5000
+#define STOP_TIMEOUT_MSEC 2000
+#define RETRY_MSEC 50
+#define LIST_MAX 16
+#define REPLAY_GRACE_MSEC 10000	/* for frames after the last is due */
+#define STALL_MSEC 10000	/* with no data moving, a run has failed */
+
+#define OUT_MAX (256 * 1024)	/* unsent PUT data of a client */
+#define IN_MAX 65536
+
+/* The most the proxy holds of one direction of a connection.  */
+#define PROXY_QUEUE_MAX (16 * 1024 * 1024)
+
+/* Requests of the tunnel protocol, see HACKING.  */
+#define TUNNEL_OPEN		0x01
+#define TUNNEL_DATA		0x02
+#define TUNNEL_JDATA		0x06
+#define TUNNEL_SIMPLE		0x40
+#define TUNNEL_PAD1		0x45
+#define TUNNEL_CLOSE		0x46
+#define TUNNEL_DISCONNECT	0x47
+
+typedef struct
+{
+  int n;
+  int value[LIST_MAX];
+} List;
+
+typedef struct
+{
+  char *me;
+  char **hts_argv;		/* hts and its own options */
+  int hts_argc;
+  int port;
+  int duration;
+  int inflight;			/* round trips outstanding per session */
+  int echo;			/* or else sink */
+  List sessions;
+  List content_length;
+  List strict;
+  List keep_alive;
+  List frame_size;
+  int proxy;			/* put a proxy in front of hts */
+  int proxy_store;		/* it holds data until the sender is done */
+  List proxy_buffer;
+  List proxy_delay;
+  List proxy_rate;
+  Replay *replay;		/* sessions to replay, or NULL */
+  List replay_speed;
+} Arguments;
+
+/* The parameters of one run.  */
+typedef struct
+{
+  int sessions;
+  int content_length;
+  int strict;
+  int keep_alive;
+  int frame_size;
+  int proxy_buffer;		/* bytes held before forwarding, or 0 */
+  int proxy_delay;		/* milliseconds added to everything */
+  int proxy_rate;		/* bytes a second, or 0 for no limit */
+  int replay_speed;		/* times real time, or 0 for at once */
+} Run;
+
+/* Latencies in microseconds.  */
+typedef struct
+{
+  unsigned long *usec;
+  size_t n, size;
+} Samples;
+
+/* One direction of a replayed session.  Frame I is sent when it is
+   due, and has arrived when end[I] bytes have.  */
+typedef struct
+{
+  ReplayFrame *frame;		/* NULL if not replaying */
+  int n;
+  int next;			/* frames sent */
+  int done;			/* frames arrived */
+  unsigned long sent;		/* bytes sent ... */
+  unsigned long arrived;	/* ... and arrived */
+  unsigned long *end;		/* [n] */
+  unsigned long *when;		/* [n] timer_now_usec () it was sent */
+} Track;
+
+enum
+{
+  CONN_IDLE,			/* waiting to connect */
+  CONN_CONNECTING,
+  CONN_HEADERS,			/* GET: reading the reply header */
+  CONN_OPEN
+};
+
+/* A client: a PUT connection for data to hts, and a GET connection
+   for data back.  */
+typedef struct
+{
+  struct sockaddr_in src;	/* a loopback address of its own */
+  int put_fd;
+  int put_state;
+  unsigned long put_retry;	/* timer_now () of the next connect */
+  long put_left;		/* bytes of body before DISCONNECT */
+  int opened;			/* TUNNEL_OPEN queued */
+  int announced;		/* and written */
+  int put_done;			/* DISCONNECT queued */
+  char *out;
+  size_t out_len, out_off;
+
+  int get_fd;
+  int get_state;
+  unsigned long get_retry;
+  char *in;
+  size_t in_len;
+  long body_left;		/* of the GET reply, or -1 if unknown */
+  int req;			/* request being read, or 0 */
+  unsigned long req_left;	/* of its data */
+
+  size_t frame_left;		/* of the frame being queued */
+  unsigned long sent;		/* payload queued */
+  unsigned long received;	/* payload read back */
+  unsigned long *ends;		/* [inflight] byte offsets ... */
+  unsigned long *times;		/* ... and when they were sent */
+  int ihead, itail;
+
+  Track up;			/* --replay: frames to hts ... */
+  Track down;			/* ... and back */
+  int linked;			/* its forward connection is known */
+} Client;
+
+/* A connection from hts to the echo or sink server.  */
+typedef struct
+{
+  int fd;
+  char buf[IN_MAX];
+  size_t len, off;
+  Client *client;		/* --replay: whose connection it is */
+  unsigned char stamp[4];	/* which comes first */
+  size_t stamp_len;
+  size_t frame_left;		/* of the frame being sent */
+} Echo;
+
+/* Data held by the proxy, in the order it arrived.  */
+typedef struct chunk
+{
+  struct chunk *next;
+  unsigned long due;		/* timer_now_usec () to pass it on */
+  size_t len, off;
+  char data[1];
+} Chunk;
+
+/* One direction of a proxied connection.  */
+typedef struct
+{
+  Chunk *head, *tail;
+  size_t queued;
+  size_t ready;			/* of queued, what buffering lets through */
+  int eof;			/* the sender is done */
+  int shut;			/* and that has been passed on */
+} Flow;
+
+/* A connection through the proxy.  flow[i] carries data from fd[i] to
+   fd[1 - i].  */
+typedef struct
+{
+  int fd[2];			/* client and hts side; -1 if unused */
+  int connecting;		/* to hts */
+  Flow flow[2];
+} Proxy;
+
+/* What --proxy-rate lets through in one direction, shared by all
+   connections like a slow link.  */
+typedef struct
+{
+  long tokens;			/* bytes allowed now */
+  unsigned long refilled;	/* timer_now_usec () */
+} Bucket;
+
+typedef struct
+{
+  Arguments *arg;
+  Run *run;
+  int port;
+  int entry_port;		/* where clients connect: proxy or hts */
+  int echo_fd;
+  int echo_port;
+  Echo *echoes;
+  int nechoes;
+  Client *clients;
+  int proxy_fd;
+  Proxy *proxies;
+  int nproxies;
+  Bucket bucket[2];		/* to hts and back */
+  pid_t hts;
+  char pid_filename[64];
+  struct pollfd *pfd;
+  int *who;			/* what each pfd entry belongs to */
+  int measuring;
+  unsigned long start_usec;
+  unsigned long bytes_up;	/* payload at the echo server */
+  unsigned long bytes_down;	/* payload back at the clients */
+  unsigned long frames;		/* round trips, or frames sunk */
+  Samples rtt;
+  Samples up, down;		/* --replay: one way */
+  int failed;
+  int stalled;			/* data stopped moving while measuring */
+} Bench;
+
+static char payload[IN_MAX];
+
+static void
+usage (FILE *f, const char *me)
+{
+  fprintf (f,
+"Usage: %s [OPTION]... -- HTS [HTS-OPTION]...\n"
+"Benchmark HTS over loopback.  Each of the LIST options takes values\n"
+"separated by commas, and every combination of them is run.\n"
+"\n"
+"  -c, --content-length LIST      Content-Length of PUT requests and GET\n"
+"                                 replies (default is %d)\n"
+"  -d, --duration SECONDS         measure each run for SECONDS seconds\n"
+"                                 (default is %d)\n"
+"  -f, --frame-size LIST          write LIST bytes at a time (default is\n"
+"                                 1024)\n"
+"  -h, --help                     display this help and exit\n"
+"  -i, --inflight N               keep N frames per session on their way\n"
+"                                 (default is %d)\n"
+"  -k, --keep-alive LIST          pass --keep-alive LIST to HTS (default\n"
+"                                 is %d)\n"
+"  -p, --port PORT                run HTS at PORT, and the next ports for\n"
+"                                 the following runs (default is %d)\n"
+"      --proxy                    connect through a proxy that passes data\n"
+"                                 on as it comes; the --proxy- options\n"
+"                                 make it behave like worse ones\n"
+"      --proxy-buffer LIST        hold data in each direction until LIST\n"
+"                                 bytes have arrived\n"
+"      --proxy-delay LIST         hold everything for LIST milliseconds\n"
+"      --proxy-rate LIST          pass on at most LIST bytes a second in\n"
+"                                 each direction\n"
+"      --proxy-store              hold data until the request or reply\n"
+"                                 is over\n"
+"  -r, --replay FILE              replay the tunnel sessions in FILE, a\n"
+"                                 pcap capture, instead of making up\n"
+"                                 traffic; sets --sessions and --sink\n"
+"      --replay-speed LIST        replay LIST times faster than captured,\n"
+"                                 or as fast as possible if 0 (default\n"
+"                                 is 1)\n"
+"  -s, --sessions LIST            run LIST sessions at once (default is 1)\n"
+"      --sink                     discard data instead of echoing it; no\n"
+"                                 round trip times are measured\n"
+"  -S, --strict                   run both with and without\n"
+"                                 --strict\n"
+"\n"
+"HTS is started with --forward-port, --content-length, --keep-alive,\n"
+"--max-sessions, --pid-file, --strict and PORT added to HTS-OPTIONs.\n"
+"The exit status is 1 if any run failed.\n",
+	   me, DEFAULT_CONTENT_LENGTH, DEFAULT_DURATION, DEFAULT_INFLIGHT,
+	   DEFAULT_KEEP_ALIVE, DEFAULT_BENCH_PORT);
+}
+
+/* Values below MIN are refused.  */
+
+static void
+parse_list (Arguments *arg, List *list, const char *s, int min)
+{
+  char *copy = strdup (s);
+  char *p;
+
+  list->n = 0;
+  for (p = strtok (copy, ","); p != NULL; p = strtok (NULL, ","))
+    {
+      if (list->n == LIST_MAX)
+	{
+	  fprintf (stderr, "%s: at most %d values in a list\n",
+		   arg->me, LIST_MAX);
+	  exit (1);
+	}
+      list->value[list->n] = atoi_with_postfix (p);
+      if (list->value[list->n] < min)
+	{
+	  fprintf (stderr, "%s: bad value \"%s\"\n", arg->me, p);
+	  exit (1);
+	}
+      list->n++;
+    }
+  free (copy);
+}
+
+static void
+parse_arguments (int argc, char **argv, Arguments *arg)
+{
+  const char *replay = NULL, *why;
+  int c;
+
+  arg->me = argv[0];
+  arg->port = DEFAULT_BENCH_PORT;
+  arg->duration = DEFAULT_DURATION;
+  arg->inflight = DEFAULT_INFLIGHT;
+  arg->echo = TRUE;
+  arg->sessions.n = 1;
+  arg->sessions.value[0] = 1;
+  arg->content_length.n = 1;
+  arg->content_length.value[0] = DEFAULT_CONTENT_LENGTH;
+  arg->strict.n = 1;
+  arg->strict.value[0] = FALSE;
+  arg->keep_alive.n = 1;
+  arg->keep_alive.value[0] = DEFAULT_KEEP_ALIVE;
+  arg->frame_size.n = 1;
+  arg->frame_size.value[0] = 1024;
+  arg->proxy = FALSE;
+  arg->proxy_store = FALSE;
+  arg->proxy_buffer.n = arg->proxy_delay.n = arg->proxy_rate.n = 1;
+  arg->proxy_buffer.value[0] = 0;
+  arg->proxy_delay.value[0] = 0;
+  arg->proxy_rate.value[0] = 0;
+  arg->replay = NULL;
+  arg->replay_speed.n = 1;
+  arg->replay_speed.value[0] = 1;
+
+  for (;;)
+    {
+      int option_index = 0;
+      static struct option long_options[] =
+      {
+	{ "content-length", required_argument, 0, 'c' },
+	{ "duration", required_argument, 0, 'd' },
+	{ "frame-size", required_argument, 0, 'f' },
+	{ "help", no_argument, 0, 'h' },
+	{ "inflight", required_argument, 0, 'i' },
+	{ "keep-alive", required_argument, 0, 'k' },
+	{ "port", required_argument, 0, 'p' },
+	{ "proxy", no_argument, 0, 'P' },
+	{ "proxy-buffer", required_argument, 0, 'B' },
+	{ "proxy-delay", required_argument, 0, 'D' },
+	{ "proxy-rate", required_argument, 0, 'R' },
+	{ "proxy-store", no_argument, 0, 'T' },
+	{ "replay", required_argument, 0, 'r' },
+	{ "replay-speed", required_argument, 0, 'X' },
+	{ "sessions", required_argument, 0, 's' },
+	{ "sink", no_argument, 0, 'K' },
+	{ "strict", no_argument, 0, 'S' },
+	{ 0, 0, 0, 0 }
+      };
+
+      c = getopt_long (argc, argv, "c:d:f:hi:k:p:r:s:S",
+		       long_options, &option_index);
+      if (c == -1)
+	break;
+
+      switch (c)
+	{
+	case 'c':
+	  parse_list (arg, &arg->content_length, optarg, 1);
+	  break;
+	case 'd':
+	  arg->duration = atoi (optarg);
+	  break;
+	case 'f':
+	  parse_list (arg, &arg->frame_size, optarg, 1);
+	  break;
+	case 'h':
+	  usage (stdout, arg->me);
+	  exit (0);
+	case 'i':
+	  arg->inflight = atoi (optarg);
+	  break;
+	case 'k':
+	  parse_list (arg, &arg->keep_alive, optarg, 1);
+	  break;
+	case 'p':
+	  arg->port = atoi (optarg);
+	  break;
+	case 's':
+	  parse_list (arg, &arg->sessions, optarg, 1);
+	  break;
+	case 'K':
+	  arg->echo = FALSE;
+	  break;
+	case 'P':
+	  arg->proxy = TRUE;
+	  break;
+	case 'B':
+	  parse_list (arg, &arg->proxy_buffer, optarg, 0);
+	  arg->proxy = TRUE;
+	  break;
+	case 'D':
+	  parse_list (arg, &arg->proxy_delay, optarg, 0);
+	  arg->proxy = TRUE;
+	  break;
+	case 'R':
+	  parse_list (arg, &arg->proxy_rate, optarg, 0);
+	  arg->proxy = TRUE;
+	  break;
+	case 'T':
+	  arg->proxy_store = arg->proxy = TRUE;
+	  break;
+	case 'r':
+	  replay = optarg;
+	  break;
+	case 'X':
+	  parse_list (arg, &arg->replay_speed, optarg, 0);
+	  break;
+	case 'S':
+	  arg->strict.n = 2;
+	  arg->strict.value[1] = TRUE;
+	  break;
+	default:
+	  fprintf (stderr, "%s: try '%s --help' for help.\n",
+		   arg->me, arg->me);
+	  exit (1);
+	}
+    }
+
+  if (optind == argc)
+    {
+      fprintf (stderr, "%s: no hts to run\n"
+	       "%s: try '%s --help' for help.\n", arg->me, arg->me, arg->me);
+      exit (1);
+    }
+  arg->hts_argv = argv + optind;
+  arg->hts_argc = argc - optind;
+
+  if (arg->duration <= 0 || arg->inflight <= 0)
+    {
+      fprintf (stderr, "%s: --duration and --inflight must be positive\n",
+	       arg->me);
+      exit (1);
+    }
+  for (c = 0; c < arg->frame_size.n; c++)
+    if (arg->frame_size.value[c] > IN_MAX)
+      {
+	fprintf (stderr, "%s: frames are at most %d bytes\n",
+		 arg->me, IN_MAX);
+	exit (1);
+      }
+
+  /* The capture's server is played by the sink.  */
+  if (replay != NULL)
+    {
+      arg->replay = replay_load (replay, &why);
+      if (arg->replay == NULL)
+	{
+	  fprintf (stderr, "%s: %s: %s\n", arg->me, replay, why);
+	  exit (1);
+	}
+      arg->sessions.n = 1;
+      arg->sessions.value[0] = arg->replay->nsessions;
+      arg->echo = FALSE;
+    }
+}
+
+/* hts and what it forks, in seconds of CPU time, or -1 if that isn't
+   known.  */
+
+static double
+process_cpu (pid_t pid)
+{
+  unsigned long ticks = 0;
+  int found = FALSE;
+  DIR *dir;
+  struct dirent *ent;
+
+  dir = opendir ("/proc");
+  if (dir == NULL)
+    return -1;
+
+  while ((ent = readdir (dir)) != NULL)
+    {
+      char name[300], line[512], *p;
+      unsigned long utime, stime;
+      FILE *f;
+      int ppid;
+
+      if (ent->d_name[0] < '0' || ent->d_name[0] > '9')
+	continue;
+      snprintf (name, sizeof name, "/proc/%s/stat", ent->d_name);
+      f = fopen (name, "r");
+      if (f == NULL)
+	continue;
+      p = fgets (line, sizeof line, f);
+      fclose (f);
+
+      /* The command name may contain anything but ends with ')'.  */
+      if (p == NULL || (p = strrchr (line, ')')) == NULL
+	  || sscanf (p + 1, " %*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u"
+		     " %lu %lu", &ppid, &utime, &stime) != 3)
+	continue;
+      if (atoi (ent->d_name) == pid || ppid == pid)
+	{
+	  ticks += utime + stime;
+	  found = TRUE;
+	}
+    }
+  closedir (dir);
+
+  return found ? (double)ticks / sysconf (_SC_CLK_TCK) : -1;
+}
+
+static int
+hts_start (Bench *bench)
+{
+  Arguments *arg = bench->arg;
+  Run *run = bench->run;
+  char forward[32], content_length[16], keep_alive[16];
+  char sessions[16], port[16];
+  unsigned long deadline;
+  char **argv;
+  pid_t child;
+  FILE *f;
+  int i, n;
+
+  snprintf (bench->pid_filename, sizeof bench->pid_filename,
+	    "/tmp/hts-bench.%d", (int)getpid ());
+  unlink (bench->pid_filename);
+  snprintf (forward, sizeof forward, "127.0.0.1:%d", bench->echo_port);
+  snprintf (content_length, sizeof content_length, "%d",
+	    run->content_length);
+  snprintf (keep_alive, sizeof keep_alive, "%d", run->keep_alive);
+  snprintf (sessions, sizeof sessions, "%d", run->sessions);
+  snprintf (port, sizeof port, "%d", bench->port);
+
+  argv = malloc ((arg->hts_argc + 13) * sizeof *argv);
+  for (n = 0; n < arg->hts_argc; n++)
+    argv[n] = arg->hts_argv[n];
+  argv[n++] = "--forward-port";
+  argv[n++] = forward;
+  argv[n++] = "--content-length";
+  argv[n++] = content_length;
+  argv[n++] = "--keep-alive";
+  argv[n++] = keep_alive;
+  argv[n++] = "--max-sessions";
+  argv[n++] = sessions;
+  argv[n++] = "--pid-file";
+  argv[n++] = bench->pid_filename;
+  if (run->strict)
+    argv[n++] = "--strict";
+  argv[n++] = port;
+  argv[n] = NULL;
+
+  child = fork ();
+  if (child == 0)
+    {
+      /* So that hts and its workers can be stopped together even if
+	 it doesn't daemonize.  */
+      setpgid (0, 0);
+      execvp (argv[0], argv);
+      fprintf (stderr, "%s: couldn't run %s: %s\n",
+	       arg->me, argv[0], strerror (errno));
+      _exit (1);
+    }
+  free (argv);
+  if (child == -1)
+    return -1;
+
+  /* hts daemonizes, so its pid comes from the pid file.  */
+  deadline = timer_now () + START_TIMEOUT_MSEC;
+  while ((long)(timer_now () - deadline) < 0)
+    {
+      waitpid (-1, NULL, WNOHANG);
+      f = fopen (bench->pid_filename, "r");
+      if (f != NULL)
+	{
+	  i = fscanf (f, "%d", &n);
+	  fclose (f);
+	  if (i == 1 && n > 0)
+	    {
+	      bench->hts = n;
+	      return 0;
+	    }
+	}
+      usleep (10000);
+    }
+
+  kill (-child, SIGKILL);
+  errno = ETIMEDOUT;
+  return -1;
+}
+
+static void
+hts_stop (Bench *bench)
+{
+  unsigned long deadline;
+
+  if (bench->hts <= 0)
+    return;
+
+  kill (-bench->hts, SIGTERM);
+  kill (bench->hts, SIGTERM);
+  deadline = timer_now () + STOP_TIMEOUT_MSEC;
+  while (kill (bench->hts, 0) == 0 && (long)(timer_now () - deadline) < 0)
+    {
+      waitpid (-1, NULL, WNOHANG);
+      usleep (10000);
+    }
+  if (kill (bench->hts, 0) == 0)
+    {
+      kill (-bench->hts, SIGKILL);
+      kill (bench->hts, SIGKILL);
+    }
+  while (waitpid (-1, NULL, WNOHANG) > 0)
+    ;
+  unlink (bench->pid_filename);
+  bench->hts = 0;
+}
+
+static void
+sample_add (Samples *samples, unsigned long usec)
+{
+  if (samples->n == samples->size)
+    {
+      samples->size = samples->size ? 2 * samples->size : 4096;
+      samples->usec = realloc (samples->usec,
+			       samples->size * sizeof *samples->usec);
+    }
+  samples->usec[samples->n++] = usec;
+}
+
+/* Fold a wait of USEC microseconds, or -1 for none, into a poll ()
+   TIMEOUT.  */
+
+static void
+wait_timeout (int *timeout, long usec)
+{
+  if (usec > 0 && (usec + 999) / 1000 < *timeout)
+    *timeout = (usec + 999) / 1000;
+}
+
+static void
+track_init (Track *track, ReplayFrame *frame, int n)
+{
+  memset (track, 0, sizeof *track);
+  track->frame = frame;
+  track->n = n;
+  track->end = malloc ((n + 1) * sizeof *track->end);
+  track->when = malloc ((n + 1) * sizeof *track->when);
+}
+
+static void
+track_free (Track *track)
+{
+  free (track->end);
+  free (track->when);
+}
+
+/* How many microseconds until the next frame of TRACK is due: 0 if
+   it is, or -1 if there is none.  The replay starts with the
+   measuring.  */
+
+static long
+track_wait (Bench *bench, Track *track, unsigned long now)
+{
+  unsigned long due = bench->start_usec;
+
+  if (track->frame == NULL || track->next == track->n || !bench->measuring)
+    return -1;
+  if (bench->run->replay_speed > 0)
+    due += track->frame[track->next].usec / bench->run->replay_speed;
+  return (long)(due - now) > 0 ? (long)(due - now) : 0;
+}
+
+/* Take the next frame of TRACK to send, and return its length.  */
+
+static size_t
+track_send (Track *track, unsigned long now)
+{
+  size_t len = track->frame[track->next].len;
+
+  track->sent += len;
+  track->end[track->next] = track->sent;
+  track->when[track->next] = now;
+  track->next++;
+  return len;
+}
+
+static void
+track_arrived (Bench *bench, Track *track, size_t n, Samples *samples)
+{
+  unsigned long now = timer_now_usec ();
+
+  track->arrived += n;
+  while (track->done < track->next
+	 && track->end[track->done] <= track->arrived)
+    {
+      sample_add (samples, now - track->when[track->done]);
+      bench->frames++;
+      track->done++;
+    }
+}
+
+static void
+set_nonblocking (int fd)
+{
+  int flags = fcntl (fd, F_GETFL);
+
+  if (flags != -1)
+    fcntl (fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Listen at a free loopback port, and return it in PORT.  */
+
+static int
+listen_loopback (int *port)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof addr;
+  int fd;
+
+  fd = socket (PF_INET, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (bind (fd, (struct sockaddr *)&addr, sizeof addr) == -1
+      || listen (fd, 128) == -1
+      || getsockname (fd, (struct sockaddr *)&addr, &len) == -1)
+    {
+      close (fd);
+      return -1;
+    }
+  set_nonblocking (fd);
+  *port = ntohs (addr.sin_port);
+  return fd;
+}
+
+static int
+echo_listen (Bench *bench)
+{
+  bench->echo_fd = listen_loopback (&bench->echo_port);
+  return bench->echo_fd == -1 ? -1 : 0;
+}
+
+static void
+echo_accept (Bench *bench)
+{
+  int fd, i, on = 1;
+
+  fd = accept (bench->echo_fd, NULL, NULL);
+  if (fd == -1)
+    return;
+  for (i = 0; i < bench->nechoes; i++)
+    if (bench->echoes[i].fd == -1)
+      {
+	/* Echoes shouldn't wait for more data to send.  */
+	set_nonblocking (fd);
+	setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+	bench->echoes[i].fd = fd;
+	bench->echoes[i].len = bench->echoes[i].off = 0;
+	bench->echoes[i].client = NULL;
+	bench->echoes[i].stamp_len = bench->echoes[i].frame_left = 0;
+	return;
+      }
+  close (fd);
+}
+
+static void
+echo_close (Echo *echo)
+{
+  close (echo->fd);
+  echo->fd = -1;
+}
+
+/* Whether ECHO, the forward connection of a replayed session, has
+   frames to send: as for track_wait ().  */
+
+static long
+replay_echo_wait (Bench *bench, Echo *echo, unsigned long now)
+{
+  if (echo->client == NULL)
+    return -1;
+  if (echo->off < echo->len || echo->frame_left > 0)
+    return 0;
+  return track_wait (bench, &echo->client->down, now);
+}
+
+/* The server end of a replayed session.  It takes the client's
+   number from the first four bytes, sinks the rest, and sends the
+   captured frames back when they are due.  */
+
+static void
+replay_echo (Bench *bench, Echo *echo, int revents)
+{
+  char buf[IN_MAX], *p = buf;
+  unsigned long now = timer_now_usec ();
+  ssize_t n;
+
+  if (revents & (POLLIN | POLLHUP | POLLERR))
+    {
+      n = read (echo->fd, buf, sizeof buf);
+      if (n == 0 || (n == -1 && errno != EAGAIN))
+	{
+	  echo_close (echo);
+	  return;
+	}
+      for (; n > 0 && echo->stamp_len < sizeof echo->stamp; n--)
+	echo->stamp[echo->stamp_len++] = *p++;
+      if (echo->client == NULL && echo->stamp_len == sizeof echo->stamp)
+	{
+	  unsigned long i = ((unsigned long)echo->stamp[0] << 24)
+	    | ((unsigned long)echo->stamp[1] << 16)
+	    | (echo->stamp[2] << 8) | echo->stamp[3];
+
+	  if (i >= (unsigned long)bench->run->sessions)
+	    {
+	      echo_close (echo);
+	      return;
+	    }
+	  echo->client = &bench->clients[i];
+	  echo->client->linked = TRUE;
+	}
+      if (n > 0 && echo->client != NULL)
+	{
+	  if (bench->measuring)
+	    bench->bytes_up += n;
+	  track_arrived (bench, &echo->client->up, n, &bench->up);
+	}
+    }
+
+  while (replay_echo_wait (bench, echo, now) == 0)
+    {
+      if (echo->off == echo->len)
+	{
+	  if (echo->frame_left == 0)
+	    echo->frame_left = track_send (&echo->client->down, now);
+	  echo->len = echo->frame_left < sizeof echo->buf
+	    ? echo->frame_left : sizeof echo->buf;
+	  echo->off = 0;
+	  echo->frame_left -= echo->len;
+	}
+      n = write (echo->fd, echo->buf + echo->off, echo->len - echo->off);
+      if (n == -1)
+	{
+	  if (errno != EAGAIN)
+	    echo_close (echo);
+	  return;
+	}
+      echo->off += n;
+    }
+}
+
+static void
+echo_event (Bench *bench, Echo *echo, int revents)
+{
+  ssize_t n;
+
+  if (bench->arg->replay != NULL)
+    {
+      replay_echo (bench, echo, revents);
+      return;
+    }
+
+  if (echo->off < echo->len)
+    {
+      n = write (echo->fd, echo->buf + echo->off, echo->len - echo->off);
+      if (n == -1 && errno != EAGAIN)
+	{
+	  echo_close (echo);
+	  return;
+	}
+      if (n > 0)
+	echo->off += n;
+      if (echo->off < echo->len)
+	return;
+    }
+
+  if (!(revents & (POLLIN | POLLHUP | POLLERR)))
+    return;
+
+  n = read (echo->fd, echo->buf, sizeof echo->buf);
+  if (n == 0 || (n == -1 && errno != EAGAIN))
+    {
+      echo_close (echo);
+      return;
+    }
+  if (n == -1)
+    return;
+
+  if (bench->measuring)
+    {
+      bench->bytes_up += n;
+      if (!bench->arg->echo)
+	bench->frames += n;
+    }
+  if (bench->arg->echo)
+    {
+      echo->len = n;
+      echo->off = 0;
+      echo_event (bench, echo, 0);
+    }
+}
+
+static int
+client_socket (Client *client, int port)
+{
+  struct sockaddr_in addr;
+  int fd;
+
+  fd = socket (PF_INET, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+  set_nonblocking (fd);
+  if (bind (fd, (struct sockaddr *)&client->src, sizeof client->src) == -1)
+    {
+      /* Not every system has all of 127.0.0.0/8.  */
+      if (errno != EADDRNOTAVAIL
+	  || client->src.sin_addr.s_addr == htonl (INADDR_LOOPBACK))
+	{
+	  close (fd);
+	  return -1;
+	}
+      client->src.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+      close (fd);
+      return client_socket (client, port);
+    }
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addr.sin_port = htons (port);
+  if (connect (fd, (struct sockaddr *)&addr, sizeof addr) == -1
+      && errno != EINPROGRESS)
+    {
+      close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+static void
+client_out (Client *client, const void *data, size_t len)
+{
+  memcpy (client->out + client->out_len, data, len);
+  client->out_len += len;
+}
+
+static void
+put_connect (Bench *bench, Client *client)
+{
+  char header[256];
+  int n;
+
+  client->put_fd = client_socket (client, bench->entry_port);
+  if (client->put_fd == -1)
+    {
+      client->put_retry = timer_now () + RETRY_MSEC;
+      return;
+    }
+  client->put_state = CONN_CONNECTING;
+  client->put_done = FALSE;
+  client->put_left = bench->run->content_length - 1;
+  client->out_len = client->out_off = 0;
+
+  n = sprintf (header, "PUT /index.html?crap=%lu HTTP/1.1\r\n"
+	       "Host: 127.0.0.1:%d\r\n"
+	       "Content-Length: %d\r\n"
+	       "Connection: close\r\n\r\n",
+	       timer_now_usec (), bench->port, bench->run->content_length);
+  client_out (client, header, n);
+  if (!client->opened)
+    {
+      static const char open[3] = { TUNNEL_OPEN, 0, 0 };
+
+      client_out (client, open, sizeof open);
+      client->put_left -= sizeof open;
+      client->opened = TRUE;
+
+      /* Tell the server end of a replay whose connection it gets.  */
+      if (bench->arg->replay != NULL)
+	{
+	  unsigned long i = client - bench->clients;
+	  unsigned char stamp[7];
+
+	  stamp[0] = TUNNEL_DATA;
+	  stamp[1] = 0;
+	  stamp[2] = 4;
+	  stamp[3] = (i >> 24) & 0xff;
+	  stamp[4] = (i >> 16) & 0xff;
+	  stamp[5] = (i >> 8) & 0xff;
+	  stamp[6] = i & 0xff;
+	  client_out (client, stamp, sizeof stamp);
+	  client->put_left -= sizeof stamp;
+	}
+    }
+}
+
+/* End the PUT request: fill Content-Length, so that it holds with or
+   without --strict, and disconnect.  */
+
+static void
+put_finish (Client *client)
+{
+  char pad = TUNNEL_PAD1;
+  char disconnect = TUNNEL_DISCONNECT;
+
+  while (client->put_left > 0)
+    {
+      client_out (client, &pad, 1);
+      client->put_left--;
+    }
+  client_out (client, &disconnect, 1);
+  client->put_done = TRUE;
+}
+
+/* Queue LEN bytes of payload in as many DATA requests as the PUT
+   request has room for.  Returns the number of bytes queued.  */
+
+static size_t
+put_data (Client *client, size_t len)
+{
+  size_t done = 0;
+
+  while (done < len && !client->put_done)
+    {
+      unsigned char head[3];
+      size_t n = len - done;
+
+      if (client->put_left < 4)
+	{
+	  put_finish (client);
+	  break;
+	}
+      if ((long)n > client->put_left - 3)
+	n = client->put_left - 3;
+      if (n > 65535)
+	n = 65535;
+      head[0] = TUNNEL_DATA;
+      head[1] = n >> 8;
+      head[2] = n & 0xff;
+      client_out (client, head, 3);
+      client_out (client, payload, n);
+      client->put_left -= 3 + n;
+      done += n;
+    }
+  return done;
+}
+
+/* Whether a replaying CLIENT has anything to queue: as for
+   track_wait ().  */
+
+static long
+replay_put_wait (Bench *bench, Client *client, unsigned long now)
+{
+  if (client->frame_left > 0)
+    return 0;
+  return track_wait (bench, &client->up, now);
+}
+
+/* Queue the frames of a replayed session that are due.  */
+
+static void
+replay_fill (Bench *bench, Client *client)
+{
+  unsigned long now = timer_now_usec ();
+
+  while (client->put_state == CONN_OPEN && !client->put_done
+	 && client->out_len + IN_MAX + 64 < OUT_MAX
+	 && replay_put_wait (bench, client, now) == 0)
+    {
+      size_t n;
+
+      if (client->frame_left == 0)
+	client->frame_left = track_send (&client->up, now);
+      n = client->frame_left < IN_MAX ? client->frame_left : IN_MAX;
+      n = put_data (client, n);
+      client->sent += n;
+      client->frame_left -= n;
+    }
+}
+
+/* Queue frames while there's room and the round trips allow.  A frame
+   which doesn't fit in one PUT request is continued in the next.  */
+
+static void
+client_fill (Bench *bench, Client *client)
+{
+  size_t frame = bench->run->frame_size;
+
+  if (client->up.frame != NULL)
+    {
+      replay_fill (bench, client);
+      return;
+    }
+
+  while (client->put_state == CONN_OPEN && !client->put_done
+	 && client->out_len + frame + 64 < OUT_MAX)
+    {
+      if (client->frame_left == 0)
+	{
+	  if (bench->arg->echo)
+	    {
+	      int next = (client->ihead + 1) % (bench->arg->inflight + 1);
+
+	      if (next == client->itail)
+		break;
+	      client->ends[client->ihead] = client->sent + frame;
+	      client->times[client->ihead] = timer_now_usec ();
+	      client->ihead = next;
+	    }
+	  client->frame_left = frame;
+	}
+
+      frame = put_data (client, client->frame_left);
+      client->sent += frame;
+      client->frame_left -= frame;
+      frame = bench->run->frame_size;
+    }
+}
+
+static void
+put_close (Client *client)
+{
+  if (client->put_fd != -1)
+    close (client->put_fd);
+  client->put_fd = -1;
+  client->put_state = CONN_IDLE;
+  client->put_retry = timer_now ();
+}
+
+static void
+put_event (Bench *bench, Client *client, int revents)
+{
+  ssize_t n;
+
+  if (client->put_state == CONN_CONNECTING)
+    {
+      int error = 0;
+      socklen_t len = sizeof error;
+
+      if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+	return;
+      if (getsockopt (client->put_fd, SOL_SOCKET, SO_ERROR,
+		      &error, &len) == -1 || error != 0)
+	{
+	  /* hts may not listen yet.  */
+	  put_close (client);
+	  client->put_retry = timer_now () + RETRY_MSEC;
+	  client->opened = FALSE;
+	  return;
+	}
+      client->put_state = CONN_OPEN;
+    }
+
+  /* hts may answer the PUT.  Nothing in the answer matters.  */
+  if (revents & POLLIN)
+    {
+      char buf[4096];
+
+      n = read (client->put_fd, buf, sizeof buf);
+      if (n == 0 || (n == -1 && errno != EAGAIN))
+	{
+	  put_close (client);
+	  return;
+	}
+    }
+
+  client_fill (bench, client);
+  if (client->out_off < client->out_len)
+    {
+      n = write (client->put_fd, client->out + client->out_off,
+		 client->out_len - client->out_off);
+      if (n == -1 && errno != EAGAIN)
+	{
+	  put_close (client);
+	  return;
+	}
+      if (n > 0)
+	{
+	  client->out_off += n;
+	  client->announced = client->opened;
+	}
+    }
+  if (client->out_off == client->out_len)
+    {
+      client->out_off = client->out_len = 0;
+      if (client->put_done)
+	put_close (client);
+    }
+}
+
+static void
+get_connect (Bench *bench, Client *client)
+{
+  client->get_fd = client_socket (client, bench->entry_port);
+  if (client->get_fd == -1)
+    {
+      client->get_retry = timer_now () + RETRY_MSEC;
+      return;
+    }
+  client->get_state = CONN_CONNECTING;
+  client->in_len = 0;
+  client->req = 0;
+}
+
+static void
+get_close (Client *client)
+{
+  if (client->get_fd != -1)
+    close (client->get_fd);
+  client->get_fd = -1;
+  client->get_state = CONN_IDLE;
+  client->get_retry = timer_now ();
+}
+
+static void
+client_received (Bench *bench, Client *client, size_t n)
+{
+  unsigned long now = timer_now_usec ();
+
+  client->received += n;
+  if (bench->measuring)
+    bench->bytes_down += n;
+
+  while (client->itail != client->ihead
+	 && client->ends[client->itail] <= client->received)
+    {
+      if (bench->measuring)
+	{
+	  sample_add (&bench->rtt, now - client->times[client->itail]);
+	  bench->frames++;
+	}
+      client->itail = (client->itail + 1) % (bench->arg->inflight + 1);
+    }
+  if (client->down.frame != NULL)
+    track_arrived (bench, &client->down, n, &bench->down);
+}
+
+/* Parse the requests in a GET reply.  Returns FALSE when the reply is
+   over.  */
+
+static int
+get_parse (Bench *bench, Client *client, unsigned char *p, size_t len)
+{
+  while (len > 0)
+    {
+      size_t n;
+
+      if (client->body_left == 0)
+	return FALSE;
+
+      if (client->req == 0)
+	{
+	  size_t head;
+
+	  if (p[0] & TUNNEL_SIMPLE)
+	    {
+	      client->body_left--;
+	      if (p[0] == TUNNEL_DISCONNECT)
+		return FALSE;
+	      if (p[0] == TUNNEL_CLOSE)
+		{
+		  bench->failed = TRUE;
+		  return FALSE;
+		}
+	      p++;
+	      len--;
+	      continue;
+	    }
+
+	  head = p[0] == TUNNEL_JDATA ? 5 : 3;
+	  if (len < head)
+	    {
+	      /* Keep the partial header for the next read.  */
+	      memmove (client->in, p, len);
+	      client->in_len = len;
+	      return TRUE;
+	    }
+	  client->req = p[0];
+	  if (head == 5)
+	    client->req_left = ((unsigned long)p[1] << 24)
+	      | ((unsigned long)p[2] << 16) | (p[3] << 8) | p[4];
+	  else
+	    client->req_left = (p[1] << 8) | p[2];
+	  client->body_left -= head;
+	  p += head;
+	  len -= head;
+	  continue;
+	}
+
+      n = len < client->req_left ? len : client->req_left;
+      if (client->req == TUNNEL_DATA || client->req == TUNNEL_JDATA)
+	client_received (bench, client, n);
+      client->req_left -= n;
+      client->body_left -= n;
+      if (client->req_left == 0)
+	client->req = 0;
+      p += n;
+      len -= n;
+    }
+
+  client->in_len = 0;
+  return client->body_left != 0;
+}
+
+static void
+get_event (Bench *bench, Client *client, int revents)
+{
+  ssize_t n;
+
+  if (client->get_state == CONN_CONNECTING)
+    {
+      char request[256];
+      int error = 0;
+      socklen_t len = sizeof error;
+
+      if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+	return;
+      if (getsockopt (client->get_fd, SOL_SOCKET, SO_ERROR,
+		      &error, &len) == -1 || error != 0)
+	{
+	  get_close (client);
+	  client->get_retry = timer_now () + RETRY_MSEC;
+	  return;
+	}
+      n = sprintf (request, "GET /index.html?crap=%lu HTTP/1.1\r\n"
+		   "Host: 127.0.0.1:%d\r\n"
+		   "Connection: close\r\n\r\n",
+		   timer_now_usec (), bench->port);
+      if (write (client->get_fd, request, n) != n)
+	{
+	  get_close (client);
+	  return;
+	}
+      client->get_state = CONN_HEADERS;
+      return;
+    }
+
+  if (!(revents & (POLLIN | POLLHUP | POLLERR)))
+    return;
+
+  n = read (client->get_fd, client->in + client->in_len,
+	    IN_MAX - client->in_len);
+  if (n == 0 || (n == -1 && errno != EAGAIN))
+    {
+      get_close (client);
+      return;
+    }
+  if (n == -1)
+    return;
+  client->in_len += n;
+
+  if (client->get_state == CONN_HEADERS)
+    {
+      char *end, *line;
+
+      client->in[client->in_len] = 0;
+      end = strstr (client->in, "\r\n\r\n");
+      if (end == NULL)
+	{
+	  if (client->in_len == IN_MAX)
+	    get_close (client);
+	  return;
+	}
+      *end = 0;
+      client->body_left = -1;
+      for (line = strstr (client->in, "\r\n"); line != NULL;
+	   line = strstr (line, "\r\n"))
+	{
+	  line += 2;
+	  if (strncasecmp (line, "Content-Length:", 15) == 0)
+	    client->body_left = atol (line + 15);
+	}
+      client->get_state = CONN_OPEN;
+      end += 4;
+      n = client->in + client->in_len - end;
+      memmove (client->in, end, n);
+      client->in_len = n;
+    }
+
+  if (!get_parse (bench, client, (unsigned char *)client->in,
+		  client->in_len))
+    get_close (client);
+}
+
+static void
+proxy_close (Proxy *proxy)
+{
+  int i;
+
+  for (i = 0; i < 2; i++)
+    {
+      Flow *flow = &proxy->flow[i];
+
+      if (proxy->fd[i] != -1)
+	close (proxy->fd[i]);
+      proxy->fd[i] = -1;
+      while (flow->head != NULL)
+	{
+	  Chunk *chunk = flow->head;
+
+	  flow->head = chunk->next;
+	  free (chunk);
+	}
+    }
+}
+
+static void
+proxy_accept (Bench *bench)
+{
+  struct sockaddr_in src, addr;
+  socklen_t len = sizeof src;
+  Proxy *proxy = NULL;
+  int fd, i;
+
+  fd = accept (bench->proxy_fd, (struct sockaddr *)&src, &len);
+  if (fd == -1)
+    return;
+  for (i = 0; i < bench->nproxies; i++)
+    if (bench->proxies[i].fd[0] == -1)
+      {
+	proxy = &bench->proxies[i];
+	break;
+      }
+  if (proxy == NULL)
+    {
+      close (fd);
+      return;
+    }
+
+  memset (proxy, 0, sizeof *proxy);
+  proxy->fd[0] = fd;
+  proxy->fd[1] = socket (PF_INET, SOCK_STREAM, 0);
+  proxy->connecting = TRUE;
+  set_nonblocking (fd);
+  if (proxy->fd[1] == -1)
+    {
+      proxy_close (proxy);
+      return;
+    }
+  set_nonblocking (proxy->fd[1]);
+
+  /* Connect from the client's address, so that hts can still tell
+     the sessions apart.  */
+  src.sin_port = 0;
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addr.sin_port = htons (bench->port);
+  if (bind (proxy->fd[1], (struct sockaddr *)&src, sizeof src) == -1
+      || (connect (proxy->fd[1], (struct sockaddr *)&addr, sizeof addr) == -1
+	  && errno != EINPROGRESS))
+    proxy_close (proxy);
+}
+
+/* How many microseconds until FLOW, going to hts if I is 0 or back if
+   1, may pass something on: 0 if it may now, or -1 if it has nothing
+   to pass on.  */
+
+static long
+proxy_wait (Bench *bench, Flow *flow, int i, unsigned long now)
+{
+  Bucket *bucket = &bench->bucket[i];
+  int rate = bench->run->proxy_rate;
+  long add;
+
+  if (flow->ready == 0)
+    return -1;
+  if ((long)(flow->head->due - now) > 0)
+    return flow->head->due - now;
+  if (rate == 0)
+    return 0;
+
+  /* Up to a tenth of a second's worth may go at once.  */
+  add = (long)((double)(long)(now - bucket->refilled) * rate / 1e6);
+  if (add > 0)
+    {
+      /* Rounding up, so that it's never too generous.  */
+      bucket->tokens += add;
+      bucket->refilled += (unsigned long)add * 1000000UL / rate + 1;
+      if (bucket->tokens > rate / 10 + 1)
+	{
+	  bucket->tokens = rate / 10 + 1;
+	  bucket->refilled = now;
+	}
+    }
+  if (bucket->tokens > 0)
+    return 0;
+  return (long)((1 - bucket->tokens) * 1e6 / rate) + 1;
+}
+
+/* Whether FLOW holds as much as the proxy takes in.  Like a real one,
+   only a storing proxy takes in more than it has passed on, plus what
+   is on its way under --proxy-delay, so senders feel the limits.  */
+
+static int
+proxy_full (Bench *bench, Flow *flow)
+{
+  Run *run = bench->run;
+  size_t max = PROXY_QUEUE_MAX;
+
+  if (!bench->arg->proxy_store
+      && (run->proxy_rate > 0 || run->proxy_delay == 0))
+    max = run->proxy_buffer + IN_MAX
+      + (size_t)run->proxy_rate * run->proxy_delay / 1000;
+  return flow->queued >= max;
+}
+
+static int
+proxy_read (Bench *bench, Proxy *proxy, int i)
+{
+  Flow *flow = &proxy->flow[i];
+  char buf[IN_MAX];
+  Chunk *chunk;
+  ssize_t n;
+
+  n = read (proxy->fd[i], buf, sizeof buf);
+  if (n == -1)
+    return errno == EAGAIN ? 0 : -1;
+
+  if (n == 0)
+    flow->eof = TRUE;
+  else
+    {
+      chunk = malloc (sizeof *chunk + n);
+      if (chunk == NULL)
+	return -1;
+      chunk->next = NULL;
+      chunk->due = timer_now_usec () + 1000UL * bench->run->proxy_delay;
+      chunk->len = n;
+      chunk->off = 0;
+      memcpy (chunk->data, buf, n);
+      if (flow->tail != NULL)
+	flow->tail->next = chunk;
+      else
+	flow->head = chunk;
+      flow->tail = chunk;
+      flow->queued += n;
+    }
+
+  /* A buffering proxy lets data through in blocks.  */
+  if (flow->eof
+      || (!bench->arg->proxy_store
+	  && flow->queued - flow->ready >= (size_t)bench->run->proxy_buffer))
+    flow->ready = flow->queued;
+  return 0;
+}
+
+static int
+proxy_send (Bench *bench, Proxy *proxy, int i)
+{
+  Flow *flow = &proxy->flow[i];
+  Bucket *bucket = &bench->bucket[i];
+  int fd = proxy->fd[1 - i];
+
+  while (proxy_wait (bench, flow, i, timer_now_usec ()) == 0)
+    {
+      Chunk *chunk = flow->head;
+      size_t n = chunk->len - chunk->off;
+      ssize_t m;
+
+      if (n > flow->ready)
+	n = flow->ready;
+      if (bench->run->proxy_rate > 0 && n > (size_t)bucket->tokens)
+	n = bucket->tokens;
+      m = write (fd, chunk->data + chunk->off, n);
+      if (m == -1)
+	return errno == EAGAIN ? 0 : -1;
+
+      chunk->off += m;
+      flow->queued -= m;
+      flow->ready -= m;
+      bucket->tokens -= m;
+      if (chunk->off == chunk->len)
+	{
+	  flow->head = chunk->next;
+	  if (flow->head == NULL)
+	    flow->tail = NULL;
+	  free (chunk);
+	}
+    }
+
+  if (flow->eof && flow->queued == 0 && !flow->shut)
+    {
+      shutdown (fd, SHUT_WR);
+      flow->shut = TRUE;
+    }
+  return 0;
+}
+
+static void
+proxy_event (Bench *bench, Proxy *proxy, int side, int revents)
+{
+  Flow *flow = &proxy->flow[side];
+  int i;
+
+  if (side == 1 && proxy->connecting)
+    {
+      int error = 0;
+      socklen_t len = sizeof error;
+
+      if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+	return;
+      if (getsockopt (proxy->fd[1], SOL_SOCKET, SO_ERROR,
+		      &error, &len) == -1 || error != 0)
+	{
+	  proxy_close (proxy);
+	  return;
+	}
+      proxy->connecting = FALSE;
+    }
+
+  if ((revents & (POLLIN | POLLHUP | POLLERR)) && !flow->eof
+      && !proxy_full (bench, flow)
+      && proxy_read (bench, proxy, side) == -1)
+    {
+      proxy_close (proxy);
+      return;
+    }
+
+  if (!proxy->connecting)
+    for (i = 0; i < 2; i++)
+      if (proxy_send (bench, proxy, i) == -1)
+	{
+	  proxy_close (proxy);
+	  return;
+	}
+
+  if (proxy->flow[0].shut && proxy->flow[1].shut)
+    proxy_close (proxy);
+}
+
+static int
+bench_started (Bench *bench)
+{
+  int i;
+
+  /* Echoed data shows that the whole path is up.  */
+  for (i = 0; i < bench->run->sessions; i++)
+    if (bench->clients[i].get_state != CONN_OPEN
+	|| (bench->arg->echo && bench->clients[i].received == 0)
+	|| (bench->arg->replay != NULL && !bench->clients[i].linked))
+      return FALSE;
+  return TRUE;
+}
+
+static int
+replay_done (Bench *bench)
+{
+  int i;
+
+  for (i = 0; i < bench->run->sessions; i++)
+    {
+      Client *client = &bench->clients[i];
+
+      if (client->up.done < client->up.n
+	  || client->down.done < client->down.n)
+	return FALSE;
+    }
+  return TRUE;
+}
+
+static int
+compare_ulong (const void *a, const void *b)
+{
+  unsigned long x = *(const unsigned long *)a;
+  unsigned long y = *(const unsigned long *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void
+report_samples (const char *name, Samples *samples)
+{
+  size_t n = samples->n;
+
+  if (n == 0)
+    {
+      printf ("\"%s_samples\":0,\"%s_p50_usec\":null,"
+	      "\"%s_p99_usec\":null", name, name, name);
+      return;
+    }
+  qsort (samples->usec, n, sizeof *samples->usec, compare_ulong);
+  printf ("\"%s_samples\":%lu,\"%s_p50_usec\":%lu,\"%s_p99_usec\":%lu",
+	  name, (unsigned long)n, name, samples->usec[n / 2],
+	  name, samples->usec[(size_t)(n * 0.99)]);
+}
+
+static void
+bench_report (Bench *bench, double seconds, double cpu)
+{
+  Arguments *arg = bench->arg;
+  Run *run = bench->run;
+  unsigned long bytes = bench->bytes_up + bench->bytes_down;
+  unsigned long frames = bench->frames;
+
+  printf ("{\"mode\":\"%s\",\"sessions\":%d,\"content_length\":%d,"
+	  "\"strict\":%s,\"keep_alive\":%d,\"frame_size\":%d,",
+	  arg->replay != NULL ? "replay" : arg->echo ? "echo" : "sink",
+	  run->sessions, run->content_length, run->strict ? "true" : "false",
+	  run->keep_alive, run->frame_size);
+  if (arg->proxy)
+    printf ("\"proxy\":{\"buffer\":%d,\"store\":%s,\"delay_msec\":%d,"
+	    "\"rate\":%d},", run->proxy_buffer,
+	    arg->proxy_store ? "true" : "false",
+	    run->proxy_delay, run->proxy_rate);
+  else
+    printf ("\"proxy\":null,");
+  if (arg->replay != NULL)
+    printf ("\"replay_speed\":%d,", run->replay_speed);
+  if (bench->failed)
+    {
+      printf ("\"error\":\"tunnel %s\"}\n",
+	      bench->stalled ? "stalled" : "failed");
+      fflush (stdout);
+      return;
+    }
+
+  if (arg->replay == NULL && !arg->echo)
+    frames /= run->frame_size;
+  printf ("\"seconds\":%.3f,\"bytes\":%lu,\"mb_per_s\":%.3f,"
+	  "\"frames_per_s\":%.1f,",
+	  seconds, bytes, bytes / seconds / 1e6, frames / seconds);
+  if (cpu >= 0 && bytes > 0)
+    printf ("\"cpu_sec_per_gb\":%.3f,", cpu / (bytes / 1e9));
+  else
+    printf ("\"cpu_sec_per_gb\":null,");
+
+  if (arg->replay != NULL)
+    {
+      printf ("\"frames\":%lu,\"lost\":%lu,",
+	      bench->frames, arg->replay->frames - bench->frames);
+      report_samples ("up", &bench->up);
+      printf (",");
+      report_samples ("down", &bench->down);
+    }
+  else
+    report_samples ("rtt", &bench->rtt);
+  printf ("}\n");
+  fflush (stdout);
+}
+
+/* One run.  Warm up until every session has had data back, then
+   measure for --duration seconds, or until the replay is over.  A
+   run that made up its traffic fails if it stops moving for
+   STALL_MSEC, which is what a session hts never resumes looks like.
+   Returns whether the run failed.  */
+
+static int
+bench_run (Arguments *arg, Run *run, int port)
+{
+  Bench bench;
+  int nproxies = arg->proxy ? 4 * run->sessions + 8 : 0;
+  int nfds = 2 + 2 * run->sessions + run->sessions + 8 + 2 * nproxies;
+  unsigned long deadline, end_usec = 0;
+  unsigned long moved = 0, progress = 0;
+  double cpu_start = -1, cpu_end;
+  int i;
+
+  memset (&bench, 0, sizeof bench);
+  bench.echo_fd = bench.proxy_fd = -1;
+  bench.arg = arg;
+  bench.run = run;
+  bench.port = bench.entry_port = port;
+  bench.nechoes = run->sessions + 8;
+  bench.echoes = calloc (bench.nechoes, sizeof *bench.echoes);
+  bench.clients = calloc (run->sessions, sizeof *bench.clients);
+  bench.pfd = malloc (nfds * sizeof *bench.pfd);
+  bench.who = malloc (nfds * sizeof *bench.who);
+  bench.nproxies = nproxies;
+  bench.proxies = calloc (nproxies + 1, sizeof *bench.proxies);
+  for (i = 0; i < bench.nechoes; i++)
+    bench.echoes[i].fd = -1;
+  for (i = 0; i < nproxies; i++)
+    bench.proxies[i].fd[0] = bench.proxies[i].fd[1] = -1;
+  for (i = 0; i < 2; i++)
+    {
+      bench.bucket[i].tokens = run->proxy_rate / 10 + 1;
+      bench.bucket[i].refilled = timer_now_usec ();
+    }
+
+  if (arg->proxy
+      && (bench.proxy_fd = listen_loopback (&bench.entry_port)) == -1)
+    {
+      fprintf (stderr, "%s: couldn't start proxy: %s\n",
+	       arg->me, strerror (errno));
+      bench.failed = TRUE;
+      bench_report (&bench, 0, -1);
+      goto out;
+    }
+  if (echo_listen (&bench) == -1 || hts_start (&bench) == -1)
+    {
+      fprintf (stderr, "%s: couldn't start: %s\n", arg->me, strerror (errno));
+      bench.failed = TRUE;
+      bench_report (&bench, 0, -1);
+      goto out;
+    }
+
+  for (i = 0; i < run->sessions; i++)
+    {
+      Client *client = &bench.clients[i];
+
+      client->src.sin_family = AF_INET;
+      client->src.sin_addr.s_addr = htonl (INADDR_LOOPBACK + 1 + i);
+      client->put_fd = client->get_fd = -1;
+      client->out = malloc (OUT_MAX);
+      client->in = malloc (IN_MAX + 1);
+      client->ends = malloc ((arg->inflight + 1) * sizeof *client->ends);
+      client->times = malloc ((arg->inflight + 1) * sizeof *client->times);
+      if (arg->replay != NULL)
+	{
+	  ReplaySession *session = &arg->replay->session[i];
+
+	  track_init (&client->up, session->up, session->nup);
+	  track_init (&client->down, session->down, session->ndown);
+	}
+    }
+
+  deadline = timer_now () + START_TIMEOUT_MSEC;
+  for (;;)
+    {
+      unsigned long now = timer_now ();
+      unsigned long usec = timer_now_usec ();
+      int timeout = RETRY_MSEC;
+      int n = 0;
+
+      if (!bench.measuring && bench_started (&bench))
+	{
+	  bench.measuring = TRUE;
+	  bench.start_usec = timer_now_usec ();
+	  end_usec = bench.start_usec + 1000000UL * arg->duration;
+	  if (arg->replay != NULL)
+	    end_usec = bench.start_usec + 1000UL * REPLAY_GRACE_MSEC
+	      + (run->replay_speed > 0
+		 ? arg->replay->usec / run->replay_speed : 0);
+	  cpu_start = process_cpu (bench.hts);
+	  progress = now;
+	}
+      if (bench.measuring && ((long)(timer_now_usec () - end_usec) >= 0
+			      || (arg->replay != NULL
+				  && replay_done (&bench))))
+	break;
+      if (bench.failed || (!bench.measuring && (long)(now - deadline) >= 0))
+	{
+	  bench.failed = TRUE;
+	  break;
+	}
+      if (bench.measuring && arg->replay == NULL)
+	{
+	  if (bench.bytes_up + bench.bytes_down != moved)
+	    {
+	      moved = bench.bytes_up + bench.bytes_down;
+	      progress = now;
+	    }
+	  else if ((long)(now - progress) >= STALL_MSEC)
+	    {
+	      fprintf (stderr, "%s: no data for %d ms\n", arg->me, STALL_MSEC);
+	      bench.failed = bench.stalled = TRUE;
+	      break;
+	    }
+	}
+
+      bench.pfd[n].fd = bench.echo_fd;
+      bench.pfd[n].events = POLLIN;
+      bench.who[n++] = -1;
+      for (i = 0; i < bench.nechoes; i++)
+	if (bench.echoes[i].fd != -1)
+	  {
+	    Echo *echo = &bench.echoes[i];
+
+	    bench.pfd[n].fd = echo->fd;
+	    bench.pfd[n].events = echo->off < echo->len ? POLLOUT : POLLIN;
+	    if (arg->replay != NULL)
+	      {
+		long wait = replay_echo_wait (&bench, echo, usec);
+
+		bench.pfd[n].events = POLLIN | (wait == 0 ? POLLOUT : 0);
+		wait_timeout (&timeout, wait);
+	      }
+	    bench.who[n++] = 2 * run->sessions + i;
+	  }
+      if (bench.proxy_fd != -1)
+	{
+	  bench.pfd[n].fd = bench.proxy_fd;
+	  bench.pfd[n].events = POLLIN;
+	  bench.who[n++] = -2;
+	  for (i = 0; i < 2 * nproxies; i++)
+	    {
+	      Proxy *proxy = &bench.proxies[i / 2];
+	      int side = i % 2;
+	      Flow *flow = &proxy->flow[side];
+	      long wait;
+
+	      if (proxy->fd[side] == -1)
+		continue;
+	      bench.pfd[n].fd = proxy->fd[side];
+	      bench.pfd[n].events = 0;
+	      if (side == 1 && proxy->connecting)
+		bench.pfd[n].events = POLLOUT;
+	      else
+		{
+		  if (!flow->eof && !proxy_full (&bench, flow))
+		    bench.pfd[n].events |= POLLIN;
+
+		  /* Held data is sent when it's due, or the socket
+		     has room.  */
+		  wait = proxy_wait (&bench, &proxy->flow[1 - side],
+				     1 - side, usec);
+		  if (wait == 0)
+		    bench.pfd[n].events |= POLLOUT;
+		  wait_timeout (&timeout, wait);
+		}
+	      bench.who[n++] = 2 * run->sessions + bench.nechoes + i;
+	    }
+	}
+      for (i = 0; i < run->sessions; i++)
+	{
+	  Client *client = &bench.clients[i];
+
+	  if (client->put_state == CONN_IDLE
+	      && (long)(now - client->put_retry) >= 0)
+	    put_connect (&bench, client);
+	  if (client->get_state == CONN_IDLE && client->announced
+	      && (long)(now - client->get_retry) >= 0)
+	    get_connect (&bench, client);
+
+	  if (client->put_fd != -1)
+	    {
+	      long wait = 0;
+
+	      /* A replay has something to write only when it's due.  */
+	      if (arg->replay != NULL)
+		{
+		  wait = replay_put_wait (&bench, client, usec);
+		  wait_timeout (&timeout, wait);
+		}
+	      bench.pfd[n].fd = client->put_fd;
+	      bench.pfd[n].events = POLLIN;
+	      if (client->put_state == CONN_CONNECTING
+		  || client->out_off < client->out_len
+		  || (!client->put_done && wait == 0))
+		bench.pfd[n].events |= POLLOUT;
+	      bench.who[n++] = 2 * i;
+	    }
+	  if (client->get_fd != -1)
+	    {
+	      bench.pfd[n].fd = client->get_fd;
+	      bench.pfd[n].events = client->get_state == CONN_CONNECTING
+		? POLLOUT : POLLIN;
+	      bench.who[n++] = 2 * i + 1;
+	    }
+	}
+
+      if (poll (bench.pfd, n, timeout) == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  break;
+	}
+
+      for (i = 0; i < n; i++)
+	{
+	  int who = bench.who[i];
+	  int revents = bench.pfd[i].revents;
+
+	  if (revents == 0)
+	    continue;
+	  if (who == -1)
+	    echo_accept (&bench);
+	  else if (who == -2)
+	    proxy_accept (&bench);
+	  else if (who >= 2 * run->sessions + bench.nechoes)
+	    {
+	      Proxy *proxy;
+
+	      who -= 2 * run->sessions + bench.nechoes;
+	      proxy = &bench.proxies[who / 2];
+
+	      /* Unless closed by an earlier entry.  */
+	      if (proxy->fd[who % 2] == bench.pfd[i].fd)
+		proxy_event (&bench, proxy, who % 2, revents);
+	    }
+	  else if (who >= 2 * run->sessions)
+	    echo_event (&bench, &bench.echoes[who - 2 * run->sessions],
+			revents);
+	  else if (who % 2 == 0)
+	    put_event (&bench, &bench.clients[who / 2], revents);
+	  else
+	    get_event (&bench, &bench.clients[who / 2], revents);
+	}
+    }
+
+  cpu_end = process_cpu (bench.hts);
+  bench_report (&bench, (timer_now_usec () - bench.start_usec) / 1e6,
+		cpu_start >= 0 && cpu_end >= 0 ? cpu_end - cpu_start : -1);
+
+  for (i = 0; i < run->sessions; i++)
+    {
+      Client *client = &bench.clients[i];
+
+      put_close (client);
+      get_close (client);
+      free (client->out);
+      free (client->in);
+      free (client->ends);
+      free (client->times);
+      track_free (&client->up);
+      track_free (&client->down);
+    }
+
+ out:
+  for (i = 0; i < nproxies; i++)
+    proxy_close (&bench.proxies[i]);
+  if (bench.proxy_fd != -1)
+    close (bench.proxy_fd);
+  hts_stop (&bench);
+  for (i = 0; i < bench.nechoes; i++)
+    if (bench.echoes[i].fd != -1)
+      close (bench.echoes[i].fd);
+  if (bench.echo_fd != -1)
+    close (bench.echo_fd);
+  free (bench.echoes);
+  free (bench.clients);
+  free (bench.proxies);
+  free (bench.pfd);
+  free (bench.who);
+  free (bench.rtt.usec);
+  free (bench.up.usec);
+  free (bench.down.usec);
+  return bench.failed;
+}
+
+int
+main (int argc, char **argv)
+{
+  Arguments arg;
+  Run run;
+  List *list[9];
+  int *value[9];
+  int which[9];
+  int i, n = 0;
+  int port, failed = 0;
+
+  parse_arguments (argc, argv, &arg);
+  signal (SIGPIPE, SIG_IGN);
+  memset (payload, 'x', sizeof payload);
+
+  /* Every combination of the swept parameters, the last one
+     changing fastest.  */
+#define SWEEP(name) \
+  (list[n] = &arg.name, value[n] = &run.name, which[n++] = 0)
+  SWEEP (sessions);
+  SWEEP (content_length);
+  SWEEP (strict);
+  SWEEP (keep_alive);
+  SWEEP (frame_size);
+  SWEEP (proxy_buffer);
+  SWEEP (proxy_delay);
+  SWEEP (proxy_rate);
+  SWEEP (replay_speed);
+#undef SWEEP
+
+  port = arg.port;
+  do
+    {
+      for (i = 0; i < n; i++)
+	*value[i] = list[i]->value[which[i]];
+      fprintf (stderr, "%s: %d sessions, content length %d%s, "
+	       "keep-alive %d, frames of %d bytes", arg.me,
+	       run.sessions, run.content_length,
+	       run.strict ? " (strict)" : "", run.keep_alive,
+	       run.frame_size);
+      if (arg.proxy)
+	fprintf (stderr, ", proxy buffer %d%s, delay %d, rate %d",
+		 run.proxy_buffer, arg.proxy_store ? " (store)" : "",
+		 run.proxy_delay, run.proxy_rate);
+      if (arg.replay != NULL && run.replay_speed > 0)
+	fprintf (stderr, ", replay at %d times real time", run.replay_speed);
+      else if (arg.replay != NULL)
+	fprintf (stderr, ", replay as fast as possible");
+      fprintf (stderr, "\n");
+      failed += bench_run (&arg, &run, port++);
+
+      for (i = n - 1; i >= 0 && ++which[i] == list[i]->n; i--)
+	which[i] = 0;
+    }
+  while (i >= 0);
+
+  replay_free (arg.replay);
+  return failed > 0;
+}
@@ -0,0 +1,471 @@
+/*
+event.c
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+*/
+
+#include <stdlib.h>
+#include <unistd_.h>
+
+#include "common.h"
+#include "event.h"
+
+#if defined HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#define EVENT_EPOLL
+#elif defined HAVE_KQUEUE
+#include <sys/event.h>
+#define EVENT_KQUEUE
+#endif
+
+typedef struct
+{
+  int events;			/* 0 if FD isn't registered */
+  void *data;
+  int index;			/* position in the poll () array */
+} Registration;
+
+struct event_loop
+{
+  int fd;			/* epoll or kqueue descriptor */
+  Registration *reg;		/* indexed by file descriptor */
+  int nreg;
+#if defined EVENT_EPOLL
+  struct epoll_event *ready;
+#elif defined EVENT_KQUEUE
+  struct kevent *ready;
+#else
+  struct pollfd *pollfd;
+  int npollfd;
+#endif
+  int nready;
+};
+
+static Registration *
+registration (EventLoop *loop, int fd, int grow)
+{
+  if (fd < 0)
+    {
+      errno = EBADF;
+      return NULL;
+    }
+
+  if (fd >= loop->nreg)
+    {
+      Registration *reg;
+      int n, i;
+
+      if (!grow)
+	return NULL;
+
+      n = loop->nreg ? loop->nreg : 64;
+      while (n <= fd)
+	n *= 2;
+      reg = realloc (loop->reg, n * sizeof *reg);
+      if (reg == NULL)
+	return NULL;
+      for (i = loop->nreg; i < n; i++)
+	{
+	  reg[i].events = 0;
+	  reg[i].data = NULL;
+	  reg[i].index = -1;
+	}
+      loop->reg = reg;
+      loop->nreg = n;
+    }
+
+  return &loop->reg[fd];
+}
+
+/* Make room for reporting at least N ready descriptors at once.  */
+
+static int
+grow_ready (EventLoop *loop, int n)
+{
+  void *p;
+
+  if (n <= loop->nready)
+    return 0;
+
+#if defined EVENT_EPOLL || defined EVENT_KQUEUE
+  p = realloc (loop->ready, n * sizeof *loop->ready);
+  if (p == NULL)
+    return -1;
+  loop->ready = p;
+#else
+  p = realloc (loop->pollfd, n * sizeof *loop->pollfd);
+  if (p == NULL)
+    return -1;
+  loop->pollfd = p;
+#endif
+
+  loop->nready = n;
+  return 0;
+}
+
+#if defined EVENT_EPOLL
+
+static int
+backend_new (EventLoop *loop, int size_hint)
+{
+  loop->fd = epoll_create (size_hint);
+  if (loop->fd == -1)
+    return -1;
+  fcntl (loop->fd, F_SETFD, FD_CLOEXEC);
+  return 0;
+}
+
+static int
+backend_ctl (EventLoop *loop, int fd, int old, int events)
+{
+  struct epoll_event ev;
+  int op;
+
+  memset (&ev, 0, sizeof ev);
+  ev.data.fd = fd;
+  if (events & POLLIN)
+    ev.events |= EPOLLIN;
+  if (events & POLLOUT)
+    ev.events |= EPOLLOUT;
+  if (events & EVENT_EDGE)
+    ev.events |= EPOLLET;
+
+  if (old == 0)
+    op = EPOLL_CTL_ADD;
+  else if (events == 0)
+    op = EPOLL_CTL_DEL;
+  else
+    op = EPOLL_CTL_MOD;
+
+  return epoll_ctl (loop->fd, op, fd, &ev);
+}
+
+static int
+backend_wait (EventLoop *loop, Event *events, int max, int timeout)
+{
+  int i, n, m;
+
+  if (grow_ready (loop, max) == -1)
+    return -1;
+
+  n = epoll_wait (loop->fd, loop->ready, max, timeout);
+  for (i = m = 0; i < n; i++)
+    {
+      struct epoll_event *ev = &loop->ready[i];
+      Registration *reg = registration (loop, ev->data.fd, FALSE);
+
+      if (reg == NULL || reg->events == 0)
+	continue;
+      events[m].fd = ev->data.fd;
+      events[m].data = reg->data;
+      events[m].revents = 0;
+      if (ev->events & EPOLLIN)
+	events[m].revents |= POLLIN;
+      if (ev->events & EPOLLOUT)
+	events[m].revents |= POLLOUT;
+      if (ev->events & EPOLLERR)
+	events[m].revents |= POLLERR;
+      if (ev->events & EPOLLHUP)
+	events[m].revents |= POLLHUP;
+      m++;
+    }
+
+  return n == -1 ? -1 : m;
+}
+
+static int
+backend_refresh (EventLoop *loop, int fd, int events)
+{
+  if (backend_ctl (loop, fd, events, events) == 0 || errno != ENOENT)
+    return 0;
+  return backend_ctl (loop, fd, 0, events);
+}
+
+static const char *backend_name = "epoll";
+
+#elif defined EVENT_KQUEUE
+
+static int
+backend_new (EventLoop *loop, int size_hint)
+{
+  (void)size_hint;
+  loop->fd = kqueue ();
+  if (loop->fd == -1)
+    return -1;
+  fcntl (loop->fd, F_SETFD, FD_CLOEXEC);
+  return 0;
+}
+
+static int
+backend_ctl (EventLoop *loop, int fd, int old, int events)
+{
+  struct kevent ev[2];
+  u_short flags;
+  int n = 0;
+
+  flags = EV_ADD | ((events & EVENT_EDGE) ? EV_CLEAR : 0);
+
+  if (events & POLLIN)
+    EV_SET (&ev[n++], fd, EVFILT_READ, flags, 0, 0, NULL);
+  else if (old & POLLIN)
+    EV_SET (&ev[n++], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+
+  if (events & POLLOUT)
+    EV_SET (&ev[n++], fd, EVFILT_WRITE, flags, 0, 0, NULL);
+  else if (old & POLLOUT)
+    EV_SET (&ev[n++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+
+  return kevent (loop->fd, ev, n, NULL, 0, NULL);
+}
+
+static int
+backend_wait (EventLoop *loop, Event *events, int max, int timeout)
+{
+  struct timespec ts, *tsp = NULL;
+  int i, n, m;
+
+  if (grow_ready (loop, max) == -1)
+    return -1;
+
+  if (timeout >= 0)
+    {
+      ts.tv_sec = timeout / 1000;
+      ts.tv_nsec = (timeout % 1000) * 1000000L;
+      tsp = &ts;
+    }
+
+  /* A descriptor registered for both reading and writing may be
+     reported twice.  The caller's handlers cope with that.  */
+  n = kevent (loop->fd, NULL, 0, loop->ready, max, tsp);
+  for (i = m = 0; i < n; i++)
+    {
+      struct kevent *ev = &loop->ready[i];
+      Registration *reg = registration (loop, ev->ident, FALSE);
+
+      if (reg == NULL || reg->events == 0)
+	continue;
+      events[m].fd = ev->ident;
+      events[m].data = reg->data;
+      events[m].revents = ev->filter == EVFILT_WRITE ? POLLOUT : POLLIN;
+      if (ev->flags & EV_EOF)
+	events[m].revents |= POLLHUP;
+      if (ev->flags & EV_ERROR)
+	events[m].revents |= POLLERR;
+      m++;
+    }
+
+  return n == -1 ? -1 : m;
+}
+
+static int
+backend_refresh (EventLoop *loop, int fd, int events)
+{
+  return backend_ctl (loop, fd, 0, events);
+}
+
+static const char *backend_name = "kqueue";
+
+#else /* poll () */
+
+static int
+backend_new (EventLoop *loop, int size_hint)
+{
+  loop->fd = -1;
+  loop->npollfd = 0;
+  return grow_ready (loop, size_hint);
+}
+
+static int
+backend_ctl (EventLoop *loop, int fd, int old, int events)
+{
+  Registration *reg = &loop->reg[fd];
+
+  if (old == 0)
+    {
+      if (grow_ready (loop, loop->npollfd + 1) == -1)
+	return -1;
+      reg->index = loop->npollfd++;
+    }
+  else if (events == 0)
+    {
+      /* Move the last entry into the hole.  */
+      struct pollfd *last = &loop->pollfd[--loop->npollfd];
+
+      loop->pollfd[reg->index] = *last;
+      loop->reg[last->fd].index = reg->index;
+      reg->index = -1;
+      return 0;
+    }
+
+  loop->pollfd[reg->index].fd = fd;
+  loop->pollfd[reg->index].events = events & (POLLIN | POLLOUT);
+  return 0;
+}
+
+static int
+backend_wait (EventLoop *loop, Event *events, int max, int timeout)
+{
+  int i, n, m;
+
+  n = poll (loop->pollfd, loop->npollfd, timeout);
+  if (n <= 0)
+    return n;
+
+  for (i = m = 0; i < loop->npollfd && m < n && m < max; i++)
+    {
+      struct pollfd *p = &loop->pollfd[i];
+
+      if (p->revents == 0)
+	continue;
+      events[m].fd = p->fd;
+      events[m].revents = p->revents;
+      events[m].data = loop->reg[p->fd].data;
+      m++;
+    }
+
+  return m;
+}
+
+static int
+backend_refresh (EventLoop *loop, int fd, int events)
+{
+  (void)loop;
+  (void)fd;
+  (void)events;
+  return 0;
+}
+
+static const char *backend_name = "poll";
+
+#endif
+
+EventLoop *
+event_loop_new (int size_hint)
+{
+  EventLoop *loop;
+
+  loop = malloc (sizeof (EventLoop));
+  if (loop == NULL)
+    return NULL;
+  memset (loop, 0, sizeof (EventLoop));
+
+  if (size_hint < 1)
+    size_hint = 1;
+  if (backend_new (loop, size_hint) == -1)
+    {
+      event_loop_destroy (loop);
+      return NULL;
+    }
+
+  return loop;
+}
+
+void
+event_loop_destroy (EventLoop *loop)
+{
+  if (loop->fd != -1)
+    close (loop->fd);
+#if defined EVENT_EPOLL || defined EVENT_KQUEUE
+  free (loop->ready);
+#else
+  free (loop->pollfd);
+#endif
+  free (loop->reg);
+  free (loop);
+}
+
+const char *
+event_loop_backend (EventLoop *loop)
+{
+  (void)loop;
+  return backend_name;
+}
+
+int
+event_add (EventLoop *loop, int fd, int events, void *data)
+{
+  Registration *reg;
+
+  reg = registration (loop, fd, TRUE);
+  if (reg == NULL)
+    return -1;
+  if (reg->events != 0)
+    {
+      errno = EEXIST;
+      return -1;
+    }
+  if (events == 0)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  if (backend_ctl (loop, fd, 0, events) == -1)
+    return -1;
+  reg->events = events;
+  reg->data = data;
+  return 0;
+}
+
+int
+event_mod (EventLoop *loop, int fd, int events, void *data)
+{
+  Registration *reg;
+
+  reg = registration (loop, fd, FALSE);
+  if (reg == NULL || reg->events == 0)
+    {
+      errno = ENOENT;
+      return -1;
+    }
+  if (events == 0)
+    return event_del (loop, fd);
+
+  if (events != reg->events
+      && backend_ctl (loop, fd, reg->events, events) == -1)
+    return -1;
+  reg->events = events;
+  reg->data = data;
+  return 0;
+}
+
+int
+event_del (EventLoop *loop, int fd)
+{
+  Registration *reg;
+
+  reg = registration (loop, fd, FALSE);
+  if (reg == NULL || reg->events == 0)
+    {
+      errno = ENOENT;
+      return -1;
+    }
+
+  /* The descriptor may already be closed, in which case epoll and
+     kqueue have forgotten it.  */
+  backend_ctl (loop, fd, reg->events, 0);
+  reg->events = 0;
+  reg->data = NULL;
+  return 0;
+}
+
+int
+event_refresh (EventLoop *loop, int fd)
+{
+  Registration *reg;
+
+  reg = registration (loop, fd, FALSE);
+  if (reg == NULL || reg->events == 0)
+    {
+      errno = ENOENT;
+      return -1;
+    }
+
+  return backend_refresh (loop, fd, reg->events);
+}
+
+int
+event_wait (EventLoop *loop, Event *events, int max, int timeout)
+{
+  return backend_wait (loop, events, max, timeout);
+}
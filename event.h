@@ -0,0 +1,51 @@
+/*
+event.h
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+
+A readiness notification interface with registrations that persist
+across calls to event_wait ().  The backend is epoll on Linux, kqueue
+on BSD, and poll () everywhere else.
+*/
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <sys/poll_.h>
+
+/* Registration flag, or'ed with POLLIN and POLLOUT.  The caller
+   promises to read or write until EAGAIN before waiting again.  */
+#define EVENT_EDGE 0x10000
+
+typedef struct event_loop EventLoop;
+
+typedef struct
+{
+  int fd;
+  int revents;			/* POLLIN, POLLOUT, POLLERR, POLLHUP */
+  void *data;
+} Event;
+
+extern EventLoop *event_loop_new (int size_hint);
+extern void event_loop_destroy (EventLoop *loop);
+extern const char *event_loop_backend (EventLoop *loop);
+
+/* Register FD for EVENTS, and report DATA when it becomes ready.
+   event_mod () changes an existing registration, and event_del ()
+   removes it.  Each returns 0 on success or -1 on error.  */
+extern int event_add (EventLoop *loop, int fd, int events, void *data);
+extern int event_mod (EventLoop *loop, int fd, int events, void *data);
+extern int event_del (EventLoop *loop, int fd);
+
+/* Hand the registration of FD to the kernel again.  Needed when FD
+   may have been closed and the same number reused behind the caller's
+   back, since epoll and kqueue forget descriptors when they're
+   closed.  */
+extern int event_refresh (EventLoop *loop, int fd);
+
+/* Wait at most TIMEOUT milliseconds, or forever if TIMEOUT is -1, and
+   store up to MAX ready file descriptors in EVENTS.  Returns the
+   number stored, 0 on timeout, or -1 on error.  */
+extern int event_wait (EventLoop *loop, Event *events, int max, int timeout);
+
+#endif /* EVENT_H */
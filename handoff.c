@@ -0,0 +1,335 @@
+/*
+handoff.c
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+
+The descriptors are listed in HTS_HANDOFF_FDS, separated by commas,
+with the admin socket in HTS_HANDOFF_ADMIN and the write end of the
+pipe in HTS_HANDOFF_READY.  HTS_HANDOFF_PID is the pid of the process
+they are meant for, so that a child which inherits the environment
+doesn't take them too.
+
+systemd's socket activation works the same way, with LISTEN_PID and
+LISTEN_FDS, the sockets at 3 and up, and NOTIFY_SOCKET for the ready
+message.  inetd in "wait" mode gives hts its listening socket as
+standard input.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd_.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "handoff.h"
+
+/* The most listening sockets, one for each worker.  */
+#define HANDOFF_FDS_MAX 1024
+
+/* Where systemd puts the first socket.  */
+#define LISTEN_FDS_START 3
+
+static int handoff_ready_fd = -1;
+
+static int
+handoff_kept (int fd, const int *fds, int nfds, int admin_fd, int ready)
+{
+  int i;
+
+  if (fd == admin_fd || fd == ready)
+    return TRUE;
+  for (i = 0; i < nfds; i++)
+    if (fds[i] == fd)
+      return TRUE;
+  return FALSE;
+}
+
+static void
+handoff_keep (int fd)
+{
+  int flags = fcntl (fd, F_GETFD);
+
+  if (flags != -1)
+    fcntl (fd, F_SETFD, flags & ~FD_CLOEXEC);
+}
+
+pid_t
+handoff_exec (const char *path, char *const argv[],
+	      const int *fds, int nfds, int admin_fd, int *ready_fd)
+{
+  char list[HANDOFF_FDS_MAX * 8];
+  char number[32];
+  size_t len = 0;
+  int p[2];
+  long max;
+  pid_t pid;
+  int i;
+
+  list[0] = 0;
+  for (i = 0; i < nfds; i++)
+    {
+      if (len + sizeof number >= sizeof list)
+	{
+	  errno = EMFILE;
+	  return -1;
+	}
+      len += sprintf (list + len, i == 0 ? "%d" : ",%d", fds[i]);
+    }
+
+  if (pipe (p) == -1)
+    return -1;
+  fcntl (p[0], F_SETFD, FD_CLOEXEC);
+
+  pid = fork ();
+  if (pid == -1)
+    {
+      int saved_errno = errno;
+      close (p[0]);
+      close (p[1]);
+      errno = saved_errno;
+      return -1;
+    }
+
+  if (pid == 0)
+    {
+      /* Sessions must not stay open in the new process, or their
+	 clients and backends would never see them close.  */
+      max = sysconf (_SC_OPEN_MAX);
+      if (max == -1)
+	max = 1024;
+      for (i = 3; i < max; i++)
+	if (!handoff_kept (i, fds, nfds, admin_fd, p[1]))
+	  close (i);
+      for (i = 0; i < nfds; i++)
+	handoff_keep (fds[i]);
+      if (admin_fd != -1)
+	handoff_keep (admin_fd);
+      handoff_keep (p[1]);
+
+      setenv ("HTS_HANDOFF_FDS", list, 1);
+      sprintf (number, "%d", admin_fd);
+      setenv ("HTS_HANDOFF_ADMIN", number, 1);
+      sprintf (number, "%d", p[1]);
+      setenv ("HTS_HANDOFF_READY", number, 1);
+      sprintf (number, "%d", (int)getpid ());
+      setenv ("HTS_HANDOFF_PID", number, 1);
+
+      execvp (path, argv);
+      _exit (127);
+    }
+
+  close (p[1]);
+  *ready_fd = p[0];
+  return pid;
+}
+
+/* Whether FD is a socket which has been listen ()ed on.  */
+
+static int
+handoff_listening (int fd)
+{
+  struct stat st;
+#ifdef SO_ACCEPTCONN
+  int on = 0;
+  socklen_t len = sizeof on;
+
+  if (getsockopt (fd, SOL_SOCKET, SO_ACCEPTCONN, &on, &len) == 0)
+    return on != 0;
+#endif
+  return fstat (fd, &st) == 0 && S_ISSOCK (st.st_mode);
+}
+
+static int
+handoff_number (const char *s, char **end)
+{
+  long n;
+
+  errno = 0;
+  n = strtol (s, end, 10);
+  if (errno != 0 || *end == s || n < 0 || n > INT_MAX)
+    return -1;
+  return (int)n;
+}
+
+int
+handoff_inherit (int **fds, int *admin_fd)
+{
+  const char *list = getenv ("HTS_HANDOFF_FDS");
+  const char *admin = getenv ("HTS_HANDOFF_ADMIN");
+  const char *ready = getenv ("HTS_HANDOFF_READY");
+  const char *pid = getenv ("HTS_HANDOFF_PID");
+  const char *p;
+  char *end;
+  int n = 0, fd;
+
+  *fds = NULL;
+  *admin_fd = -1;
+  if (list == NULL || pid == NULL || atoi (pid) != (int)getpid ())
+    goto none;
+
+  *fds = malloc ((strlen (list) / 2 + 1) * sizeof **fds);
+  if (*fds == NULL)
+    goto bad;
+  for (p = list; *p != 0; p = end + (*end == ','))
+    {
+      fd = handoff_number (p, &end);
+      if (fd == -1 || (*end != ',' && *end != 0) || !handoff_listening (fd))
+	goto bad;
+      (*fds)[n++] = fd;
+    }
+  if (n == 0)
+    goto bad;
+
+  if (admin != NULL && strcmp (admin, "-1") != 0)
+    {
+      fd = handoff_number (admin, &end);
+      if (fd == -1 || *end != 0 || !handoff_listening (fd))
+	goto bad;
+      *admin_fd = fd;
+    }
+
+  if (ready != NULL)
+    {
+      handoff_ready_fd = handoff_number (ready, &end);
+      if (handoff_ready_fd != -1)
+	fcntl (handoff_ready_fd, F_SETFD, FD_CLOEXEC);
+    }
+
+ none:
+  unsetenv ("HTS_HANDOFF_FDS");
+  unsetenv ("HTS_HANDOFF_ADMIN");
+  unsetenv ("HTS_HANDOFF_READY");
+  unsetenv ("HTS_HANDOFF_PID");
+  return n;
+
+ bad:
+  free (*fds);
+  *fds = NULL;
+  *admin_fd = -1;
+  errno = EBADF;
+  n = -1;
+  goto none;
+}
+
+int
+handoff_activated (int **fds)
+{
+  const char *count = getenv ("LISTEN_FDS");
+  const char *pid = getenv ("LISTEN_PID");
+  char *end;
+  int n = 0, i;
+
+  *fds = NULL;
+  if (count == NULL || pid == NULL || atoi (pid) != (int)getpid ())
+    goto none;
+
+  n = handoff_number (count, &end);
+  if (n <= 0 || *end != 0 || n > HANDOFF_FDS_MAX)
+    goto bad;
+  *fds = malloc (n * sizeof **fds);
+  if (*fds == NULL)
+    goto bad;
+  for (i = 0; i < n; i++)
+    {
+      (*fds)[i] = LISTEN_FDS_START + i;
+      if (!handoff_listening ((*fds)[i]))
+	goto bad;
+    }
+
+ none:
+  unsetenv ("LISTEN_FDS");
+  unsetenv ("LISTEN_PID");
+  unsetenv ("LISTEN_FDNAMES");
+  return n;
+
+ bad:
+  free (*fds);
+  *fds = NULL;
+  errno = EBADF;
+  n = -1;
+  goto none;
+}
+
+int
+handoff_inetd (int **fds)
+{
+  int fd, null;
+
+  *fds = NULL;
+  if (!handoff_listening (0))
+    {
+      errno = ENOTSOCK;
+      return -1;
+    }
+
+  /* Standard output and error are the socket too.  */
+  fd = fcntl (0, F_DUPFD, LISTEN_FDS_START);
+  null = open ("/dev/null", O_RDWR);
+  if (fd == -1 || null == -1)
+    return -1;
+  dup2 (null, 0);
+  dup2 (null, 1);
+  dup2 (null, 2);
+  if (null > 2)
+    close (null);
+
+  *fds = malloc (sizeof **fds);
+  if (*fds == NULL)
+    return -1;
+  (*fds)[0] = fd;
+  return 1;
+}
+
+/* Send STATE to the service manager, if there is one.  An address
+   starting with @ is in the abstract namespace.  */
+
+static void
+handoff_notify (const char *state)
+{
+  const char *path = getenv ("NOTIFY_SOCKET");
+  struct sockaddr_un addr;
+  socklen_t len;
+  int fd;
+
+  if (path == NULL || (path[0] != '/' && path[0] != '@')
+      || strlen (path) >= sizeof addr.sun_path)
+    return;
+
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+  if (path[0] == '@')
+    addr.sun_path[0] = 0;
+  len = offsetof (struct sockaddr_un, sun_path) + strlen (path);
+
+  fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+  if (fd == -1)
+    return;
+  if (sendto (fd, state, strlen (state), 0,
+	      (struct sockaddr *)&addr, len) == -1)
+    log_error ("couldn't notify %s: %s", path, strerror (errno));
+  close (fd);
+}
+
+void
+handoff_ready (void)
+{
+  char state[64];
+  char c = 1;
+
+  /* After an upgrade, the new process is the one to watch.  */
+  sprintf (state, "READY=1\nMAINPID=%d", (int)getpid ());
+  handoff_notify (state);
+
+  if (handoff_ready_fd == -1)
+    return;
+  if (write (handoff_ready_fd, &c, 1) != 1)
+    log_error ("couldn't tell the old process to hand off: %s",
+	       strerror (errno));
+  close (handoff_ready_fd);
+  handoff_ready_fd = -1;
+}
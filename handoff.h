@@ -0,0 +1,46 @@
+/*
+handoff.h
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+
+Passing the listening sockets to a new hts on SIGUSR2, so that it can
+be upgraded without closing them.  The new process is told where the
+sockets are in its environment, and says that it has started by
+writing a byte to a pipe.  Until then, the old one goes on as before.
+Sockets bound by systemd or inetd are picked up here too.
+*/
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <sys/types.h>
+
+/* Start PATH with ARGV, giving it the NFDS listening sockets in FDS
+   and the admin socket ADMIN_FD, or -1.  Every other descriptor is
+   closed in the new process.  Returns its pid, and in READY_FD a pipe
+   which gets a byte once it is up, or EOF if it failed.  Returns -1
+   if it couldn't be started.  */
+extern pid_t handoff_exec (const char *path, char *const argv[],
+			   const int *fds, int nfds, int admin_fd,
+			   int *ready_fd);
+
+/* The sockets given to this process by handoff_exec (), in the same
+   order, in a malloc ()ed array in FDS.  Returns how many there are,
+   0 if it wasn't started that way, or -1 if the environment names a
+   descriptor which isn't a listening socket.  ADMIN_FD is set to the
+   admin socket, or -1.  Call this before forking.  */
+extern int handoff_inherit (int **fds, int *admin_fd);
+
+/* The sockets of systemd socket activation, like handoff_inherit ().  */
+extern int handoff_activated (int **fds);
+
+/* The listening socket inetd passed as standard input, moved to a
+   descriptor of its own.  Standard input, output and error become
+   /dev/null.  Returns 1, or -1 if standard input isn't listening.  */
+extern int handoff_inetd (int **fds);
+
+/* Tell the old process that this one has taken over, and the service
+   manager in NOTIFY_SOCKET that hts is accepting connections.  */
+extern void handoff_ready (void);
+
+#endif /* HANDOFF_H */
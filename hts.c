@@ -7,14 +7,102 @@ hts is the server half of httptunnel.  httptunnel creates a virtual
 two-way data path tunneled in HTTP requests.
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE		/* splice () */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd_.h>
 #include <signal.h>
 #include <sys/poll_.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "common.h"
+#include "event.h"
+#include "pool.h"
+#include "timer.h"
+#include "mux.h"
+#include "stats.h"
+#include "logring.h"
+#include "probes.h"
+#include "handoff.h"
+
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+#include <linux/filter.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
+#define USE_SPLICE
+#ifdef TCP_INFO
+#define USE_TCP_INFO
+#endif
+#endif
+
+#ifdef DEBUG_MODE
+/* Debug messages go through a ring which the loop drains, at most
+   LOG_DRAIN_MAX of them a round.  */
+#undef log_debug
+#undef log_verbose
+#undef log_annoying
+#define log_debug(...) \
+  (debug_level >= 3 ? log_ring (debug_file, __VA_ARGS__) : (void)0)
+#define log_verbose(...) \
+  (debug_level >= 4 ? log_ring (debug_file, __VA_ARGS__) : (void)0)
+#define log_annoying(...) \
+  (debug_level >= 5 ? log_ring (debug_file, __VA_ARGS__) : (void)0)
+#define DEFAULT_LOG_RATE 10000
+#define LOG_DRAIN_MAX 256
+#endif
+
+/* Bounds for --content-length auto.  */
+#define DEFAULT_MIN_CONTENT_LENGTH (10 * 1024)
+#define DEFAULT_MAX_CONTENT_LENGTH (10 * 1024 * 1024)
+
+/* How long to look up and connect to --forward-port.  */
+#define DEFAULT_DNS_TTL 60
+#define CONNECT_TIMEOUT 30
+
+/* How long to wait before connecting a spare socket again after a
+   failure.  */
+#define SPARE_RETRY_MSEC 1000
+
+/* Backends for --forward-port.  After BACKEND_FAILURES failed
+   connects in a row, a backend isn't used for BACKEND_DOWN_MSEC
+   unless all of them are down.  */
+#define MAX_FORWARDS 32
+#define BACKEND_FAILURES 3
+#define BACKEND_DOWN_MSEC 10000
+
+/* Stop reading one side of a session when this much is waiting to be
+   sent on the other, and start again below half of it.  */
+#define DEFAULT_HIGH_WATER (256 * 1024)
+#define THROTTLE_MSEC 10
+
+/* How often to look at the kernel's TCP_INFO for each session.  The
+   tunnel is the bottleneck of a session when data queues up in the
+   GET connection, and its round trip takes more than SLOW_PEER_RATIO
+   times that of the forwarded port.  */
+#define TCP_INFO_MSEC 1000
+#define SLOW_PEER_RATIO 4
+
+/* Clients turned away by admission control are told to try again
+   after this many seconds.  */
+#define REJECT_RETRY_SECONDS 5
+
+/* The largest payload of a TUNNEL_DATA request.  */
+#define TUNNEL_DATA_MAX 65535
+
+/* The largest payload of a jumbo TUNNEL_JDATA request.  */
+#define TUNNEL_JDATA_MAX (16 * 1024 * 1024)
 
 typedef struct
 {
@@ -28,8 +116,245 @@ typedef struct
   int strict_content_length;
   int keep_alive;
   int max_connection_age;
+  int max_sessions;		/* slots, one more than session_limit */
+  int session_limit;		/* --max-sessions */
+  int max_client_sessions;	/* from one address, or 0 */
+  unsigned long session_rate;	/* bytes a second, or 0 */
+  int workers;
+  int splice;
+  int content_length_auto;
+  size_t min_content_length;
+  size_t max_content_length;
+  size_t buffer_memory;
+  int idle_timeout;
+  int dns_ttl;
+  int forward_pool;
+  int nforwards;		/* -F arguments; the first is forward_host */
+  char *forward_hosts[MAX_FORWARDS];
+  int forward_ports[MAX_FORWARDS];
+  int balance;
+  int persistent;
+  int chunked;			/* CHUNKED_* */
+  char *compress;		/* methods in order of preference */
+  int coalesce_usec;
+  size_t coalesce_bytes;
+  size_t jumbo;			/* largest TUNNEL_JDATA offered, or 0 */
+  int max_streams;		/* per multiplexed session, or 0 */
+  size_t high_water;		/* 0 for no backpressure */
+  char *stats_host;
+  int stats_port;		/* admin port, or -1 */
+  Stats *stats;			/* set up by main () before forking */
+  int admin_fd;			/* listening on stats_port, or -1 */
+  int log_rate;			/* debug messages a second, or 0 */
+  char **argv;			/* to start again with on SIGUSR2 */
+  char *exe;			/* argv[0], made absolute */
+  int drain_timeout;		/* seconds, or 0 to wait for every session */
+  int *listen_fds;		/* bound before hts started */
+  int nlisten_fds;
+  int foreground;		/* don't call daemon () */
+  int inetd;			/* standard input is the listening socket */
 } Arguments;
 
+typedef struct
+{
+  size_t length;		/* Content-Length currently in use */
+  size_t cap;			/* upper bound for this session */
+  unsigned long rate;		/* bytes per second to the tunnel */
+  unsigned long bytes;		/* written since SINCE */
+  unsigned long since;
+  int out_fd;			/* GET connection last seen */
+  unsigned long write_msec;	/* when data was last written */
+  unsigned long get_msec;	/* when the GET connection changed */
+  int replies;			/* client data soon after ours */
+  int rollover_replies;		/* ... soon after a new GET request */
+} Adaptive;
+
+typedef struct server Server;
+typedef struct stream Stream;
+
+/* One --forward-port target.  */
+typedef struct
+{
+  char *host;
+  int port;
+  struct sockaddr_in addr;	/* cached for --dns-ttl seconds */
+  int resolved;			/* addr is valid */
+  unsigned long expires;
+  pid_t resolver;		/* process looking host up, or -1 */
+  int resolver_fd;
+  int sessions;			/* sessions connected to it */
+  int failures;			/* connect failures in a row */
+  unsigned long down_until;
+} Backend;
+
+/* An idle connection to the forwarded port, waiting for a session.  */
+typedef struct
+{
+  Server *server;
+  Backend *backend;
+  int fd;			/* -1 if the slot is empty */
+  int ready;			/* connected, and not yet taken */
+} Spare;
+
+typedef struct
+{
+  Server *server;
+  Tunnel *tunnel;
+  int fd;
+  int active;
+  int closed;
+  int tunnel_fd;		/* registered tunnel_pollin_fd (), or -1 */
+  Adaptive adapt;
+  int pipe[2];			/* for splice (), or -1 */
+  int sendfile;			/* fd is a regular file */
+  char *map;			/* fd mapped, if it can't be sent, or NULL */
+  size_t map_len;
+  off_t map_pos;		/* fd's offset */
+  int tty;			/* fd is a terminal, read by session_drain () */
+  int drain;			/* read fd until EAGAIN, edge-triggered */
+  int connecting;		/* waiting for connect () to finish */
+  int chunked;			/* GET replies are chunked */
+  char *compress;		/* method agreed on, or NULL */
+  Backend *backend;		/* with --forward-port */
+  char *buf;			/* frame_max bytes from the pool */
+  size_t frame_max;		/* largest payload of one request */
+  int throttled;		/* GET socket over --high-water, fd not read */
+  int fd_full;			/* fd over --high-water, tunnel not read */
+  int mux;			/* carries streams instead of using fd */
+  Stream *streams;		/* --max-streams slots */
+  MuxParser parser;
+  size_t held;			/* bytes in buf waiting for --coalesce-usec */
+  unsigned long held_usec;	/* when the first of them was read */
+  unsigned long gap_usec;	/* when the client went away, or 0 */
+  unsigned long last_tunnel_write;
+  unsigned long last_activity;
+  Timer keep_alive;
+  Timer age;
+  Timer expire;
+  Timer adapt_timer;
+  Timer connect;
+  Timer coalesce;
+  Timer throttle;
+  Timer tcp_info;
+  Timer rate;
+  unsigned long addr;		/* the client's IPv4 address, or 0 */
+  int limited;			/* over --session-rate, nothing read */
+  long tokens;			/* bytes --session-rate still allows */
+  unsigned long refilled;	/* timer_now () */
+  SessionStats *stats;
+} Session;
+
+/* A connection to the admin port.  */
+typedef struct
+{
+  Server *server;
+  int fd;			/* -1 if the slot is free */
+  Timer timeout;
+} Admin;
+
+#define ADMIN_MAX 4
+#define ADMIN_TIMEOUT_MSEC 5000
+
+/* A stream of a multiplexed session, connected to a backend.  */
+
+struct stream
+{
+  Session *session;
+  unsigned long id;
+  int fd;			/* -1 if the slot is free */
+  int connecting;
+  int paused;			/* send window used up */
+  unsigned long window;		/* bytes the client will still take */
+  unsigned long consumed;	/* written to fd since the last MUX_WINDOW */
+  int events;			/* registered for, or 0 */
+  char *out;			/* MUX_DATA the socket hasn't taken yet */
+  size_t out_len, out_size;
+  Backend *backend;
+};
+
+/* Timers are rearmed lazily: activity only updates a time stamp, and
+   a timer which finds that it fired early just goes back in the
+   wheel.  */
+
+struct server
+{
+  Arguments *arg;
+  Session *sessions;
+  int nactive;
+  int nwaiting;			/* sessions waiting on server_fd */
+  Session *idle;		/* slot accepting the next session */
+  int server_fd;		/* shared listening socket, or -1 */
+  int accept_fd;		/* the tunnels take "accept_fd" */
+  int listen_fd;		/* descriptor registered for accepting */
+  EventLoop *loop;
+  Event *events;
+  int nevents;
+  BufferPool *pool;		/* session buffers */
+  size_t jumbo_bytes;		/* in larger ones, from the heap */
+  int (*pipes)[2];		/* idle splice () pipes */
+  int npipes;
+  TimerWheel *timers;
+  Backend *backends;
+  int next_backend;
+  Spare *spares;		/* --forward-pool */
+  Stream *streams;		/* --max-streams for each session */
+  int worker;
+  WorkerStats *stats;
+  unsigned long wakeup_usec;	/* when event_wait () last returned */
+  Admin admins[ADMIN_MAX];
+  Timer refill;
+  int handoff_fd;		/* ready pipe of the new process, or -1 */
+  pid_t handoff_pid;
+  int draining;			/* handed over, only serving old sessions */
+  int drained;			/* --drain-timeout is up */
+  Timer drain;
+};
+
+/* The index of a session in its worker, for the probes.  */
+#define SLOT(session) ((int)((session) - (session)->server->sessions))
+
+enum
+{
+  OPT_NO_SPLICE = 256,
+  OPT_MIN_CONTENT_LENGTH,
+  OPT_MAX_CONTENT_LENGTH,
+  OPT_BUFFER_MEMORY,
+  OPT_IDLE_TIMEOUT,
+  OPT_DRAIN_TIMEOUT,
+  OPT_FOREGROUND,
+  OPT_INETD,
+  OPT_MAX_CLIENT_SESSIONS,
+  OPT_SESSION_RATE,
+  OPT_DNS_TTL,
+  OPT_FORWARD_POOL,
+  OPT_BALANCE,
+  OPT_PERSISTENT,
+  OPT_CHUNKED,
+  OPT_COMPRESS,
+  OPT_COALESCE_USEC,
+  OPT_COALESCE_BYTES,
+  OPT_JUMBO,
+  OPT_MAX_STREAMS,
+  OPT_HIGH_WATER,
+  OPT_STATS_PORT,
+  OPT_LOG_RATE
+};
+
+/* Values of the "chunked" tunnel option.  */
+enum
+{
+  CHUNKED_NEVER,
+  CHUNKED_OFFERED,		/* if the client asks in TUNNEL_OPEN */
+  CHUNKED_ALWAYS
+};
+
+enum
+{
+  BALANCE_ROUND_ROBIN,
+  BALANCE_LEAST_CONNECTIONS,
+  BALANCE_HASH
+};
+
 int debug_level = 0;
 FILE *debug_file = NULL;
 
@@ -42,34 +367,133 @@ usage (FILE *f, const char *me)
 "When a connection is made, I/O is redirected to the destination specified\n"
 "by the --device or --forward-port switch.\n"
 "\n"
+"      --buffer-memory BYTES      use at most BYTES for session buffers\n"
+"                                 in each worker (default is no limit)\n"
+"      --chunked[=WHEN]           stream GET replies with chunked encoding\n"
+"                                 when the client \"offered\" (default) it,\n"
+"                                 or \"always\"; only for proxies known to\n"
+"                                 forward chunks promptly\n"
+"      --compress METHODS         compress data with the first of METHODS\n"
+"                                 (\"lz4\", \"zstd\", separated by commas)\n"
+"                                 that the client also offers\n"
+"      --coalesce-usec USEC       hold data from the forwarded port for up\n"
+"                                 to USEC microseconds, rounded up to a\n"
+"                                 millisecond, to send fewer requests\n"
+"      --coalesce-bytes BYTES     send held data once BYTES have been\n"
+"                                 collected (default is %d)\n"
 "  -c, --content-length BYTES     use HTTP PUT requests of BYTES size\n"
-"                                 (k, M, and G postfixes recognized)\n"
+"                                 (k, M, and G postfixes recognized), or\n"
+"                                 adapt the size to the traffic if BYTES\n"
+"                                 is \"auto\"\n"
+"      --min-content-length BYTES smallest size used with \"auto\"\n"
+"                                 (default is %d)\n"
+"      --max-content-length BYTES largest size used with \"auto\"\n"
+"                                 (default is %d)\n"
 "  -d, --device DEVICE            use DEVICE for input and output\n"
+"      --drain-timeout SECONDS    after handing over to a new process on\n"
+"                                 SIGUSR2, close the remaining sessions\n"
+"                                 after SECONDS seconds (default is to\n"
+"                                 wait for them to end)\n"
 #ifdef DEBUG_MODE
 "  -D, --debug [LEVEL]            enable debug mode\n"
 #endif
 "  -F, --forward-port HOST:PORT   connect to PORT at HOST and use it for \n"
-"                                 input and output\n"
+"                                 input and output; may be given more\n"
+"                                 than once to spread sessions over\n"
+"                                 several backends\n"
+"      --balance METHOD           pick backends by \"round-robin\" (the\n"
+"                                 default), \"least-connections\", or\n"
+"                                 \"hash\" of the client address\n"
+"      --dns-ttl SECONDS          look HOST up again after SECONDS seconds\n"
+"                                 (default is %d)\n"
+"      --forward-pool N           keep N idle connections to HOST:PORT\n"
+"                                 ready for new sessions\n"
+"      --foreground               don't detach from the terminal\n"
 "  -h, --help                     display this help and exit\n"
+"      --high-water BYTES         stop reading from one side when BYTES\n"
+"                                 wait to be sent on the other (default is\n"
+"                                 %d, 0 to never stop)\n"
+"      --jumbo BYTES              send up to BYTES of data in one request\n"
+"                                 to clients that support it\n"
 "  -k, --keep-alive SECONDS       send keepalive bytes every SECONDS seconds\n"
 "                                 (default is %d)\n"
+"      --idle-timeout SECONDS     close sessions without traffic for\n"
+"                                 SECONDS seconds (default is never)\n"
+"      --inetd                    accept on the socket inetd passes as\n"
+"                                 standard input (\"wait\" mode), and\n"
+"                                 exit when the last session ends\n"
 #ifdef DEBUG_MODE
 "  -l, --logfile FILE             specify logfile for debug output\n"
+"      --log-rate N               write at most N debug messages a second\n"
+"                                 and drop the rest, or all if N is 0\n"
 #endif
+"  -m, --max-sessions N           serve up to N tunnels at once (default is 1),\n"
+"                                 and answer more clients with a 503\n"
+"      --max-client-sessions N    answer a client address which already\n"
+"                                 has N tunnels with a 503\n"
+"      --max-streams N            let clients that support it carry up to\n"
+"                                 N connections to HOST:PORT in one tunnel\n"
 "  -M, --max-connection-age SEC   maximum time a connection will stay\n"
 "                                 open is SEC seconds (default is %d)\n"
 "  -S, --strict-content-length    always write Content-Length bytes in requests\n"
+"      --session-rate BYTES       let each tunnel move at most BYTES a\n"
+"                                 second, both directions together\n"
+"      --stats-port [HOST:]PORT   serve counters at PORT on HOST (default\n"
+"                                 is 127.0.0.1): /metrics for Prometheus,\n"
+"                                 /stats for JSON\n"
+#ifdef USE_SPLICE
+"      --no-splice                copy data through user space instead of\n"
+"                                 using splice () and sendfile ()\n"
+#endif
 "  -V, --version                  output version information and exit\n"
+"  -w, --workers N                run N worker processes sharing PORT\n"
 "  -p, --pid-file LOCATION        write a PID file to LOCATION\n"
+"      --persistent               keep HTTP/1.1 connections open between\n"
+"                                 requests, and accept pipelined PUTs\n"
 "\n"
 "Report bugs to %s.\n",
-	   me, DEFAULT_HOST_PORT, DEFAULT_KEEP_ALIVE,
+	   me, DEFAULT_HOST_PORT, TUNNEL_DATA_MAX,
+	   DEFAULT_MIN_CONTENT_LENGTH, DEFAULT_MAX_CONTENT_LENGTH,
+	   DEFAULT_DNS_TTL, DEFAULT_HIGH_WATER, DEFAULT_KEEP_ALIVE,
 	   DEFAULT_MAX_CONNECTION_AGE, BUG_REPORT_EMAIL);
 }
 
+/* The largest payload any session may send in one request.  */
+
+static size_t
+frame_max (Arguments *arg)
+{
+  return arg->jumbo > TUNNEL_DATA_MAX ? arg->jumbo : TUNNEL_DATA_MAX;
+}
+
+/* Check a --compress list against the methods of the protocol.  */
+
+static int
+compress_methods_valid (const char *list)
+{
+  static const char *methods[] = { "lz4", "zstd", NULL };
+  const char *p = list;
+
+  for (;;)
+    {
+      size_t len = strcspn (p, ",");
+      int i;
+
+      for (i = 0; methods[i] != NULL; i++)
+	if (strlen (methods[i]) == len && strncmp (methods[i], p, len) == 0)
+	  break;
+      if (methods[i] == NULL)
+	return FALSE;
+      if (p[len] == 0)
+	return TRUE;
+      p += len + 1;
+    }
+}
+
 static void
 parse_arguments (int argc, char **argv, Arguments *arg)
 {
+  int max_sessions_given = FALSE;
   int c;
 
   /* defaults */
@@ -80,10 +504,48 @@ parse_arguments (int argc, char **argv, Arguments *arg)
   arg->forward_host = NULL;
   arg->forward_port = -1;
   arg->content_length = DEFAULT_CONTENT_LENGTH;
+  arg->content_length_auto = FALSE;
+  arg->min_content_length = DEFAULT_MIN_CONTENT_LENGTH;
+  arg->max_content_length = DEFAULT_MAX_CONTENT_LENGTH;
+  arg->buffer_memory = 0;
+  arg->idle_timeout = 0;
+  arg->drain_timeout = 0;
+  arg->foreground = FALSE;
+  arg->inetd = FALSE;
+  arg->dns_ttl = DEFAULT_DNS_TTL;
+  arg->forward_pool = 0;
+  arg->nforwards = 0;
+  arg->balance = BALANCE_ROUND_ROBIN;
+  arg->persistent = FALSE;
+  arg->chunked = CHUNKED_NEVER;
+  arg->compress = NULL;
+  arg->coalesce_usec = 0;
+  arg->coalesce_bytes = TUNNEL_DATA_MAX;
+  arg->jumbo = 0;
+  arg->max_streams = 0;
+  arg->high_water = DEFAULT_HIGH_WATER;
+  arg->stats_host = NULL;
+  arg->stats_port = -1;
+  arg->stats = NULL;
+  arg->admin_fd = -1;
+#ifdef DEBUG_MODE
+  arg->log_rate = DEFAULT_LOG_RATE;
+#else
+  arg->log_rate = 0;
+#endif
   arg->pid_filename = NULL;
   arg->strict_content_length = FALSE;
   arg->keep_alive = DEFAULT_KEEP_ALIVE;
   arg->max_connection_age = DEFAULT_CONNECTION_MAX_TIME;
+  arg->max_sessions = 1;
+  arg->max_client_sessions = 0;
+  arg->session_rate = 0;
+  arg->workers = 1;
+#ifdef USE_SPLICE
+  arg->splice = TRUE;
+#else
+  arg->splice = FALSE;
+#endif
   
   for (;;)
     {
@@ -96,17 +558,45 @@ parse_arguments (int argc, char **argv, Arguments *arg)
 #ifdef DEBUG_MODE
 	{ "debug", optional_argument, 0, 'D' },
 	{ "logfile", required_argument, 0, 'l' },
+	{ "log-rate", required_argument, 0, OPT_LOG_RATE },
 #endif
 	{ "device", required_argument, 0, 'd' },
 	{ "pid-file", required_argument, 0, 'p' },
 	{ "keep-alive", required_argument, 0, 'k' },
 	{ "forward-port", required_argument, 0, 'F' },
 	{ "content-length", required_argument, 0, 'c' },
+	{ "min-content-length", required_argument, 0, OPT_MIN_CONTENT_LENGTH },
+	{ "max-content-length", required_argument, 0, OPT_MAX_CONTENT_LENGTH },
+	{ "buffer-memory", required_argument, 0, OPT_BUFFER_MEMORY },
+	{ "idle-timeout", required_argument, 0, OPT_IDLE_TIMEOUT },
+	{ "drain-timeout", required_argument, 0, OPT_DRAIN_TIMEOUT },
+	{ "foreground", no_argument, 0, OPT_FOREGROUND },
+	{ "inetd", no_argument, 0, OPT_INETD },
+	{ "dns-ttl", required_argument, 0, OPT_DNS_TTL },
+	{ "forward-pool", required_argument, 0, OPT_FORWARD_POOL },
+	{ "balance", required_argument, 0, OPT_BALANCE },
+	{ "persistent", no_argument, 0, OPT_PERSISTENT },
+	{ "chunked", optional_argument, 0, OPT_CHUNKED },
+	{ "compress", required_argument, 0, OPT_COMPRESS },
+	{ "coalesce-usec", required_argument, 0, OPT_COALESCE_USEC },
+	{ "coalesce-bytes", required_argument, 0, OPT_COALESCE_BYTES },
+	{ "jumbo", required_argument, 0, OPT_JUMBO },
+	{ "max-streams", required_argument, 0, OPT_MAX_STREAMS },
+	{ "high-water", required_argument, 0, OPT_HIGH_WATER },
+	{ "stats-port", required_argument, 0, OPT_STATS_PORT },
 	{ "max-connection-age", required_argument, 0, 'M' },
+	{ "max-sessions", required_argument, 0, 'm' },
+	{ "max-client-sessions", required_argument, 0,
+	  OPT_MAX_CLIENT_SESSIONS },
+	{ "session-rate", required_argument, 0, OPT_SESSION_RATE },
+	{ "workers", required_argument, 0, 'w' },
+#ifdef USE_SPLICE
+	{ "no-splice", no_argument, 0, OPT_NO_SPLICE },
+#endif
 	{ 0, 0, 0, 0 }
       };
 
-      static const char *short_options = "c:d:F:hk:M:p:SV"
+      static const char *short_options = "c:d:F:hk:m:M:p:SVw:"
 #ifdef DEBUG_MODE
 	"D:l:"
 #endif
@@ -127,7 +617,147 @@ parse_arguments (int argc, char **argv, Arguments *arg)
 	  break;
 	  
 	case 'c':
-	  arg->content_length = atoi_with_postfix (optarg);
+	  if (strcmp (optarg, "auto") == 0)
+	    arg->content_length_auto = TRUE;
+	  else
+	    arg->content_length = atoi_with_postfix (optarg);
+	  break;
+
+	case OPT_MIN_CONTENT_LENGTH:
+	  arg->min_content_length = atoi_with_postfix (optarg);
+	  break;
+
+	case OPT_MAX_CONTENT_LENGTH:
+	  arg->max_content_length = atoi_with_postfix (optarg);
+	  break;
+
+	case OPT_BUFFER_MEMORY:
+	  arg->buffer_memory = atoi_with_postfix (optarg);
+	  break;
+
+	case OPT_COALESCE_USEC:
+	  arg->coalesce_usec = atoi (optarg);
+	  break;
+
+	case OPT_COALESCE_BYTES:
+	  arg->coalesce_bytes = atoi_with_postfix (optarg);
+	  break;
+
+	case OPT_STATS_PORT:
+	  {
+	    char *p = strrchr (optarg, ':');
+
+	    if (p == NULL)
+	      {
+		arg->stats_host = "127.0.0.1";
+		arg->stats_port = atoi (optarg);
+	      }
+	    else
+	      {
+		*p = 0;
+		arg->stats_host = optarg;
+		arg->stats_port = atoi (p + 1);
+	      }
+	    if (arg->stats_port <= 0)
+	      {
+		fprintf (stderr, "%s: you must specify a port number.\n"
+			         "%s: try '%s --help' for help.\n",
+			 arg->me, arg->me, arg->me);
+		exit (1);
+	      }
+	  }
+	  break;
+
+	case OPT_HIGH_WATER:
+	  arg->high_water = atoi_with_postfix (optarg);
+	  break;
+
+	case OPT_MAX_STREAMS:
+	  arg->max_streams = atoi (optarg);
+	  break;
+
+	case OPT_JUMBO:
+	  arg->jumbo = atoi_with_postfix (optarg);
+	  break;
+
+	case OPT_IDLE_TIMEOUT:
+	  arg->idle_timeout = atoi (optarg);
+	  break;
+
+	case OPT_DRAIN_TIMEOUT:
+	  arg->drain_timeout = atoi (optarg);
+	  break;
+
+	case OPT_FOREGROUND:
+	  arg->foreground = TRUE;
+	  break;
+
+	case OPT_MAX_CLIENT_SESSIONS:
+	  arg->max_client_sessions = atoi (optarg);
+	  break;
+
+	case OPT_SESSION_RATE:
+	  arg->session_rate = atoi_with_postfix (optarg);
+	  break;
+
+	case OPT_INETD:
+	  arg->inetd = TRUE;
+	  arg->foreground = TRUE;
+	  break;
+
+	case OPT_DNS_TTL:
+	  arg->dns_ttl = atoi (optarg);
+	  break;
+
+	case OPT_FORWARD_POOL:
+	  arg->forward_pool = atoi (optarg);
+	  break;
+
+	case OPT_CHUNKED:
+	  if (optarg == NULL || strcmp (optarg, "offered") == 0)
+	    arg->chunked = CHUNKED_OFFERED;
+	  else if (strcmp (optarg, "always") == 0)
+	    arg->chunked = CHUNKED_ALWAYS;
+	  else
+	    {
+	      fprintf (stderr, "%s: --chunked takes \"offered\" or "
+		                   "\"always\".\n"
+		               "%s: try '%s --help' for help.\n",
+		       arg->me, arg->me, arg->me);
+	      exit (1);
+	    }
+	  break;
+
+	case OPT_COMPRESS:
+	  if (!compress_methods_valid (optarg))
+	    {
+	      fprintf (stderr, "%s: --compress takes a list of methods "
+		                   "like \"zstd,lz4\".\n"
+		               "%s: try '%s --help' for help.\n",
+		       arg->me, arg->me, arg->me);
+	      exit (1);
+	    }
+	  arg->compress = optarg;
+	  break;
+
+	case OPT_PERSISTENT:
+	  arg->persistent = TRUE;
+	  break;
+
+	case OPT_BALANCE:
+	  if (strcmp (optarg, "round-robin") == 0)
+	    arg->balance = BALANCE_ROUND_ROBIN;
+	  else if (strcmp (optarg, "least-connections") == 0)
+	    arg->balance = BALANCE_LEAST_CONNECTIONS;
+	  else if (strcmp (optarg, "hash") == 0)
+	    arg->balance = BALANCE_HASH;
+	  else
+	    {
+	      fprintf (stderr, "%s: unknown --balance method %s.\n"
+		               "%s: try '%s --help' for help.\n",
+		       arg->me, optarg, arg->me, arg->me);
+	      exit (1);
+	    }
 	  break;
 
 	case 'd':
@@ -151,17 +781,31 @@ parse_arguments (int argc, char **argv, Arguments *arg)
 	      log_exit (1);
 	    }
 	  break;
+
+	case OPT_LOG_RATE:
+	  arg->log_rate = atoi (optarg);
+	  break;
 #endif /* DEBUG_MODE */
 
 	case 'F':
-	  name_and_port (optarg, &arg->forward_host, &arg->forward_port);
-	  if (arg->forward_port == -1)
+	  if (arg->nforwards == MAX_FORWARDS)
+	    {
+	      fprintf (stderr, "%s: at most %d --forward-port are allowed.\n",
+		       arg->me, MAX_FORWARDS);
+	      exit (1);
+	    }
+	  name_and_port (optarg, &arg->forward_hosts[arg->nforwards],
+			 &arg->forward_ports[arg->nforwards]);
+	  if (arg->forward_ports[arg->nforwards] == -1)
 	    {
 	      fprintf (stderr, "%s: you must specify a port number.\n"
 		               "%s: try '%s --help' for help.\n",
 		       arg->me, arg->me, arg->me);
 	      exit (1);
 	    }
+	  arg->forward_host = arg->forward_hosts[0];
+	  arg->forward_port = arg->forward_ports[0];
+	  arg->nforwards++;
 	  break;
 
 	case 'h':
@@ -172,6 +816,11 @@ parse_arguments (int argc, char **argv, Arguments *arg)
 	  arg->keep_alive = atoi (optarg);
 	  break;
 
+	case 'm':
+	  arg->max_sessions = atoi (optarg);
+	  max_sessions_given = TRUE;
+	  break;
+
 	case 'M':
 	  arg->max_connection_age = atoi (optarg);
 	  break;
@@ -188,6 +837,14 @@ parse_arguments (int argc, char **argv, Arguments *arg)
 	  arg->pid_filename = optarg;
 	  break;
 
+	case 'w':
+	  arg->workers = atoi (optarg);
+	  break;
+
+	case OPT_NO_SPLICE:
+	  arg->splice = FALSE;
+	  break;
+
 	case '?':
 	  break;
 
@@ -221,6 +878,107 @@ parse_arguments (int argc, char **argv, Arguments *arg)
       exit (1);
     }
 
+  if (arg->max_streams < 0
+      || (arg->max_streams > 0 && arg->forward_port == -1))
+    {
+      fprintf (stderr, "%s: --max-streams needs --forward-port and a "
+	                   "positive number.\n"
+	               "%s: try '%s --help' for help.\n",
+	       arg->me, arg->me, arg->me);
+      exit (1);
+    }
+
+  if (arg->forward_pool < 0
+      || (arg->forward_pool > 0 && arg->forward_port == -1))
+    {
+      fprintf (stderr, "%s: --forward-pool needs --forward-port and a "
+	                   "positive size.\n"
+	               "%s: try '%s --help' for help.\n",
+	       arg->me, arg->me, arg->me);
+      exit (1);
+    }
+
+  if (arg->max_sessions < 1)
+    {
+      fprintf (stderr, "%s: --max-sessions must be at least 1.\n"
+	               "%s: try '%s --help' for help.\n",
+	       arg->me, arg->me, arg->me);
+      exit (1);
+    }
+
+  if (arg->chunked != CHUNKED_NEVER && arg->strict_content_length)
+    {
+      fprintf (stderr, "%s: --chunked can't be used together with "
+	                   "--strict-content-length.\n"
+	               "%s: try '%s --help' for help.\n",
+	       arg->me, arg->me, arg->me);
+      exit (1);
+    }
+
+  if (arg->jumbo > TUNNEL_JDATA_MAX)
+    {
+      fprintf (stderr, "%s: --jumbo can't be more than %d.\n"
+	               "%s: try '%s --help' for help.\n",
+	       arg->me, TUNNEL_JDATA_MAX, arg->me, arg->me);
+      exit (1);
+    }
+  if (arg->jumbo <= TUNNEL_DATA_MAX)
+    arg->jumbo = 0;
+
+  if (arg->coalesce_usec < 0 || arg->coalesce_bytes == 0
+      || arg->coalesce_bytes > frame_max (arg))
+    {
+      fprintf (stderr, "%s: --coalesce-bytes must be between 1 and %d, "
+	                   "and --coalesce-usec can't be negative.\n"
+	               "%s: try '%s --help' for help.\n",
+	       arg->me, (int)frame_max (arg), arg->me, arg->me);
+      exit (1);
+    }
+
+  if (arg->min_content_length > arg->max_content_length)
+    {
+      fprintf (stderr, "%s: --min-content-length is larger than "
+	                   "--max-content-length.\n"
+	               "%s: try '%s --help' for help.\n",
+	       arg->me, arg->me, arg->me);
+      exit (1);
+    }
+
+  /* An adaptive tunnel starts at the given size, within bounds.  */
+  if (arg->content_length_auto)
+    {
+      if (arg->content_length < arg->min_content_length)
+	arg->content_length = arg->min_content_length;
+      if (arg->content_length > arg->max_content_length)
+	arg->content_length = arg->max_content_length;
+    }
+
+  if (arg->workers < 1)
+    {
+      fprintf (stderr, "%s: --workers must be at least 1.\n"
+	               "%s: try '%s --help' for help.\n",
+	       arg->me, arg->me, arg->me);
+      exit (1);
+    }
+
+  if (arg->inetd && arg->workers > 1)
+    {
+      fprintf (stderr, "%s: inetd passes one socket, so --inetd can't "
+	                   "be used with --workers.\n"
+	               "%s: try '%s --help' for help.\n",
+	       arg->me, arg->me, arg->me);
+      exit (1);
+    }
+
+  if (arg->device != NULL && (arg->max_sessions > 1 || arg->workers > 1))
+    {
+      fprintf (stderr, "%s: --device can't be shared by more than one "
+	                   "session.\n"
+	               "%s: try '%s --help' for help.\n",
+	       arg->me, arg->me, arg->me);
+      exit (1);
+    }
+
   if (debug_level == 0 && debug_file != NULL)
     {
       fprintf (stderr, "%s: --logfile can't be used without debugging\n",
@@ -235,74 +993,3345 @@ parse_arguments (int argc, char **argv, Arguments *arg)
       usage (stderr, arg->me);
       exit (1);
     }
-}
-
-int
-main (int argc, char **argv)
-{
-  int closed;
-  int fd = -1;
-  Arguments arg;
-  Tunnel *tunnel;
-  FILE *pid_file;
-
-  parse_arguments (argc, argv, &arg);
-
-  if (debug_level == 0 || debug_file != NULL)
-    daemon (0, 1);
-
-#ifdef DEBUG_MODE
-  if (debug_level != 0 && debug_file == NULL)
-    debug_file = stdout;
-#else
-  openlog ("hts", LOG_PID, LOG_DAEMON);
-#endif
-
-  log_notice ("hts (%s) %s started with arguments:", PACKAGE, VERSION);
-  log_notice ("  me = %s", arg.me);
-  log_notice ("  device = %s", arg.device ? arg.device : "(null)");
-  log_notice ("  port = %d", arg.port);
-  log_notice ("  forward_port = %d", arg.forward_port);
-  log_notice ("  forward_host = %s",
-	      arg.forward_host ? arg.forward_host : "(null)");
-  log_notice ("  content_length = %d", arg.content_length);
-  log_notice ("  debug_level = %d", debug_level);
-  log_notice ("  pid_filename = %s",
-	      arg.pid_filename ? arg.pid_filename : "(null)");
 
-  tunnel = tunnel_new_server (arg.port, arg.content_length);
-  if (tunnel == NULL)
+  if (arg->max_client_sessions < 0)
     {
-      log_error ("couldn't create tunnel", argv[0]);
-      log_exit (1);
+      fprintf (stderr, "%s: --max-client-sessions can't be negative.\n"
+	               "%s: try '%s --help' for help.\n",
+	       arg->me, arg->me, arg->me);
+      exit (1);
     }
 
+  /* Sessions share the listening socket, so a spare slot lets hts
+     accept a client over the limit and answer it, instead of leaving
+     it in the backlog.  Only when some limit was asked for; by
+     default hts serves one session at a time, as it always has.  */
+  arg->session_limit = arg->max_sessions;
+  if (max_sessions_given || arg->max_client_sessions > 0
+      || arg->session_rate > 0)
+    arg->max_sessions++;
+}
+
+static void
+tunnel_configure (Tunnel *tunnel, Arguments *arg)
+{
   if (tunnel_setopt (tunnel, "strict_content_length",
-		     &arg.strict_content_length) == -1)
+		     &arg->strict_content_length) == -1)
     log_debug ("tunnel_setopt strict_content_length error: %s",
 	       strerror (errno));
 
   if (tunnel_setopt (tunnel, "keep_alive",
-		     &arg.keep_alive) == -1)
+		     &arg->keep_alive) == -1)
     log_debug ("tunnel_setopt keep_alive error: %s", strerror (errno));
 
   if (tunnel_setopt (tunnel, "max_connection_age",
-		     &arg.max_connection_age) == -1)
+		     &arg->max_connection_age) == -1)
     log_debug ("tunnel_setopt max_connection_age error: %s", strerror (errno));
 
-#ifdef DEBUG_MODE
-  signal (SIGPIPE, log_sigpipe);
-#else
-  signal (SIGPIPE, SIG_IGN);
-#endif
+  if (arg->persistent
+      && tunnel_setopt (tunnel, "persistent", &arg->persistent) == -1)
+    log_error ("tunnel_setopt persistent error: %s", strerror (errno));
 
-  if(arg.pid_filename != NULL)
-    {
-      pid_file = fopen (arg.pid_filename, "w+");
+  if (arg->chunked != CHUNKED_NEVER
+      && tunnel_setopt (tunnel, "chunked", &arg->chunked) == -1)
+    log_error ("tunnel_setopt chunked error: %s", strerror (errno));
+
+  if (arg->compress != NULL
+      && tunnel_setopt (tunnel, "compress", arg->compress) == -1)
+    log_error ("tunnel_setopt compress error: %s", strerror (errno));
+
+  if (arg->jumbo > 0
+      && tunnel_setopt (tunnel, "jumbo", &arg->jumbo) == -1)
+    log_error ("tunnel_setopt jumbo error: %s", strerror (errno));
+
+  if (arg->max_streams > 0
+      && tunnel_setopt (tunnel, "mux", &arg->max_streams) == -1)
+    log_error ("tunnel_setopt mux error: %s", strerror (errno));
+}
+
+/* Create the tunnel for an additional session slot.  It doesn't bind
+   a socket of its own, but accepts on the listening socket of the
+   first tunnel.  */
+
+static Tunnel *
+session_tunnel_new (Arguments *arg, int server_fd)
+{
+  Tunnel *tunnel;
+
+  tunnel = tunnel_new_server (-1, arg->content_length);
+  if (tunnel == NULL)
+    return NULL;
+
+  if (tunnel_setopt (tunnel, "server_socket", &server_fd) == -1)
+    {
+      log_debug ("tunnel_setopt server_socket error: %s", strerror (errno));
+      tunnel_destroy (tunnel);
+      return NULL;
+    }
+
+  tunnel_configure (tunnel, arg);
+  return tunnel;
+}
+
+/* Forwarding without copying through user space.  The tunnel writes
+   the header of a TUNNEL_DATA request and does the Content-Length
+   bookkeeping when its "data_header" option is set.  The payload is
+   then moved straight to the GET connection, which the "out_fd"
+   option returns.  From a socket the data goes through a pipe with
+   splice (); from a regular file, sendfile () moves it directly.
+   A regular file which has to go through tunnel_write () is mapped,
+   so that it isn't copied into a buffer first.  Terminals can't be
+   spliced, and are read in batches by session_drain () instead.  */
+
+static void
+session_map (Session *session, size_t len)
+{
+  if (session->map != NULL)
+    munmap (session->map, session->map_len);
+  session->map = NULL;
+  session->map_len = 0;
+  if (len == 0)
+    return;
+
+  session->map = mmap (NULL, len, PROT_READ, MAP_SHARED, session->fd, 0);
+  if (session->map == MAP_FAILED)
+    {
+      log_debug ("mmap error: %s", strerror (errno));
+      session->map = NULL;
+      return;
+    }
+  session->map_len = len;
+}
+
+static void
+session_splice_open (Server *server, Session *session)
+{
+  struct stat st;
+  int regular;
+
+  session->pipe[0] = session->pipe[1] = -1;
+  session->sendfile = FALSE;
+  session->map = NULL;
+  session->map_len = 0;
+  session->tty = session->fd != -1 && isatty (session->fd);
+  regular = (session->fd != -1 && fstat (session->fd, &st) == 0
+	     && S_ISREG (st.st_mode));
+
+#ifdef USE_SPLICE
+  /* Compressed or coalesced data has to go through tunnel_write ().  */
+  if (server->arg->splice && session->compress == NULL
+      && server->arg->coalesce_usec == 0 && session->fd != -1
+      && !session->tty)
+    {
+      if (regular)
+	session->sendfile = TRUE;
+      else if (server->npipes > 0)
+	{
+	  server->npipes--;
+	  session->pipe[0] = server->pipes[server->npipes][0];
+	  session->pipe[1] = server->pipes[server->npipes][1];
+	}
+      else if (pipe (session->pipe) == -1)
+	{
+	  log_debug ("pipe error: %s", strerror (errno));
+	  session->pipe[0] = session->pipe[1] = -1;
+	}
+
+#ifdef F_SETPIPE_SZ
+      /* A jumbo request should fit in the pipe in one go.  */
+      if (session->pipe[1] != -1 && session->frame_max > TUNNEL_DATA_MAX)
+	fcntl (session->pipe[1], F_SETPIPE_SZ, (int)session->frame_max);
+#endif
+    }
+#endif
+
+  if (regular && !session->sendfile
+      && (off_t)(size_t)st.st_size == st.st_size)
+    {
+      session->map_pos = lseek (session->fd, 0, SEEK_CUR);
+      if (session->map_pos != -1)
+	session_map (session, st.st_size);
+    }
+}
+
+/* Keep the pipe for the next session if it's empty.  */
+
+static void
+session_splice_close (Server *server, Session *session)
+{
+  if (session->pipe[0] != -1)
+    {
+      int n = -1;
+
+#ifdef FIONREAD
+      if (ioctl (session->pipe[0], FIONREAD, &n) == -1)
+	n = -1;
+#endif
+      if (n == 0 && server->arg->splice
+	  && server->npipes < server->arg->max_sessions)
+	{
+	  server->pipes[server->npipes][0] = session->pipe[0];
+	  server->pipes[server->npipes][1] = session->pipe[1];
+	  server->npipes++;
+	}
+      else
+	{
+	  close (session->pipe[0]);
+	  close (session->pipe[1]);
+	}
+      session->pipe[0] = session->pipe[1] = -1;
+    }
+  session->sendfile = FALSE;
+  session_map (session, 0);
+}
+
+#ifdef USE_SPLICE
+/* Ask the tunnel to write the header for LEN bytes of data, and
+   return the descriptor the data should be written to.  */
+
+static int
+splice_header (Session *session, Arguments *arg, size_t len)
+{
+  int out_fd;
+
+  if (tunnel_setopt (session->tunnel, "data_header", &len) == -1
+      || tunnel_getopt (session->tunnel, "out_fd", &out_fd) == -1)
+    {
+      /* EMSGSIZE means the data doesn't fit in the current request,
+	 and the tunnel has to split it.  Anything else means the
+	 tunnel can't do this at all.  */
+      if (errno != EMSGSIZE)
+	{
+	  log_notice ("tunnel can't splice, copying data instead: %s",
+		      strerror (errno));
+	  arg->splice = FALSE;
+	}
+      return -1;
+    }
+
+  return out_fd;
+}
+
+/* After a failed sendfile () or splice () of data whose header is
+   out, whether to try the rest again.  The tunnel's socket is
+   blocking, but if it isn't, wait until it has room.  */
+
+static int
+splice_retry (int out_fd)
+{
+  struct pollfd pfd;
+
+  if (errno == EINTR)
+    return TRUE;
+  if (errno != EAGAIN)
+    return FALSE;
+  pfd.fd = out_fd;
+  pfd.events = POLLOUT;
+  return poll (&pfd, 1, -1) != -1 || errno == EINTR;
+}
+
+/* The header has promised LEN more bytes which can't be sent.
+   Anything else would be taken for them, so the session has to go.  */
+
+static int
+splice_short (size_t len, ssize_t m)
+{
+  if (m == 0)
+    log_error ("fd ended %lu bytes short of a request, closing",
+	       (unsigned long)len);
+  else
+    log_error ("couldn't send the last %lu bytes of a request, "
+	       "closing: %s", (unsigned long)len, strerror (errno));
+  return -1;
+}
+
+/* Move at most one TUNNEL_DATA request worth of data from the
+   session's fd to the tunnel.  Returns the number of bytes moved,
+   0 at end of file, or -1 on error, like handle_device_input ().  */
+
+static int
+session_splice (Server *server, Session *session)
+{
+  Arguments *arg = server->arg;
+  ssize_t n, m;
+  size_t len, done;
+  int out_fd;
+
+  if (session->sendfile)
+    {
+      struct stat st;
+      off_t pos;
+
+      pos = lseek (session->fd, 0, SEEK_CUR);
+      if (pos == -1 || fstat (session->fd, &st) == -1)
+	return -1;
+      if (st.st_size <= pos)
+	return 0;
+
+      len = st.st_size - pos;
+      if (len > session->frame_max)
+	len = session->frame_max;
+
+      out_fd = splice_header (session, arg, len);
+      if (out_fd == -1)
+	return handle_device_input (session->tunnel, session->fd, POLLIN);
+
+      /* The file may have been cut short since fstat ().  */
+      for (done = 0; done < len; )
+	{
+	  m = sendfile (out_fd, session->fd, NULL, len - done);
+	  if (m > 0)
+	    done += m;
+	  else if (m == 0 || !splice_retry (out_fd))
+	    return splice_short (len - done, m);
+	}
+      return len;
+    }
+
+  n = splice (session->fd, NULL, session->pipe[1], NULL, session->frame_max,
+	      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  log_annoying ("splice (%d, %d) = %d", session->fd, session->pipe[1],
+		(int)n);
+  if (n == -1 && errno == EINVAL)
+    {
+      /* Like a tun device.  */
+      log_debug ("can't splice from fd %d, copying", session->fd);
+      session_splice_close (server, session);
+      return handle_device_input (session->tunnel, session->fd, POLLIN);
+    }
+  /* End of file is seen here, before there is a header.  */
+  if (n <= 0)
+    return n;
+
+  out_fd = splice_header (session, arg, n);
+  if (out_fd == -1)
+    {
+      /* Fall back to copying what's already in the pipe.  */
+      if (read_all (session->pipe[0], session->buf, n) != n)
+	return -1;
+      if (!arg->splice)
+	session_splice_close (server, session);
+      return tunnel_write (session->tunnel, session->buf, n);
+    }
+
+  /* Only what the header announced, which is all in the pipe.  */
+  for (done = 0; done < (size_t)n; )
+    {
+      m = splice (session->pipe[0], NULL, out_fd, NULL, n - done,
+		  SPLICE_F_MOVE);
+      if (m > 0)
+	done += m;
+      else if (m == 0 || !splice_retry (out_fd))
+	return splice_short (n - done, m);
+    }
+
+  return n;
+}
+#endif /* USE_SPLICE */
+
+/* Send at most one TUNNEL_DATA request worth of a mapped file, from
+   the fd's offset.  A file that has grown is mapped again.  Returns
+   like handle_device_input ().  */
+
+static int
+session_map_input (Session *session)
+{
+  struct stat st;
+  size_t len;
+
+  if (session->map_pos >= (off_t)session->map_len)
+    {
+      if (fstat (session->fd, &st) == -1)
+	return -1;
+      if (st.st_size <= session->map_pos)
+	return 0;
+      session_map (session, st.st_size);
+      if (session->map == NULL)
+	return handle_device_input (session->tunnel, session->fd, POLLIN);
+    }
+
+  len = session->map_len - session->map_pos;
+  if (len > session->frame_max)
+    len = session->frame_max;
+  if (tunnel_write (session->tunnel, session->map + session->map_pos,
+		    len) == -1)
+    return -1;
+
+  /* Writes from the tunnel go after what has been read, as they
+     would with read ().  */
+  session->map_pos += len;
+  if (lseek (session->fd, session->map_pos, SEEK_SET) == -1)
+    return -1;
+  return len;
+}
+
+/* Send the data held in the session's buffer as one TUNNEL_DATA.  */
+
+static int
+session_flush (Session *session)
+{
+  Server *server = session->server;
+
+  timer_del (server->timers, &session->coalesce);
+  if (session->held == 0)
+    return 0;
+  if (tunnel_write (session->tunnel, session->buf, session->held) == -1)
+    return -1;
+  PROBE2 (data__out, SLOT (session), session->held);
+  session->held = 0;
+  stats_record (&server->stats->hist[HIST_DEVICE_TO_TUNNEL],
+		timer_now_usec () - session->held_usec);
+  session->stats->frames_out++;
+  server->stats->frames_out++;
+  return 0;
+}
+
+/* Read from a terminal without blocking, whose descriptor is shared
+   with the tunnel's blocking writes.  FIONREAD says how much is there.
+   When the loop has just said that it's readable but nothing is, the
+   terminal has hung up, and read () returns 0.  */
+
+static ssize_t
+tty_read (int fd, char *buf, size_t len, int woken)
+{
+  int avail = 0;
+
+  if (ioctl (fd, FIONREAD, &avail) == -1)
+    return -1;
+  if (avail == 0 && !woken)
+    {
+      errno = EAGAIN;
+      return -1;
+    }
+  if (avail > 0 && (size_t)avail < len)
+    len = avail;
+  return read (fd, buf, len);
+}
+
+/* Read everything the forwarded port, or a terminal device, has
+   ready, and pass it to the tunnel in as few TUNNEL_DATA requests as
+   possible: one per wakeup, unless more than frame_max bytes are
+   waiting.  This reads until EAGAIN, so the socket can be registered
+   edge-triggered, but no more than a --content-length worth at a
+   time, so that a fast port doesn't keep the other sessions waiting.
+   With --coalesce-usec, a small amount of data is held back for a
+   while in case more follows.  Returns like handle_device_input ().  */
+
+static int
+session_drain (Session *session)
+{
+  Arguments *arg = session->server->arg;
+  char *buf = session->buf;
+  size_t limit = arg->content_length;
+  int total = 0;
+  ssize_t n;
+
+  if (limit < session->frame_max)
+    limit = session->frame_max;
+
+  for (;;)
+    {
+      /* Changing an edge-triggered registration reports the fd
+	 again if it is still readable, after the others' turn.  A
+	 paused session is registered again when it resumes.  */
+      if ((size_t)total >= limit)
+	{
+	  if (session_flush (session) == -1)
+	    return -1;
+	  if (!session->throttled && !session->limited
+	      && event_refresh (session->server->loop, session->fd) == -1)
+	    log_error ("couldn't watch fd %d: %s", session->fd,
+		       strerror (errno));
+	  return total;
+	}
+
+      if (session->tty)
+	n = tty_read (session->fd, buf + session->held,
+		      session->frame_max - session->held, total == 0);
+      else
+	n = recv (session->fd, buf + session->held,
+		  session->frame_max - session->held, MSG_DONTWAIT);
+      log_annoying ("recv (%d, %d) = %d", session->fd,
+		    (int)(session->frame_max - session->held), (int)n);
+      if (n == -1 && errno == EINTR)
+	continue;
+      if (n > 0)
+	{
+	  /* It was there when the loop woke up.  */
+	  if (session->held == 0)
+	    session->held_usec = session->server->wakeup_usec;
+	  session->held += n;
+	  total += n;
+	  if (session->held < session->frame_max)
+	    continue;
+	}
+
+      /* Within the latency budget, wait for more to arrive.  */
+      if (n == -1 && errno == EAGAIN && arg->coalesce_usec > 0
+	  && session->held > 0 && session->held < arg->coalesce_bytes)
+	{
+	  Server *server = session->server;
+
+	  if (!timer_pending (&session->coalesce))
+	    timer_add (server->timers, &session->coalesce,
+		       timer_now () + (arg->coalesce_usec + 999) / 1000);
+	  return total > 0 ? total : -1;
+	}
+
+      if (n == -1)
+	{
+	  int saved_errno = errno;
+
+	  if (session_flush (session) == -1)
+	    return -1;
+	  errno = saved_errno;
+	}
+      else if (session_flush (session) == -1)
+	return -1;
+
+      if (n > 0)
+	continue;
+      else if (n == 0)
+	return 0;
+      else if (errno == EAGAIN && total > 0)
+	return total;
+      else
+	return -1;
+    }
+}
+
+/* Data is available from the device or forwarded port.  Returns the
+   number of bytes passed to the tunnel, or 0 or -1.  */
+
+static int
+session_device_input (Server *server, Session *session, int revents)
+{
+  int n;
+
+  if (!(revents & POLLIN))
+    {
+      handle_input ("device or port", session->tunnel, session->fd,
+		    revents, handle_device_input, &session->closed);
+      return 0;
+    }
+
+  if (session->map != NULL)
+    n = session_map_input (session);
+  else
+#ifdef USE_SPLICE
+  if (session->pipe[0] != -1 || session->sendfile)
+    n = session_splice (server, session);
+  else
+#endif
+  if (session->drain)
+    n = session_drain (session);
+  else
+    n = handle_device_input (session->tunnel, session->fd, revents);
+
+  /* session_drain () counts its own requests.  */
+  if (n > 0)
+    {
+      if (!session->drain)
+	{
+	  PROBE2 (data__out, SLOT (session), n);
+	  session->stats->frames_out++;
+	  server->stats->frames_out++;
+	  stats_record (&server->stats->hist[HIST_DEVICE_TO_TUNNEL],
+			timer_now_usec () - server->wakeup_usec);
+	}
+      session->stats->bytes_out += n;
+      server->stats->bytes_out += n;
+    }
+
+  if (n == 0 || (n == -1 && errno != EAGAIN))
+    {
+      if (n == 0)
+	log_debug ("device or port closed");
+      else
+	log_error ("device or port read error: %s", strerror (errno));
+      session->closed = TRUE;
+    }
+
+  return n;
+}
+
+/* Adaptive Content-Length, for --content-length auto.  A GET request
+   should take about CONTENT_LENGTH_SECONDS to fill at the session's
+   recent rate: bulk transfers get large requests and few reconnects,
+   interactive sessions small requests, which a buffering proxy has to
+   pass on sooner.
+
+   A proxy which buffers responses shows itself by the client sending
+   data only right after a GET request has been completed, instead of
+   right after any data.  Such sessions are kept at the minimum.  */
+
+#define CONTENT_LENGTH_SECONDS 4
+#define REPLY_MSEC 200		/* client data this soon is a reply */
+#define REPLY_SAMPLES 8
+
+static void
+adapt_init (Session *session, Arguments *arg)
+{
+  Adaptive *a = &session->adapt;
+  size_t length = a->length;
+
+  /* The previous session in this slot may have changed it.  */
+  if (length != 0 && length != arg->content_length)
+    tunnel_setopt (session->tunnel, "content_length", &arg->content_length);
+
+  memset (a, 0, sizeof *a);
+  a->length = arg->content_length;
+  a->cap = arg->max_content_length;
+  a->out_fd = -1;
+  a->since = timer_now ();
+}
+
+/* N bytes of data have been written to the tunnel.  */
+
+static void
+adapt_sent (Session *session, int n)
+{
+  Adaptive *a = &session->adapt;
+  int out_fd;
+
+  a->bytes += n;
+  a->write_msec = timer_now ();
+
+  /* The GET connection changes when a request has been filled.  */
+  if (tunnel_getopt (session->tunnel, "out_fd", &out_fd) == 0
+      && out_fd != a->out_fd)
+    {
+      a->out_fd = out_fd;
+      a->get_msec = a->write_msec;
+    }
+}
+
+/* Data has arrived from the client.  */
+
+static void
+adapt_received (Session *session, Arguments *arg)
+{
+  Adaptive *a = &session->adapt;
+  unsigned long t = timer_now ();
+
+  if (t - a->write_msec >= REPLY_MSEC)
+    return;
+
+  a->replies++;
+  if (t - a->get_msec < REPLY_MSEC)
+    a->rollover_replies++;
+
+  if (a->replies == REPLY_SAMPLES)
+    {
+      if (a->rollover_replies * 10 >= a->replies * 8)
+	{
+	  if (a->cap != arg->min_content_length)
+	    log_verbose ("proxy seems to buffer, using minimum "
+			 "Content-Length");
+	  a->cap = arg->min_content_length;
+	}
+      else
+	a->cap = arg->max_content_length;
+      a->replies = a->rollover_replies = 0;
+    }
+}
+
+/* Called about once per second.  */
+
+static void
+adapt_tick (Session *session, Arguments *arg, unsigned long t)
+{
+  Adaptive *a = &session->adapt;
+  size_t target;
+
+  if (t - a->since < 1000)
+    return;
+
+  a->rate = (3 * a->rate + 1000 * a->bytes / (t - a->since)) / 4;
+  a->bytes = 0;
+  a->since = t;
+
+  target = a->rate * CONTENT_LENGTH_SECONDS;
+  if (target < arg->min_content_length)
+    target = arg->min_content_length;
+  if (target > a->cap)
+    target = a->cap;
+
+  /* Don't bother the tunnel with small changes.  */
+  if (4 * target > 3 * a->length && 4 * target < 5 * a->length)
+    return;
+
+  if (tunnel_setopt (session->tunnel, "content_length", &target) == -1)
+    {
+      log_notice ("tunnel can't change Content-Length, using %lu: %s",
+		  (unsigned long)a->length, strerror (errno));
+      arg->content_length_auto = FALSE;
+      return;
+    }
+
+  log_verbose ("Content-Length %d -> %d (%lu bytes/s)",
+	       (int)a->length, (int)target, a->rate);
+  a->length = target;
+}
+
+/* Keep the registration of the session's tunnel in step with
+   tunnel_pollin_fd (), which changes when the client reconnects.
+   While a session waits for the client to reconnect, its tunnel polls
+   the shared listening socket.  That is registered only once, for the
+   server as a whole.  */
+
+/* Whether FD is a listening socket, rather than a client connection.
+   With only one session, tunnel.c listens on a socket of its own.  */
+
+static int
+fd_listening (Server *server, int fd)
+{
+#ifdef SO_ACCEPTCONN
+  int on = 0;
+  socklen_t len = sizeof on;
+#endif
+
+  if (fd == server->server_fd)
+    return TRUE;
+#ifdef SO_ACCEPTCONN
+  if (getsockopt (fd, SOL_SOCKET, SO_ACCEPTCONN, &on, &len) == 0)
+    return on != 0;
+#endif
+  return FALSE;
+}
+
+static void
+session_watch (Server *server, Session *session)
+{
+  int fd;
+
+  /* Client data has nowhere to go until the forwarded port is
+     connected, or while it is backed up.  */
+  if (session->closed || session->connecting || session->fd_full
+      || session->limited)
+    fd = -1;
+  else
+    fd = tunnel_pollin_fd (session->tunnel);
+  if (fd == session->tunnel_fd)
+    {
+      /* tunnel.c may have closed the descriptor and accepted a new
+	 connection under the same number.  */
+      if (fd != -1 && fd != server->server_fd)
+	event_refresh (server->loop, fd);
+      return;
+    }
+
+  if (session->tunnel_fd == server->server_fd && server->server_fd != -1)
+    server->nwaiting--;
+  else if (session->tunnel_fd != -1)
+    event_del (server->loop, session->tunnel_fd);
+
+  /* A client connection after the first is a reconnect.  The time
+     spent listening in between is the reconnect gap.  */
+  if (fd != -1 && fd_listening (server, fd))
+    {
+      if (session->gap_usec == 0)
+	{
+	  PROBE1 (disconnect, SLOT (session));
+	  session->gap_usec = timer_now_usec ();
+	}
+    }
+  else if (fd != -1 && (session->gap_usec != 0 || session->tunnel_fd != -1))
+    {
+      PROBE2 (reconnect, SLOT (session),
+	      session->gap_usec ? timer_now_usec () - session->gap_usec : 0);
+      session->stats->reconnects++;
+      server->stats->reconnects++;
+      if (session->gap_usec != 0)
+	stats_record (&server->stats->hist[HIST_RECONNECT_GAP],
+		      timer_now_usec () - session->gap_usec);
+      session->gap_usec = 0;
+    }
+
+  session->tunnel_fd = fd;
+  if (fd == -1)
+    return;
+
+  if (fd == server->server_fd)
+    server->nwaiting++;
+  else if (event_add (server->loop, fd, POLLIN, session) == -1)
+    log_error ("couldn't watch tunnel fd %d: %s", fd, strerror (errno));
+}
+
+/* Backpressure.  Writes to the tunnel and to fd block, so without
+   this a slow reader on one side makes hts stall on, or the kernel
+   buffer, everything from the other.  When the send queue of one side
+   passes --high-water, hts stops reading from the other side until
+   the queue is below half of that.  fd is then watched for POLLOUT.
+   The GET socket belongs to tunnel.c and may be replaced at any time,
+   so it's checked from a timer instead.  */
+
+static int
+send_queue (int fd)
+{
+  int n;
+
+#if defined (TIOCOUTQ)
+  if (ioctl (fd, TIOCOUTQ, &n) == 0)
+    return n;
+#elif defined (FIONWRITE)
+  if (ioctl (fd, FIONWRITE, &n) == 0)
+    return n;
+#endif
+  return -1;
+}
+
+/* Watch fd for what the session wants of it now.  With nothing to
+   watch for, fd isn't registered at all, since event_mod () to no
+   events would remove the registration anyway.  */
+
+static void
+session_fd_register (Server *server, Session *session)
+{
+  int events = 0;
+
+  /* Until then, fd is watched for the end of connect ().  */
+  if (session->fd == -1 || session->connecting)
+    return;
+
+  if (!session->throttled && !session->limited)
+    events |= POLLIN;
+  if (session->fd_full)
+    events |= POLLOUT;
+  if (events == 0)
+    {
+      event_del (server->loop, session->fd);
+      return;
+    }
+  if (session->drain && !session->fd_full)
+    events |= EVENT_EDGE;
+
+  if (event_mod (server->loop, session->fd, events, session) == -1
+      && (errno != ENOENT
+	  || event_add (server->loop, session->fd, events, session) == -1))
+    {
+      log_error ("couldn't watch fd %d: %s", session->fd, strerror (errno));
+      session->closed = TRUE;
+    }
+}
+
+static void
+session_backpressure (Server *server, Session *session)
+{
+  size_t high = server->arg->high_water;
+  int changed = FALSE;
+  int out_fd, q;
+
+  if (high == 0 || session->fd == -1 || session->connecting
+      || session->closed)
+    return;
+
+  if (tunnel_getopt (session->tunnel, "out_fd", &out_fd) == -1
+      || out_fd == -1 || (q = send_queue (out_fd)) == -1)
+    q = 0;
+  if (!session->throttled && q > (int)high)
+    {
+      log_verbose ("tunnel backed up, %d bytes queued", q);
+      session->throttled = changed = TRUE;
+      timer_add (server->timers, &session->throttle,
+		 timer_now () + THROTTLE_MSEC);
+    }
+  else if (session->throttled && q <= (int)(high / 2))
+    {
+      session->throttled = FALSE;
+      changed = TRUE;
+      timer_del (server->timers, &session->throttle);
+    }
+
+  q = send_queue (session->fd);
+  if (!session->fd_full && q > (int)high)
+    {
+      log_verbose ("device or port backed up, %d bytes queued", q);
+      session->fd_full = changed = TRUE;
+    }
+  else if (session->fd_full && q <= (int)(high / 2))
+    {
+      session->fd_full = FALSE;
+      changed = TRUE;
+    }
+
+  if (changed)
+    {
+      session_fd_register (server, session);
+      session_watch (server, session);
+    }
+}
+
+/* --session-rate.  A token bucket holding up to a second's worth of
+   bytes is charged with what each side has moved, and may go into
+   debt by one read.  In debt, the session reads neither side until
+   the bucket has paid it off.  */
+
+static void
+session_refill (Server *server, Session *session)
+{
+  unsigned long rate = server->arg->session_rate;
+  unsigned long now = timer_now ();
+  unsigned long msec = now - session->refilled;
+
+  if (msec >= 1000)
+    session->tokens = rate;
+  else
+    session->tokens += msec * (rate / 1000) + msec * (rate % 1000) / 1000;
+  if (session->tokens > (long)rate)
+    session->tokens = rate;
+  session->refilled = now;
+}
+
+/* Until the debt is paid.  */
+
+static unsigned long
+session_rate_wait (Server *server, Session *session)
+{
+  return (unsigned long)(-session->tokens * 1000.0
+			 / server->arg->session_rate) + 1;
+}
+
+static void
+session_charge (Server *server, Session *session, long bytes)
+{
+  unsigned long msec;
+
+  if (server->arg->session_rate == 0 || bytes <= 0 || session->closed)
+    return;
+
+  session_refill (server, session);
+  session->tokens -= bytes;
+  if (session->tokens >= 0 || session->limited)
+    return;
+
+  msec = session_rate_wait (server, session);
+  log_verbose ("over --session-rate, pausing for %lu ms", msec);
+  session->limited = TRUE;
+  server->stats->rate_limited++;
+  timer_add (server->timers, &session->rate, timer_now () + msec);
+  session_fd_register (server, session);
+  session_watch (server, session);
+}
+
+
+/* Close a stream without telling the client.  */
+
+static void
+stream_release (Server *server, Stream *stream)
+{
+  if (stream->events != 0)
+    event_del (server->loop, stream->fd);
+  close (stream->fd);
+  stream->fd = -1;
+  stream->events = 0;
+  free (stream->out);
+  stream->out = NULL;
+  stream->out_len = stream->out_size = 0;
+  if (stream->backend != NULL)
+    stream->backend->sessions--;
+  stream->backend = NULL;
+}
+
+static void
+session_timers_stop (Server *server, Session *session)
+{
+  timer_del (server->timers, &session->keep_alive);
+  timer_del (server->timers, &session->age);
+  timer_del (server->timers, &session->expire);
+  timer_del (server->timers, &session->adapt_timer);
+  timer_del (server->timers, &session->connect);
+  timer_del (server->timers, &session->coalesce);
+  timer_del (server->timers, &session->throttle);
+  timer_del (server->timers, &session->tcp_info);
+  timer_del (server->timers, &session->rate);
+}
+
+/* A jumbo session's buffer is as large as what it negotiated, and
+   comes from the heap, so that the pool's buffers can stay the size
+   of ordinary frames.  Jumbo buffers and the pool share
+   --buffer-memory.  If there isn't room, the session sends ordinary
+   frames.  */
+
+static void
+session_buffer_get (Server *server, Session *session)
+{
+  size_t limit = server->arg->buffer_memory;
+  size_t size = session->frame_max;
+
+  session->buf = NULL;
+  if (size > pool_buffer_size (server->pool))
+    {
+      if (limit == 0 || (pool_bytes (server->pool) + server->jumbo_bytes
+			 + size <= limit))
+	session->buf = malloc (size);
+      if (session->buf != NULL)
+	{
+	  server->jumbo_bytes += size;
+	  return;
+	}
+      log_verbose ("no memory for a jumbo buffer, sending %lu bytes "
+		   "at a time", (unsigned long)TUNNEL_DATA_MAX);
+      session->frame_max = TUNNEL_DATA_MAX;
+    }
+}
+
+static void
+session_buffer_put (Server *server, Session *session)
+{
+  if (session->buf != NULL
+      && session->frame_max > pool_buffer_size (server->pool))
+    {
+      free (session->buf);
+      server->jumbo_bytes -= session->frame_max;
+    }
+  else
+    pool_put (server->pool, session->buf);
+  session->buf = NULL;
+}
+
+static void
+session_close (Server *server, Session *session)
+{
+  int i;
+
+  log_debug ("closing tunnel");
+  PROBE1 (session__close, SLOT (session));
+  session->closed = TRUE;
+  session_timers_stop (server, session);
+  session_watch (server, session);
+  event_del (server->loop, session->fd);
+  close (session->fd);
+  session_splice_close (server, session);
+  if (session->mux)
+    for (i = 0; i < server->arg->max_streams; i++)
+      if (session->streams[i].fd != -1)
+	stream_release (server, &session->streams[i]);
+  session->mux = FALSE;
+  session_buffer_put (server, session);
+  session->held = 0;
+  session->gap_usec = 0;
+  tunnel_close (session->tunnel);
+  log_notice ("disconnected from %s", session->stats->peer);
+  session->stats->active = FALSE;
+  session->fd = -1;
+  if (session->backend != NULL)
+    session->backend->sessions--;
+  session->backend = NULL;
+  session->active = FALSE;
+  server->nactive--;
+  server->idle = NULL;
+}
+
+/* The throttle timer: check again whether the tunnel has drained,
+   and keep checking while the session is throttled.  */
+
+static void
+session_throttle (void *data)
+{
+  Session *session = data;
+  Server *server = session->server;
+
+  session_backpressure (server, session);
+  if (session->closed)
+    {
+      session_close (server, session);
+      return;
+    }
+  if (session->throttled && !timer_pending (&session->throttle))
+    timer_add (server->timers, &session->throttle,
+	       timer_now () + THROTTLE_MSEC);
+}
+
+/* The rate timer: resume the session once its debt has been paid.  */
+
+static void
+session_unlimit (void *data)
+{
+  Session *session = data;
+  Server *server = session->server;
+
+  session_refill (server, session);
+  if (session->tokens < 0)
+    {
+      timer_add (server->timers, &session->rate,
+		 timer_now () + session_rate_wait (server, session));
+      return;
+    }
+  session->limited = FALSE;
+  session_fd_register (server, session);
+  if (session->closed)
+    {
+      session_close (server, session);
+      return;
+    }
+  session_watch (server, session);
+}
+
+/* Sample connection FD into TCP, or clear TCP if there's nothing to
+   sample.  */
+
+static int
+tcp_sample (int fd, TcpSample *tcp)
+{
+#ifdef USE_TCP_INFO
+  struct tcp_info info;
+  socklen_t len = sizeof info;
+  int q;
+
+  if (fd != -1
+      && getsockopt (fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+    {
+      tcp->rtt_usec = info.tcpi_rtt;
+      tcp->rttvar_usec = info.tcpi_rttvar;
+      tcp->retransmits = info.tcpi_total_retrans;
+      tcp->cwnd = info.tcpi_snd_cwnd;
+      q = send_queue (fd);
+      tcp->send_queue = q == -1 ? 0 : q;
+      return 0;
+    }
+#endif
+  memset (tcp, 0, sizeof *tcp);
+  return -1;
+}
+
+static void
+session_tcp_info (void *data)
+{
+  Session *session = data;
+  Server *server = session->server;
+  SessionStats *stats = session->stats;
+  int out_fd, slow;
+
+  if (tunnel_getopt (session->tunnel, "out_fd", &out_fd) == -1)
+    out_fd = -1;
+  if (tcp_sample (out_fd, &stats->tunnel) == 0)
+    stats_record (&server->stats->hist[HIST_TUNNEL_RTT],
+		  stats->tunnel.rtt_usec);
+  if (server->arg->device == NULL && !session->connecting
+      && tcp_sample (session->fd, &stats->forward) == 0)
+    stats_record (&server->stats->hist[HIST_FORWARD_RTT],
+		  stats->forward.rtt_usec);
+
+  /* Without a forwarded port to compare with, a queue is enough.  */
+  slow = (session->throttled || stats->tunnel.send_queue > session->frame_max)
+    && stats->tunnel.rtt_usec > SLOW_PEER_RATIO * stats->forward.rtt_usec;
+  if (slow && !stats->slow)
+    {
+      log_notice ("%s: tunnel is the bottleneck: rtt %lu us, "
+		  "%lu bytes queued, %lu retransmits; forward rtt %lu us",
+		  stats->peer, stats->tunnel.rtt_usec,
+		  stats->tunnel.send_queue, stats->tunnel.retransmits,
+		  stats->forward.rtt_usec);
+      server->stats->slow_sessions++;
+    }
+  else if (!slow && stats->slow)
+    log_verbose ("%s: tunnel caught up", stats->peer);
+  stats->slow = slow;
+
+  timer_add (server->timers, &session->tcp_info, timer_now () + TCP_INFO_MSEC);
+}
+
+static void
+session_count_padding (Server *server, Session *session, int n)
+{
+  PROBE2 (padding, SLOT (session), n);
+  session->stats->paddings++;
+  server->stats->paddings++;
+  server->stats->padding_bytes += n;
+}
+
+/* The latency budget for held data is up.  */
+
+static void
+session_coalesce (void *data)
+{
+  Session *session = data;
+  Server *server = session->server;
+
+  if (session_flush (session) == -1)
+    {
+      log_error ("tunnel write error: %s", strerror (errno));
+      session_close (server, session);
+      return;
+    }
+  session->last_tunnel_write = timer_now ();
+  session_watch (server, session);
+}
+
+/* Send padding if nothing has been written to the tunnel for
+   --keep-alive seconds.  */
+
+static void
+session_keep_alive (void *data)
+{
+  Session *session = data;
+  Server *server = session->server;
+  unsigned long now = timer_now ();
+  unsigned long due;
+
+  due = session->last_tunnel_write + 1000UL * server->arg->keep_alive;
+  if ((long)(due - now) <= 0)
+    {
+      log_verbose ("keep-alive timeout");
+      tunnel_padding (session->tunnel, 1);
+      session_count_padding (server, session, 1);
+      session->last_tunnel_write = now;
+      session_watch (server, session);
+      due = now + 1000UL * server->arg->keep_alive;
+    }
+
+  timer_add (server->timers, &session->keep_alive, due);
+}
+
+/* The tunnel checks the age of its connection when it writes.  Make
+   sure it writes when the connection gets too old, even if
+   --keep-alive is longer than --max-connection-age.  */
+
+static void
+session_age (void *data)
+{
+  Session *session = data;
+  Server *server = session->server;
+
+  log_verbose ("max connection age reached");
+  tunnel_padding (session->tunnel, 1);
+  session_count_padding (server, session, 1);
+  session->last_tunnel_write = timer_now ();
+  session_watch (server, session);
+  timer_add (server->timers, &session->age,
+	     session->last_tunnel_write
+	     + 1000UL * server->arg->max_connection_age);
+}
+
+static void
+session_expire (void *data)
+{
+  Session *session = data;
+  Server *server = session->server;
+  unsigned long now = timer_now ();
+  unsigned long due;
+
+  due = session->last_activity + 1000UL * server->arg->idle_timeout;
+  if ((long)(due - now) <= 0)
+    {
+      log_notice ("closing idle session");
+      session->closed = TRUE;
+      session_close (server, session);
+      return;
+    }
+
+  timer_add (server->timers, &session->expire, due);
+}
+
+static void
+session_adapt (void *data)
+{
+  Session *session = data;
+  Server *server = session->server;
+  unsigned long now = timer_now ();
+
+  /* A chunked reply has no Content-Length to adapt.  */
+  if (!server->arg->content_length_auto || session->chunked)
+    return;
+  adapt_tick (session, server->arg, now);
+  timer_add (server->timers, &session->adapt_timer, now + 1000);
+}
+
+static void
+session_timers_start (Server *server, Session *session)
+{
+  Arguments *arg = server->arg;
+  unsigned long now = timer_now ();
+
+  timer_add (server->timers, &session->keep_alive,
+	     now + 1000UL * arg->keep_alive);
+  if (arg->max_connection_age > 0)
+    timer_add (server->timers, &session->age,
+	       now + 1000UL * arg->max_connection_age);
+  if (arg->idle_timeout > 0)
+    timer_add (server->timers, &session->expire,
+	       now + 1000UL * arg->idle_timeout);
+  if (arg->content_length_auto)
+    timer_add (server->timers, &session->adapt_timer, now + 1000);
+#ifdef USE_TCP_INFO
+  timer_add (server->timers, &session->tcp_info, now + TCP_INFO_MSEC);
+#endif
+}
+
+/* Looking a backend up may block for a long time, so only the lookup
+   at startup is done in line.  After that the address is cached for
+   --dns-ttl seconds, and then looked up again by a child process
+   while the old address stays in use.  */
+
+static int
+backend_resolve (Server *server, Backend *backend)
+{
+  if (set_address (&backend->addr, backend->host, backend->port) == -1)
+    return -1;
+  backend->resolved = TRUE;
+  backend->expires = timer_now () + 1000UL * server->arg->dns_ttl;
+  return 0;
+}
+
+static void
+backend_refresh (Server *server, Backend *backend)
+{
+  int p[2];
+
+  if (backend->resolver != -1
+      || (long)(timer_now () - backend->expires) < 0)
+    return;
+
+  if (pipe (p) == -1)
+    {
+      log_error ("pipe error: %s", strerror (errno));
+      return;
+    }
+
+  backend->resolver = fork ();
+  if (backend->resolver == 0)
+    {
+      struct sockaddr_in addr;
+
+      close (p[0]);
+      if (set_address (&addr, backend->host, backend->port) == 0)
+	write_all (p[1], &addr, sizeof addr);
+      _exit (0);
+    }
+
+  close (p[1]);
+  if (backend->resolver == -1)
+    {
+      log_error ("couldn't fork to look up %s: %s",
+		 backend->host, strerror (errno));
+      close (p[0]);
+      return;
+    }
+
+  backend->resolver_fd = p[0];
+  if (event_add (server->loop, p[0], POLLIN, backend) == -1)
+    log_error ("couldn't watch fd %d: %s", p[0], strerror (errno));
+}
+
+/* The child looking a backend up has something to say.  */
+
+static void
+backend_resolved (Server *server, Backend *backend)
+{
+  struct sockaddr_in addr;
+
+  if (read_all (backend->resolver_fd, &addr, sizeof addr) == sizeof addr)
+    {
+      log_debug ("%s is %s", backend->host, inet_ntoa (addr.sin_addr));
+      backend->addr = addr;
+      backend->resolved = TRUE;
+    }
+  else
+    log_error ("couldn't look up %s%s", backend->host,
+	       backend->resolved ? ", keeping the old address" : "");
+
+  backend->expires = timer_now () + 1000UL * server->arg->dns_ttl;
+  event_del (server->loop, backend->resolver_fd);
+  close (backend->resolver_fd);
+  waitpid (backend->resolver, NULL, 0);
+  backend->resolver = -1;
+  backend->resolver_fd = -1;
+}
+
+/* Passive health tracking: a backend which fails to connect
+   BACKEND_FAILURES times in a row is left alone for a while.  */
+
+static int
+backend_up (Backend *backend)
+{
+  return backend->resolved
+    && (long)(timer_now () - backend->down_until) >= 0;
+}
+
+static void
+backend_failed (Server *server, Backend *backend)
+{
+  server->stats->connect_failures++;
+  if (++backend->failures >= BACKEND_FAILURES)
+    {
+      if (backend->failures == BACKEND_FAILURES)
+	log_notice ("backend %s:%d is down", backend->host, backend->port);
+      backend->down_until = timer_now () + BACKEND_DOWN_MSEC;
+    }
+}
+
+static void
+backend_ok (Backend *backend)
+{
+  if (backend->failures >= BACKEND_FAILURES)
+    log_notice ("backend %s:%d is up", backend->host, backend->port);
+  backend->failures = 0;
+}
+
+static Backend *
+server_backend (Server *server, void *data)
+{
+  Backend *backend = data;
+
+  if (backend >= server->backends
+      && backend < server->backends + server->arg->nforwards)
+    return backend;
+  return NULL;
+}
+
+/* A hash of the client's address, so --balance hash can send the same
+   client to the same backend.  */
+
+static unsigned long
+session_client_hash (Session *session)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof addr;
+
+  if (getpeername (tunnel_pollin_fd (session->tunnel),
+		   (struct sockaddr *)&addr, &len) == -1
+      || addr.sin_family != AF_INET)
+    return 0;
+  return ntohl (addr.sin_addr.s_addr);
+}
+
+/* Note the client's address for logging and the admin port.  */
+
+static void
+session_peer (Session *session)
+{
+  SessionStats *stats = session->stats;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof addr;
+
+  memset (stats, 0, sizeof *stats);
+  session->addr = 0;
+  if (getpeername (tunnel_pollin_fd (session->tunnel),
+		   (struct sockaddr *)&addr, &len) == 0
+      && addr.sin_family == AF_INET)
+    {
+      session->addr = ntohl (addr.sin_addr.s_addr);
+      sprintf (stats->peer, "%s:%d",
+	       inet_ntoa (addr.sin_addr), ntohs (addr.sin_port));
+    }
+  else
+    strcpy (stats->peer, "unknown");
+}
+
+static unsigned long
+hash_mix (unsigned long x)
+{
+  x &= 0xffffffffUL;
+  x = ((x >> 16) ^ x) * 0x45d9f3bUL & 0xffffffffUL;
+  x = ((x >> 16) ^ x) * 0x45d9f3bUL & 0xffffffffUL;
+  return (x >> 16) ^ x;
+}
+
+/* Pick a backend for a new session.  Backends that are down are only
+   used when all of them are.  Hashing scores every backend against
+   the client and takes the highest, so a client only moves when its
+   backend goes down.  */
+
+static Backend *
+backend_pick (Server *server, Session *session)
+{
+  Arguments *arg = server->arg;
+  Backend *best = NULL;
+  unsigned long client = 0, score, best_score = 0;
+  int i, any_up = FALSE;
+
+  for (i = 0; i < arg->nforwards; i++)
+    if (backend_up (&server->backends[i]))
+      any_up = TRUE;
+
+  if (arg->balance == BALANCE_HASH)
+    client = session_client_hash (session);
+
+  for (i = 0; i < arg->nforwards; i++)
+    {
+      Backend *backend;
+
+      backend = &server->backends[(server->next_backend + i)
+				  % arg->nforwards];
+      if (any_up && !backend_up (backend))
+	continue;
+
+      switch (arg->balance)
+	{
+	case BALANCE_ROUND_ROBIN:
+	  server->next_backend = (backend - server->backends + 1)
+				 % arg->nforwards;
+	  return backend;
+
+	case BALANCE_LEAST_CONNECTIONS:
+	  score = ULONG_MAX - backend->sessions;
+	  break;
+
+	default:
+	  score = hash_mix (client ^ hash_mix (backend - server->backends));
+	  break;
+	}
+
+      if (best == NULL || score > best_score)
+	{
+	  best = backend;
+	  best_score = score;
+	}
+    }
+
+  /* Ties for the least connections go round robin.  */
+  if (best != NULL)
+    server->next_backend = (best - server->backends + 1) % arg->nforwards;
+  return best;
+}
+
+/* Start connecting to a backend without waiting for it.  */
+
+static int
+forward_socket (Backend *backend)
+{
+  int fd, flags;
+
+  fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+
+  flags = fcntl (fd, F_GETFL);
+  if (flags == -1
+      || fcntl (fd, F_SETFL, flags | O_NONBLOCK) == -1
+      || (connect (fd, (struct sockaddr *)&backend->addr,
+		   sizeof backend->addr) == -1
+	  && errno != EINPROGRESS))
+    {
+      int saved_errno = errno;
+      close (fd);
+      errno = saved_errno;
+      return -1;
+    }
+
+  return fd;
+}
+
+/* An idle connection is alive if reading it wouldn't return EOF or an
+   error.  A greeting from the backend is left for the session to
+   read.  */
+
+static int
+spare_alive (int fd)
+{
+  char c;
+  int n;
+
+  n = recv (fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n > 0 || (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+static void
+spare_schedule (Server *server, unsigned long msec)
+{
+  if (!timer_pending (&server->refill))
+    timer_add (server->timers, &server->refill, timer_now () + msec);
+}
+
+static void
+spare_drop (Server *server, Spare *spare)
+{
+  event_del (server->loop, spare->fd);
+  close (spare->fd);
+  spare->fd = -1;
+  spare->ready = FALSE;
+}
+
+/* Spares are spread over the backends by slot number.  */
+
+static void
+spare_refill (void *data)
+{
+  Server *server = data;
+  Arguments *arg = server->arg;
+  int i;
+
+  for (i = 0; i < arg->forward_pool; i++)
+    {
+      Spare *spare = &server->spares[i];
+
+      if (spare->fd != -1 || !backend_up (spare->backend))
+	continue;
+
+      spare->fd = forward_socket (spare->backend);
+      if (spare->fd == -1)
+	{
+	  log_debug ("couldn't connect spare to %s:%d: %s",
+		     spare->backend->host, spare->backend->port,
+		     strerror (errno));
+	  backend_failed (server, spare->backend);
+	  spare_schedule (server, SPARE_RETRY_MSEC);
+	  return;
+	}
+      if (event_add (server->loop, spare->fd, POLLOUT, spare) == -1)
+	{
+	  log_error ("couldn't watch fd %d: %s", spare->fd, strerror (errno));
+	  close (spare->fd);
+	  spare->fd = -1;
+	  return;
+	}
+    }
+}
+
+/* Something happened to an idle connection: either it's done
+   connecting, or the backend has closed it or said hello.  */
+
+static void
+spare_event (Server *server, Spare *spare)
+{
+  if (!spare->ready)
+    {
+      socklen_t len;
+      int error;
+
+      len = sizeof error;
+      if (getsockopt (spare->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+	error = errno;
+      if (error != 0)
+	{
+	  log_debug ("couldn't connect spare to %s:%d: %s",
+		     spare->backend->host, spare->backend->port,
+		     strerror (error));
+	  backend_failed (server, spare->backend);
+	  spare_drop (server, spare);
+	  spare_schedule (server, SPARE_RETRY_MSEC);
+	  return;
+	}
+      backend_ok (spare->backend);
+      spare->ready = TRUE;
+      event_mod (server->loop, spare->fd, POLLIN, spare);
+    }
+  else if (spare_alive (spare->fd))
+    {
+      /* Keep the greeting, but stop waking up for it.  */
+      event_mod (server->loop, spare->fd, 0, spare);
+    }
+  else
+    {
+      log_debug ("spare fd %d was closed", spare->fd);
+      spare_drop (server, spare);
+      spare_schedule (server, 0);
+    }
+}
+
+static Spare *
+server_spare (Server *server, void *data)
+{
+  Spare *spare = data;
+
+  if (server->spares != NULL && spare >= server->spares
+      && spare < server->spares + server->arg->forward_pool)
+    return spare;
+  return NULL;
+}
+
+/* Connect a new session to BACKEND, using an idle connection from
+   --forward-pool if there is a live one.  Either way the socket is
+   handed over non-blocking.  */
+
+static int
+forward_connect (Server *server, Backend *backend)
+{
+  int i, fd;
+
+  backend_refresh (server, backend);
+
+  for (i = 0; i < server->arg->forward_pool; i++)
+    {
+      Spare *spare = &server->spares[i];
+
+      if (!spare->ready || spare->backend != backend)
+	continue;
+
+      fd = spare->fd;
+      event_del (server->loop, fd);
+      spare->fd = -1;
+      spare->ready = FALSE;
+      spare_schedule (server, 0);
+      if (spare_alive (fd))
+	{
+	  log_debug ("using spare fd %d", fd);
+	  PROBE4 (forward__connect, backend->host, backend->port, fd, 1);
+	  server->stats->spare_hits++;
+	  return fd;
+	}
+      close (fd);
+    }
+
+  fd = forward_socket (backend);
+  PROBE4 (forward__connect, backend->host, backend->port, fd, 0);
+  return fd;
+}
+
+/* The session's socket to its backend has become writable, so
+   connect () is done, one way or the other.  */
+
+static void
+session_connected (Server *server, Session *session)
+{
+  Backend *backend = session->backend;
+  socklen_t len;
+  int error, flags;
+
+  len = sizeof error;
+  if (getsockopt (session->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+    error = errno;
+  PROBE3 (forward__connected, SLOT (session), session->fd, error);
+  if (error != 0)
+    {
+      log_error ("couldn't connect to %s:%d: %s\n",
+		 backend->host, backend->port, strerror (error));
+      backend_failed (server, backend);
+      session->closed = TRUE;
+      return;
+    }
+
+  /* The rest of hts expects a blocking socket.  */
+  flags = fcntl (session->fd, F_GETFL);
+  if (flags != -1)
+    fcntl (session->fd, F_SETFL, flags & ~O_NONBLOCK);
+
+  log_debug ("connected to %s:%d", backend->host, backend->port);
+  backend_ok (backend);
+  session->connecting = FALSE;
+  timer_del (server->timers, &session->connect);
+  session_fd_register (server, session);
+  session_watch (server, session);
+}
+
+static void
+session_connect_timeout (void *data)
+{
+  Session *session = data;
+  Server *server = session->server;
+
+  log_error ("timed out connecting to %s:%d\n",
+	     session->backend->host, session->backend->port);
+  backend_failed (server, session->backend);
+  session_close (server, session);
+}
+
+/* Streams.  A multiplexed session has no fd of its own.  The client
+   opens streams with MUX_OPEN, and each one is connected to a backend
+   picked like for a whole session.  Sending is limited by a window
+   per stream which the receiver opens again with MUX_WINDOW, so one
+   slow stream can't fill the tunnel.  The stream sockets are
+   non-blocking.  Data for a stream that is still connecting, or
+   whose socket is full, is queued until POLLOUT, and the client gets
+   no more window until the queue is empty.  The window bounds the
+   queue.  */
+
+static int
+stream_send (Session *session, int type, unsigned long id,
+	     unsigned long value)
+{
+  char head[MUX_HEADER_MAX];
+  size_t n;
+
+  n = mux_header (head, type, id, value);
+  if (tunnel_write (session->tunnel, head, n) == -1)
+    {
+      session->closed = TRUE;
+      return -1;
+    }
+  PROBE4 (mux__frame__out, SLOT (session), type, id, value);
+  session->server->stats->mux_frames_out++;
+  session->last_tunnel_write = timer_now ();
+  return 0;
+}
+
+static Stream *
+stream_find (Server *server, Session *session, unsigned long id)
+{
+  int i;
+
+  for (i = 0; i < server->arg->max_streams; i++)
+    if (session->streams[i].fd != -1 && session->streams[i].id == id)
+      return &session->streams[i];
+  return NULL;
+}
+
+static void
+stream_close (Server *server, Stream *stream)
+{
+  log_debug ("closing stream %lu", stream->id);
+  stream_send (stream->session, MUX_CLOSE, stream->id, 0);
+  stream_release (server, stream);
+}
+
+/* Watch the stream's socket for the end of connect (), for room for
+   queued data, and for data from the backend while the client has a
+   window open.  */
+
+static int
+stream_register (Server *server, Stream *stream)
+{
+  int events = 0, r = 0;
+
+  if (stream->connecting || stream->out_len > 0)
+    events |= POLLOUT;
+  if (!stream->connecting && !stream->paused)
+    events |= POLLIN;
+  if (events == stream->events)
+    return 0;
+
+  if (events == 0)
+    r = event_del (server->loop, stream->fd);
+  else if (stream->events == 0)
+    r = event_add (server->loop, stream->fd, events, stream);
+  else
+    r = event_mod (server->loop, stream->fd, events, stream);
+  if (r == -1)
+    {
+      log_error ("couldn't watch fd %d: %s", stream->fd, strerror (errno));
+      return -1;
+    }
+  stream->events = events;
+  return 0;
+}
+
+/* Open the window again once half of it has been written to the
+   backend, and nothing is waiting to be.  */
+
+static void
+stream_credit (Stream *stream)
+{
+  if (stream->out_len > 0 || stream->consumed < MUX_WINDOW_INITIAL / 2)
+    return;
+  stream_send (stream->session, MUX_WINDOW, stream->id, stream->consumed);
+  stream->consumed = 0;
+}
+
+/* Write LEN bytes of DATA from the client to the backend, and queue
+   what the socket won't take now.  */
+
+static int
+stream_write (Server *server, Stream *stream, const char *data, size_t len)
+{
+  size_t size;
+  ssize_t n;
+  char *p;
+
+  if (!stream->connecting && stream->out_len == 0)
+    {
+      n = write (stream->fd, data, len);
+      log_annoying ("write (%d, %d) = %d", stream->fd, (int)len, (int)n);
+      if (n == -1 && errno != EAGAIN && errno != EINTR)
+	return -1;
+      if (n > 0)
+	{
+	  stream->consumed += n;
+	  data += n;
+	  len -= n;
+	}
+    }
+  if (len == 0)
+    return 0;
+
+  if (stream->out_len + len > MUX_WINDOW_INITIAL)
+    {
+      log_error ("stream %lu sent more than its window", stream->id);
+      return -1;
+    }
+  if (stream->out_len + len > stream->out_size)
+    {
+      for (size = stream->out_size ? stream->out_size : MUX_DATA_MAX + 1;
+	   size < stream->out_len + len; size *= 2)
+	;
+      if (size > MUX_WINDOW_INITIAL)
+	size = MUX_WINDOW_INITIAL;
+      p = realloc (stream->out, size);
+      if (p == NULL)
+	{
+	  log_error ("no memory to queue data for stream %lu", stream->id);
+	  return -1;
+	}
+      stream->out = p;
+      stream->out_size = size;
+    }
+  memcpy (stream->out + stream->out_len, data, len);
+  stream->out_len += len;
+  return stream_register (server, stream);
+}
+
+/* The socket has room for queued data.  */
+
+static int
+stream_flush (Server *server, Stream *stream)
+{
+  ssize_t n;
+
+  n = write (stream->fd, stream->out, stream->out_len);
+  log_annoying ("write (%d, %d) = %d", stream->fd, (int)stream->out_len,
+		(int)n);
+  if (n == -1)
+    return errno == EAGAIN || errno == EINTR ? 0 : -1;
+  memmove (stream->out, stream->out + n, stream->out_len - n);
+  stream->out_len -= n;
+  stream->consumed += n;
+  stream_credit (stream);
+  return stream_register (server, stream);
+}
+
+static void
+stream_open (Server *server, Session *session, unsigned long id)
+{
+  Stream *stream = NULL;
+  Backend *backend;
+  int i, fd;
+
+  if (stream_find (server, session, id) != NULL)
+    {
+      log_error ("stream %lu opened twice", id);
+      return;
+    }
+
+  for (i = 0; i < server->arg->max_streams; i++)
+    if (session->streams[i].fd == -1)
+      {
+	stream = &session->streams[i];
+	break;
+      }
+
+  backend = backend_pick (server, session);
+  if (stream == NULL || backend == NULL)
+    {
+      log_verbose ("refusing stream %lu", id);
+      stream_send (session, MUX_CLOSE, id, 0);
+      return;
+    }
+
+  fd = forward_connect (server, backend);
+  if (fd == -1)
+    {
+      log_error ("couldn't connect to %s:%d: %s\n",
+		 backend->host, backend->port, strerror (errno));
+      backend_failed (server, backend);
+      stream_send (session, MUX_CLOSE, id, 0);
+      return;
+    }
+
+  log_debug ("stream %lu to %s:%d is fd %d",
+	     id, backend->host, backend->port, fd);
+  stream->id = id;
+  stream->fd = fd;
+  stream->connecting = TRUE;
+  stream->paused = FALSE;
+  stream->window = MUX_WINDOW_INITIAL;
+  stream->consumed = 0;
+  stream->events = 0;
+  stream->out_len = 0;
+  stream->backend = backend;
+  backend->sessions++;
+  if (stream_register (server, stream) == -1)
+    stream_close (server, stream);
+}
+
+static void
+stream_connected (Server *server, Stream *stream)
+{
+  struct sockaddr_in addr;
+  socklen_t len;
+  int error;
+
+  len = sizeof error;
+  if (getsockopt (stream->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+    error = errno;
+  if (error != 0)
+    {
+      log_error ("couldn't connect to %s:%d: %s\n",
+		 stream->backend->host, stream->backend->port,
+		 strerror (error));
+      backend_failed (server, stream->backend);
+      stream_close (server, stream);
+      return;
+    }
+
+  /* A stale event for a reused descriptor number.  */
+  len = sizeof addr;
+  if (getpeername (stream->fd, (struct sockaddr *)&addr, &len) == -1)
+    return;
+
+  backend_ok (stream->backend);
+  stream->connecting = FALSE;
+  if ((stream->out_len > 0 ? stream_flush (server, stream)
+       : stream_register (server, stream)) == -1)
+    stream_close (server, stream);
+}
+
+/* The backend of a stream has sent something.  */
+
+static void
+stream_input (Server *server, Stream *stream)
+{
+  Session *session = stream->session;
+  char *buf = session->buf;
+  size_t max, head;
+  ssize_t n;
+
+  max = session->frame_max - MUX_HEADER_MAX;
+  if (max > MUX_DATA_MAX)
+    max = MUX_DATA_MAX;
+  if (max > stream->window)
+    max = stream->window;
+
+  if (max > 0)
+    {
+      n = recv (stream->fd, buf + MUX_HEADER_MAX, max, MSG_DONTWAIT);
+      log_annoying ("recv (%d, %d) = %d", stream->fd, (int)max, (int)n);
+      if (n == -1 && (errno == EAGAIN || errno == EINTR))
+	return;
+      if (n <= 0)
+	{
+	  stream_close (server, stream);
+	  return;
+	}
+
+      /* Put the header right in front of the data.  */
+      head = mux_header (buf, MUX_DATA, stream->id, n);
+      memmove (buf + MUX_HEADER_MAX - head, buf, head);
+      if (tunnel_write (session->tunnel, buf + MUX_HEADER_MAX - head,
+			head + n) == -1)
+	{
+	  session->closed = TRUE;
+	  return;
+	}
+      PROBE4 (mux__frame__out, SLOT (session), MUX_DATA, stream->id, n);
+      stream->window -= n;
+      session->last_tunnel_write = session->last_activity = timer_now ();
+      session->stats->bytes_out += n;
+      session->stats->frames_out++;
+      server->stats->bytes_out += n;
+      server->stats->mux_frames_out++;
+      session_charge (server, session, n);
+    }
+
+  /* Stop reading the backend until MUX_WINDOW.  */
+  if (stream->window == 0)
+    {
+      log_verbose ("stream %lu is waiting for a window", stream->id);
+      stream->paused = TRUE;
+      if (stream_register (server, stream) == -1)
+	stream_close (server, stream);
+    }
+}
+
+static void
+stream_event (Server *server, Stream *stream, int revents)
+{
+  if ((revents & POLLOUT) && stream->out_len > 0
+      && stream_flush (server, stream) == -1)
+    {
+      log_debug ("couldn't write to stream %lu: %s", stream->id,
+		 strerror (errno));
+      stream_close (server, stream);
+      return;
+    }
+  if ((revents & (POLLIN | POLLERR | POLLHUP)) && !stream->paused)
+    stream_input (server, stream);
+}
+
+static void
+stream_frame (Server *server, Session *session, MuxFrame *frame)
+{
+  Stream *stream;
+
+  PROBE4 (mux__frame__in, SLOT (session), frame->type, frame->id,
+	  frame->len);
+  if (frame->type == MUX_OPEN)
+    {
+      stream_open (server, session, frame->id);
+      return;
+    }
+
+  stream = stream_find (server, session, frame->id);
+  if (stream == NULL)
+    return;			/* closed already */
+
+  switch (frame->type)
+    {
+    case MUX_DATA:
+      if (stream_write (server, stream, frame->data, frame->len) == -1)
+	{
+	  stream_close (server, stream);
+	  return;
+	}
+      session->stats->bytes_in += frame->len;
+      server->stats->bytes_in += frame->len;
+      stream_credit (stream);
+      break;
+
+    case MUX_CLOSE:
+      log_debug ("client closed stream %lu", stream->id);
+      stream_release (server, stream);
+      break;
+
+    case MUX_WINDOW:
+      /* Don't let a careless client wrap the window around.  */
+      if (frame->value > ULONG_MAX - stream->window)
+	stream->window = ULONG_MAX;
+      else
+	stream->window += frame->value;
+      if (stream->paused && stream->window > 0)
+	{
+	  stream->paused = FALSE;
+	  if (stream_register (server, stream) == -1)
+	    stream_close (server, stream);
+	}
+      break;
+    }
+}
+
+/* Read from the tunnel of a multiplexed session, and hand the frames
+   to the streams.  */
+
+static void
+session_mux_input (Server *server, Session *session, int revents)
+{
+  MuxFrame frame;
+  char *p;
+  int n, m;
+
+  if (!(revents & (POLLIN | POLLERR | POLLHUP)))
+    return;
+
+  n = tunnel_read (session->tunnel, session->buf, session->frame_max);
+  log_annoying ("tunnel_read () = %d", n);
+  if (n == 0 || (n == -1 && errno != EAGAIN))
+    {
+      session->closed = TRUE;
+      return;
+    }
+
+  for (p = session->buf; n > 0 && !session->closed; p += m, n -= m)
+    {
+      m = mux_parse (&session->parser, p, n, &frame);
+      if (m == -1)
+	{
+	  log_error ("bad stream frame type %d", (unsigned char)*p);
+	  session->closed = TRUE;
+	  return;
+	}
+      if (frame.type != 0)
+	stream_frame (server, session, &frame);
+    }
+}
+
+static Stream *
+server_stream (Server *server, void *data)
+{
+  Stream *stream = data;
+
+  if (server->streams != NULL && stream >= server->streams
+      && stream < server->streams
+		  + server->arg->max_sessions * server->arg->max_streams)
+    return stream;
+  return NULL;
+}
+
+/* handle_tunnel_input () returns the number of bytes written to fd,
+   and handle_input () drops it, so count it on the way.  */
+
+static unsigned long tunnel_input_bytes;
+
+static int
+count_tunnel_input (Tunnel *tunnel, int fd, int events)
+{
+  int n = handle_tunnel_input (tunnel, fd, events);
+
+  if (n > 0)
+    tunnel_input_bytes += n;
+  return n;
+}
+
+/* Read from the tunnel.  On a persistent connection, tunnel.c may
+   already have read the next pipelined request together with the
+   current one, and poll () won't report those bytes again, so keep
+   going until its buffer is empty.  The bound keeps one busy client
+   from starving the others.  */
+
+#define PIPELINE_ROUNDS 16
+
+static void
+session_tunnel_input (Server *server, Session *session, int revents)
+{
+  unsigned long bytes_in = session->stats->bytes_in;
+  size_t pending;
+  int i;
+
+  PROBE2 (tunnel__input__start, SLOT (session), revents);
+  if (session->mux)
+    session_mux_input (server, session, revents);
+  else
+    handle_input ("tunnel", session->tunnel, session->fd, revents,
+		  count_tunnel_input, &session->closed);
+
+  session_backpressure (server, session);
+  for (i = 0; i < PIPELINE_ROUNDS && !session->closed && !session->fd_full
+	 && !session->limited; i++)
+    {
+      if (tunnel_getopt (session->tunnel, "pending", &pending) == -1
+	  || pending == 0)
+	break;
+      log_verbose ("%lu pipelined bytes", (unsigned long)pending);
+      if (session->mux)
+	session_mux_input (server, session, POLLIN);
+      else
+	handle_input ("tunnel", session->tunnel, session->fd, POLLIN,
+		      count_tunnel_input, &session->closed);
+    }
+
+  session->stats->bytes_in += tunnel_input_bytes;
+  server->stats->bytes_in += tunnel_input_bytes;
+  PROBE2 (tunnel__input__done, SLOT (session),
+	  session->stats->bytes_in - bytes_in);
+  tunnel_input_bytes = 0;
+  session_charge (server, session, session->stats->bytes_in - bytes_in);
+  if (session->stats->bytes_in != bytes_in)
+    stats_record (&server->stats->hist[HIST_TUNNEL_TO_DEVICE],
+		  timer_now_usec () - server->wakeup_usec);
+
+  session_watch (server, session);
+}
+
+/* Open the device or connect to the forwarded port for a session
+   which has just been accepted.  */
+
+static int
+session_open (Server *server, Session *session)
+{
+  Arguments *arg = server->arg;
+  int fd = -1;
+
+  /* The client's TUNNEL_OPEN has been read by now.  */
+  session->mux = FALSE;
+  if (arg->max_streams > 0
+      && tunnel_getopt (session->tunnel, "mux", &session->mux) == 0
+      && session->mux)
+    {
+      log_debug ("multiplexing streams");
+      mux_parser_init (&session->parser);
+    }
+
+  if (arg->device != NULL)
+    {
+      fd = open_device (arg->device);
+      log_debug ("open_device (\"%s\") = %d", arg->device, fd);
+      if (fd == -1)
+	{
+	  log_error ("couldn't open %s: %s",
+		     arg->device, strerror (errno));
+	  return -1;
+	}
+    }
+
+  session->connecting = FALSE;
+  session->throttled = session->fd_full = session->limited = FALSE;
+  session->tokens = arg->session_rate;
+  session->refilled = timer_now ();
+  session->backend = NULL;
+  if (arg->forward_port != -1 && !session->mux)
+    {
+      Backend *backend = backend_pick (server, session);
+
+      if (backend == NULL)
+	{
+	  log_error ("no backend to connect to");
+	  return -1;
+	}
+      fd = forward_connect (server, backend);
+      log_debug ("forward_connect (\"%s:%d\") = %d",
+	     backend->host, backend->port, fd);
+      if (fd == -1)
+	{
+	  log_error ("couldn't connect to %s:%d: %s\n",
+		     backend->host, backend->port, strerror (errno));
+	  backend_failed (server, backend);
+	  return -1;
+	}
+      session->backend = backend;
+      backend->sessions++;
+      session->connecting = TRUE;
+      timer_add (server->timers, &session->connect,
+		 timer_now () + 1000UL * CONNECT_TIMEOUT);
+    }
+
+  session->fd = fd;
+  session->active = TRUE;
+  session->closed = FALSE;
+  session->stats->active = TRUE;
+  session->stats->started = timer_now ();
+  if (session->backend != NULL)
+    sprintf (session->stats->backend, "%.*s:%d", STATS_PEER_MAX - 8,
+	     session->backend->host, session->backend->port);
+  session->tunnel_fd = -1;
+  session->last_tunnel_write = session->last_activity = timer_now ();
+  session_timers_start (server, session);
+
+  session->compress = NULL;
+  if (arg->compress != NULL
+      && tunnel_getopt (session->tunnel, "compress", &session->compress) == 0
+      && session->compress != NULL)
+    log_debug ("compressing with %s", session->compress);
+
+  session->frame_max = TUNNEL_DATA_MAX;
+  if (arg->jumbo > 0
+      && tunnel_getopt (session->tunnel, "jumbo", &session->frame_max) == 0
+      && session->frame_max > TUNNEL_DATA_MAX)
+    log_debug ("sending jumbo requests of up to %lu bytes",
+	       (unsigned long)session->frame_max);
+  if (session->frame_max < TUNNEL_DATA_MAX
+      || session->frame_max > frame_max (arg))
+    session->frame_max = TUNNEL_DATA_MAX;
+  session_buffer_get (server, session);
+  session_splice_open (server, session);
+
+  /* Without a buffer the session makes do with the tunnel's.  A
+     multiplexed session can't, so it gets closed.  */
+  if (session->buf == NULL)
+    session->buf = pool_get (server->pool);
+  if (session->buf == NULL)
+    {
+      log_verbose ("buffer memory exhausted");
+      session_splice_close (server, session);
+      if (session->mux)
+	{
+	  session_timers_stop (server, session);
+	  session->active = session->stats->active = FALSE;
+	  return -1;
+	}
+    }
+  session->drain = ((session->tty
+		     || (arg->forward_port != -1 && !session->mux))
+		    && session->pipe[0] == -1 && session->buf != NULL);
+  session->chunked = FALSE;
+  if (arg->chunked != CHUNKED_NEVER
+      && tunnel_getopt (session->tunnel, "chunked", &session->chunked) == 0
+      && session->chunked)
+    log_debug ("sending chunked GET replies");
+
+  if (arg->content_length_auto)
+    adapt_init (session, arg);
+  return 0;
+}
+
+/* Return the first idle session slot, creating its tunnel if needed,
+   or NULL if all slots are in use.  */
+
+static Session *
+session_idle (Server *server)
+{
+  Arguments *arg = server->arg;
+  Session *sessions = server->sessions;
+  int i;
+
+  if (server->nactive == arg->max_sessions)
+    return NULL;
+
+  for (i = 0; i < arg->max_sessions; i++)
+    {
+      if (sessions[i].active)
+	continue;
+      if (sessions[i].tunnel == NULL)
+	{
+	  sessions[i].tunnel = session_tunnel_new (arg, server->server_fd);
+	  if (sessions[i].tunnel == NULL)
+	    {
+	      log_error ("couldn't create tunnel for session %d", i);
+	      continue;
+	    }
+	}
+      return &sessions[i];
+    }
+
+  return NULL;
+}
+
+/* Watch the listening socket while there is room for another session,
+   or while some session waits for its client to reconnect.  Once
+   another process has the socket, there is no telling whose client
+   a connection is from, so a draining process accepts none.  */
+
+static void
+server_listen (Server *server)
+{
+  int fd = -1;
+
+  if (server->idle == NULL && !server->draining)
+    server->idle = session_idle (server);
+
+  if (server->draining)
+    fd = -1;
+  else if (server->server_fd != -1)
+    {
+      if (server->idle != NULL || server->nwaiting > 0)
+	fd = server->server_fd;
+    }
+  else if (server->idle != NULL)
+    fd = tunnel_pollin_fd (server->idle->tunnel);
+
+  if (fd == server->listen_fd)
+    return;
+
+  if (server->listen_fd != -1)
+    event_del (server->loop, server->listen_fd);
+  server->listen_fd = fd;
+  if (fd != -1 && event_add (server->loop, fd, POLLIN, NULL) == -1)
+    log_error ("couldn't watch listening fd %d: %s", fd, strerror (errno));
+}
+
+/* Admission control.  Returns why a new session from client ADDR may
+   not be opened, or NULL.  EARLY is set for a connection the tunnel
+   hasn't read yet.  It may then be a client reconnecting to one of its
+   sessions, which isn't refused if that session is waiting for it.  */
+
+static const char *
+server_admit (Server *server, unsigned long addr, int early)
+{
+  Arguments *arg = server->arg;
+  Session *session;
+  int i, n = 0;
+
+  if (early && addr == 0)
+    return NULL;
+  for (i = 0; i < arg->max_sessions && addr != 0; i++)
+    {
+      session = &server->sessions[i];
+      if (!session->active || session->addr != addr)
+	continue;
+      if (early && session->tunnel_fd == server->server_fd)
+	return NULL;
+      n++;
+    }
+
+  if (server->nactive >= arg->session_limit)
+    return "too many sessions";
+  if (arg->max_client_sessions > 0 && n >= arg->max_client_sessions)
+    return "too many sessions from one address";
+  return NULL;
+}
+
+/* Answer the request on FD with a 503, so that the client, or a proxy
+   in between, knows to come back later.  */
+
+static void
+server_reject (Server *server, int fd, const char *peer, const char *why)
+{
+  char reply[160];
+  int n;
+
+  log_notice ("rejected %s: %s", peer, why);
+  n = sprintf (reply, "HTTP/1.0 503 Service Unavailable\r\n"
+	       "Retry-After: %d\r\n"
+	       "Content-Length: 0\r\n"
+	       "Connection: close\r\n\r\n", REJECT_RETRY_SECONDS);
+  if (send (fd, reply, n, MSG_DONTWAIT) != n)
+    log_debug ("couldn't send 503: %s", strerror (errno));
+  server->stats->rejected++;
+}
+
+static void
+session_reject (Server *server, Session *session, const char *why)
+{
+  server_reject (server, tunnel_pollin_fd (session->tunnel),
+		 session->stats->peer, why);
+  tunnel_close (session->tunnel);
+}
+
+/* Accept a connection from the listening socket for SESSION's tunnel,
+   and refuse it before the tunnel reads the request and waits for the
+   other leg, if the client may not open a session anyway.  Returns -1
+   if there's nothing for tunnel_accept () to serve.  */
+
+static int
+server_accept_early (Server *server, Session *session)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof addr;
+  char peer[STATS_PEER_MAX];
+  const char *why;
+  int fd;
+
+  fd = accept (server->server_fd, (struct sockaddr *)&addr, &len);
+  if (fd == -1)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	log_notice ("couldn't accept connection: %s", strerror (errno));
+      return -1;
+    }
+
+  if (addr.sin_family != AF_INET)
+    {
+      addr.sin_addr.s_addr = 0;
+      strcpy (peer, "unknown");
+    }
+  else
+    sprintf (peer, "%s:%d", inet_ntoa (addr.sin_addr), ntohs (addr.sin_port));
+  why = server_admit (server, ntohl (addr.sin_addr.s_addr), TRUE);
+  if (why != NULL)
+    {
+      server_reject (server, fd, peer, why);
+      close (fd);
+      return -1;
+    }
+
+  if (tunnel_setopt (session->tunnel, "accept_fd", &fd) == -1)
+    {
+      log_error ("tunnel_setopt accept_fd error: %s", strerror (errno));
+      close (fd);
+      return -1;
+    }
+  return 0;
+}
+
+/* tunnel_accept () has handed a reconnecting client to the session
+   that owns it, without saying which one.  Whichever it was has a new
+   connection to watch now.  */
+
+static void
+server_watch_waiting (Server *server)
+{
+  Session *session;
+  int i;
+
+  if (server->server_fd == -1)
+    return;
+  for (i = 0; i < server->arg->max_sessions; i++)
+    {
+      session = &server->sessions[i];
+      if (session->active && !session->closed
+	  && session->tunnel_fd == server->server_fd)
+	session_watch (server, session);
+    }
+}
+
+static void
+server_accept (Server *server)
+{
+  Session *session = server->idle;
+  const char *why;
+  int i;
+
+  if (session == NULL)
+    {
+      /* No room for a new session, so this must be a client
+	 reconnecting.  Let a waiting tunnel deal with it.  */
+      for (i = 0; i < server->arg->max_sessions; i++)
+	{
+	  session = &server->sessions[i];
+	  if (session->active && session->tunnel_fd == server->server_fd)
+	    {
+	      session_tunnel_input (server, session, POLLIN);
+	      server_watch_waiting (server);
+	      return;
+	    }
+	}
+      return;
+    }
+
+  if (server->accept_fd && server_accept_early (server, session) == -1)
+    return;
+  if (tunnel_accept (session->tunnel) == -1)
+    {
+      if (errno != EAGAIN)
+	log_notice ("couldn't accept connection: %s", strerror (errno));
+      else
+	server_watch_waiting (server);
+      return;
+    }
+  session_peer (session);
+  why = server_admit (server, session->addr, FALSE);
+  if (why != NULL)
+    {
+      session_reject (server, session, why);
+      return;
+    }
+  log_notice ("connected to %s", session->stats->peer);
+  PROBE2 (session__accept, SLOT (session), session->stats->peer);
+  server->stats->accepted++;
+
+  if (session_open (server, session) == -1)
+    {
+      /* Only this session fails.  */
+      tunnel_close (session->tunnel);
+      log_notice ("disconnected from %s", session->stats->peer);
+      server->stats->failed++;
+      return;
+    }
+  server->nactive++;
+  server->idle = NULL;
+  server_listen (server);
+
+  if (session->fd != -1
+      && event_add (server->loop, session->fd,
+		    session->connecting ? POLLOUT
+		    : POLLIN | (session->drain ? EVENT_EDGE : 0),
+		    session) == -1)
+    log_error ("couldn't watch fd %d: %s", session->fd, strerror (errno));
+  session_watch (server, session);
+}
+
+/* The admin port.  Every worker listens on the same socket, and
+   whichever one accepts a connection answers with the counters of
+   all of them.  A request has to arrive in one piece, and the reply
+   is written in one go, with a timeout.  */
+
+static int
+admin_socket (const char *host, int port)
+{
+  struct sockaddr_in addr;
+  int fd, one = 1;
+
+  if (set_address (&addr, host, port) == -1)
+    return -1;
+
+  fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+  if (setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) == -1
+      || bind (fd, (struct sockaddr *)&addr, sizeof addr) == -1
+      || listen (fd, ADMIN_MAX) == -1
+      || fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK) == -1)
+    {
+      int saved_errno = errno;
+      close (fd);
+      errno = saved_errno;
+      return -1;
+    }
+
+  return fd;
+}
+
+static void
+admin_close (Admin *admin)
+{
+  Server *server = admin->server;
+
+  timer_del (server->timers, &admin->timeout);
+  event_del (server->loop, admin->fd);
+  close (admin->fd);
+  admin->fd = -1;
+}
+
+static void
+admin_timeout (void *data)
+{
+  log_debug ("admin connection timed out");
+  admin_close (data);
+}
+
+static void
+admin_accept (Server *server)
+{
+  Admin *admin = NULL;
+  int fd, i;
+
+  /* Another worker may have been first.  */
+  fd = accept (server->arg->admin_fd, NULL, NULL);
+  if (fd == -1)
+    return;
+
+  for (i = 0; i < ADMIN_MAX; i++)
+    if (server->admins[i].fd == -1)
+      {
+	admin = &server->admins[i];
+	break;
+      }
+  if (admin == NULL || event_add (server->loop, fd, POLLIN, admin) == -1)
+    {
+      close (fd);
+      return;
+    }
+
+  admin->fd = fd;
+  timer_add (server->timers, &admin->timeout,
+	     timer_now () + ADMIN_TIMEOUT_MSEC);
+}
+
+static void
+admin_input (Admin *admin)
+{
+  Server *server = admin->server;
+  const char *status = "200 OK", *type = "text/plain";
+  char buf[1024], head[256];
+  struct timeval tv;
+  char *body = NULL;
+  int n, flags;
+
+  n = recv (admin->fd, buf, sizeof buf - 1, MSG_DONTWAIT);
+  if (n == -1 && errno == EAGAIN)
+    return;
+  if (n <= 0)
+    {
+      admin_close (admin);
+      return;
+    }
+  buf[n] = 0;
+
+  if (strncmp (buf, "GET /metrics ", 13) == 0)
+    {
+      body = stats_prometheus (server->arg->stats);
+      type = "text/plain; version=0.0.4";
+    }
+  else if (strncmp (buf, "GET /stats ", 11) == 0)
+    {
+      body = stats_json (server->arg->stats, timer_now ());
+      type = "application/json";
+    }
+  else
+    status = "404 Not Found";
+
+  flags = fcntl (admin->fd, F_GETFL);
+  if (flags != -1)
+    fcntl (admin->fd, F_SETFL, flags & ~O_NONBLOCK);
+  tv.tv_sec = 1;
+  tv.tv_usec = 0;
+  setsockopt (admin->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+
+  n = sprintf (head, "HTTP/1.0 %s\r\n"
+	       "Content-Type: %s\r\n"
+	       "Content-Length: %lu\r\n"
+	       "Connection: close\r\n\r\n",
+	       status, type,
+	       (unsigned long)(body == NULL ? 0 : strlen (body)));
+  if (write_all (admin->fd, head, n) != -1 && body != NULL)
+    write_all (admin->fd, body, strlen (body));
+
+  free (body);
+  admin_close (admin);
+}
+
+static Admin *
+server_admin (Server *server, void *data)
+{
+  Admin *admin = data;
+
+  if (admin >= server->admins && admin < server->admins + ADMIN_MAX)
+    return admin;
+  return NULL;
+}
+
+/* Upgrading.  On SIGUSR2, hts starts its own binary again with the
+   same arguments, and hands it the listening sockets.  Once the new
+   process says it is up, this one drains: it opens no new sessions,
+   but serves the ones it has until they end, or --drain-timeout.
+   With --workers, the parent does the handing over and then tells
+   its workers to drain with SIGUSR2.  */
+
+static volatile sig_atomic_t handoff_requested = 0;
+
+static void
+handoff_signal (int sig)
+{
+  (void)sig;
+  handoff_requested = 1;
+}
+
+/* Not restarted, so that wait () and event_wait () return at once.  */
+
+static void
+handoff_catch (void)
+{
+  struct sigaction sa;
+
+  memset (&sa, 0, sizeof sa);
+  sa.sa_handler = handoff_signal;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = 0;
+  sigaction (SIGUSR2, &sa, NULL);
+}
+
+static void
+server_drain_timeout (void *data)
+{
+  Server *server = data;
+
+  log_notice ("drain timeout, closing %d sessions", server->nactive);
+  server->drained = TRUE;
+}
+
+/* Close the sessions that wait for their clients to reconnect, since
+   they won't be let in again.  Called between rounds of events.  */
+
+static void
+server_drain_waiting (Server *server)
+{
+  Session *session;
+  int i;
+
+  for (i = 0; i < server->arg->max_sessions; i++)
+    {
+      session = &server->sessions[i];
+      if (session->active && session->gap_usec != 0)
+	{
+	  log_verbose ("closing a session waiting for a reconnect");
+	  session_close (server, session);
+	}
+    }
+}
+
+static void
+server_drain (Server *server)
+{
+  Arguments *arg = server->arg;
+
+  if (server->draining)
+    return;
+  log_notice ("draining %d sessions", server->nactive);
+  server->draining = TRUE;
+  server->idle = NULL;
+  server_listen (server);
+  if (arg->admin_fd != -1)
+    event_del (server->loop, arg->admin_fd);
+  if (arg->drain_timeout > 0)
+    timer_add (server->timers, &server->drain,
+	       timer_now () + 1000UL * arg->drain_timeout);
+}
+
+static void
+server_handoff (Server *server)
+{
+  Arguments *arg = server->arg;
+  int fd = server->server_fd;
+
+  if (server->draining || server->handoff_fd != -1)
+    {
+      log_notice ("already handing over, SIGUSR2 ignored");
+      return;
+    }
+
+  if (fd == -1
+      && tunnel_getopt (server->sessions[0].tunnel, "server_socket",
+			&fd) == -1)
+    {
+      log_error ("can't hand over, the tunnel doesn't share its "
+		 "socket: %s", strerror (errno));
+      return;
+    }
+
+  server->handoff_pid = handoff_exec (arg->exe, arg->argv, &fd, 1,
+				      arg->admin_fd, &server->handoff_fd);
+  if (server->handoff_pid == -1)
+    {
+      log_error ("couldn't start %s: %s", arg->exe, strerror (errno));
+      return;
+    }
+  log_notice ("started %s as process %d", arg->exe,
+	      (int)server->handoff_pid);
+
+  /* The pipe's address tells it apart from the other event data.  */
+  if (event_add (server->loop, server->handoff_fd, POLLIN,
+		 &server->handoff_fd) == -1)
+    log_error ("couldn't watch fd %d: %s", server->handoff_fd,
+	       strerror (errno));
+}
+
+/* The new process has written its byte, or died.  */
+
+static void
+server_handoff_ready (Server *server)
+{
+  char c;
+  ssize_t n;
+
+  n = read (server->handoff_fd, &c, 1);
+  if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    return;
+  event_del (server->loop, server->handoff_fd);
+  close (server->handoff_fd);
+  server->handoff_fd = -1;
+
+  /* Whatever daemon () left behind.  */
+  waitpid (server->handoff_pid, NULL, WNOHANG);
+
+  if (n != 1)
+    {
+      log_error ("process %d didn't start, still serving",
+		 (int)server->handoff_pid);
+      return;
+    }
+  log_notice ("process %d took over", (int)server->handoff_pid);
+  server_drain (server);
+}
+
+static int
+server_init (Server *server, Arguments *arg, int worker)
+{
+  int i;
+
+  memset (server, 0, sizeof *server);
+  server->arg = arg;
+#ifdef DEBUG_MODE
+  /* Each worker has a ring of its own, started after forking.  */
+  if (debug_level >= 3 && log_ring_start (debug_file, arg->log_rate) == -1)
+    log_error ("no memory for a log ring, logging synchronously");
+#endif
+  server->server_fd = -1;
+  server->listen_fd = -1;
+  server->handoff_fd = -1;
+  timer_init (&server->drain, server_drain_timeout, server);
+  server->nevents = 2 * arg->max_sessions + arg->forward_pool + 2;
+
+  server->sessions = calloc (arg->max_sessions, sizeof *server->sessions);
+  server->events = malloc (server->nevents * sizeof *server->events);
+  server->loop = event_loop_new (server->nevents);
+  server->pool = pool_new (TUNNEL_DATA_MAX, arg->buffer_memory);
+  server->jumbo_bytes = 0;
+  server->pipes = malloc (arg->max_sessions * sizeof *server->pipes);
+  server->timers = timer_wheel_new (timer_now ());
+  if (arg->max_streams > 0)
+    {
+      server->streams = calloc (arg->max_sessions * arg->max_streams,
+				sizeof *server->streams);
+      if (server->streams == NULL)
+	return -1;
+    }
+  if (server->sessions == NULL || server->events == NULL
+      || server->loop == NULL || server->pool == NULL
+      || server->pipes == NULL || server->timers == NULL)
+    return -1;
+
+  for (i = 0; i < arg->max_sessions; i++)
+    {
+      Session *session = &server->sessions[i];
+
+      session->server = server;
+      session->stats = stats_session (arg->stats, worker, i);
+      timer_init (&session->keep_alive, session_keep_alive, session);
+      timer_init (&session->age, session_age, session);
+      timer_init (&session->expire, session_expire, session);
+      timer_init (&session->adapt_timer, session_adapt, session);
+      timer_init (&session->connect, session_connect_timeout, session);
+      timer_init (&session->coalesce, session_coalesce, session);
+      timer_init (&session->throttle, session_throttle, session);
+      timer_init (&session->tcp_info, session_tcp_info, session);
+      timer_init (&session->rate, session_unlimit, session);
+      if (arg->max_streams > 0)
+	{
+	  int j;
+
+	  session->streams = &server->streams[i * arg->max_streams];
+	  for (j = 0; j < arg->max_streams; j++)
+	    {
+	      session->streams[j].session = session;
+	      session->streams[j].fd = -1;
+	    }
+	}
+      server->sessions[i].fd = -1;
+      server->sessions[i].tunnel_fd = -1;
+      server->sessions[i].pipe[0] = server->sessions[i].pipe[1] = -1;
+    }
+
+  if (arg->nforwards > 0)
+    {
+      int resolved = 0;
+
+      server->backends = calloc (arg->nforwards, sizeof *server->backends);
+      if (server->backends == NULL)
+	return -1;
+      for (i = 0; i < arg->nforwards; i++)
+	{
+	  Backend *backend = &server->backends[i];
+
+	  backend->host = arg->forward_hosts[i];
+	  backend->port = arg->forward_ports[i];
+	  backend->resolver = -1;
+	  backend->resolver_fd = -1;
+	  backend->expires = backend->down_until = timer_now ();
+	  if (backend_resolve (server, backend) == 0)
+	    resolved++;
+	  else
+	    log_error ("couldn't look up %s: %s",
+		       backend->host, strerror (errno));
+	}
+      if (resolved == 0)
+	return -1;
+    }
+
+  timer_init (&server->refill, spare_refill, server);
+  if (arg->forward_pool > 0)
+    {
+      server->spares = malloc (arg->forward_pool * sizeof *server->spares);
+      if (server->spares == NULL)
+	return -1;
+      for (i = 0; i < arg->forward_pool; i++)
+	{
+	  server->spares[i].server = server;
+	  server->spares[i].backend = &server->backends[i % arg->nforwards];
+	  server->spares[i].fd = -1;
+	  server->spares[i].ready = FALSE;
+	}
+      spare_schedule (server, 0);
+    }
+
+  server->worker = worker;
+  server->stats = stats_worker (arg->stats, worker);
+  memset (server->stats, 0, sizeof *server->stats);
+  server->stats->pid = getpid ();
+  for (i = 0; i < ADMIN_MAX; i++)
+    {
+      server->admins[i].server = server;
+      server->admins[i].fd = -1;
+      timer_init (&server->admins[i].timeout, admin_timeout,
+		  &server->admins[i]);
+    }
+  if (arg->admin_fd != -1
+      && event_add (server->loop, arg->admin_fd, POLLIN, server) == -1)
+    return -1;
+
+  log_debug ("event backend: %s", event_loop_backend (server->loop));
+  return 0;
+}
+
+/* Event data is a session, a spare connection, a stream, a backend
+   for its resolver, an admin connection, the server itself for the
+   admin port, &server->handoff_fd for the ready pipe of a new
+   process, or NULL for the listening socket.  */
+
+static Session *
+server_session (Server *server, void *data)
+{
+  Session *session = data;
+
+  if (session >= server->sessions
+      && session < server->sessions + server->arg->max_sessions)
+    return session;
+  return NULL;
+}
+
+static void
+server_run (Server *server)
+{
+  Arguments *arg = server->arg;
+  int i;
+
+  log_debug ("waiting for tunnel connection");
+
+  for (;;)
+    {
+      long timeout;
+      int n;
+
+      if (handoff_requested)
+	{
+	  handoff_requested = 0;
+	  if (arg->workers > 1)
+	    server_drain (server);
+	  else
+	    server_handoff (server);
+	}
+      if (server->draining)
+	server_drain_waiting (server);
+      if (server->draining && (server->nactive == 0 || server->drained))
+	break;
+      /* inetd listens again once hts has exited.  */
+      if (arg->inetd && server->nactive == 0 && server->stats->accepted > 0)
+	break;
+
+      server_listen (server);
+
+      timeout = timer_next (server->timers, timer_now ());
+      if (timeout > INT_MAX)
+	timeout = INT_MAX;
+#ifdef DEBUG_MODE
+      /* Come back at once if there's more to log.  */
+      if (log_ring_drain (LOG_DRAIN_MAX) > 0)
+	timeout = 0;
+#endif
+
+      log_annoying ("event_wait () ...");
+      n = event_wait (server->loop, server->events, server->nevents,
+		      (int)timeout);
+      log_annoying ("... = %d", n);
+      server->wakeup_usec = timer_now_usec ();
+      PROBE1 (loop__wakeup, n);
+      server->stats->wakeups++;
+      if (n > 0)
+	server->stats->events += n;
+      if (n == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  log_error ("%s error: %s\n",
+		     event_loop_backend (server->loop), strerror (errno));
+	  log_exit (1);
+	}
+
+      for (i = 0; i < n; i++)
+	{
+	  Event *ev = &server->events[i];
+	  Session *session = server_session (server, ev->data);
+	  Spare *spare = server_spare (server, ev->data);
+	  Backend *backend = server_backend (server, ev->data);
+	  Stream *stream = server_stream (server, ev->data);
+	  Admin *admin = server_admin (server, ev->data);
+
+	  log_annoying ("fd %d revents = %x, POLLIN = %x",
+			ev->fd, ev->revents, POLLIN);
+
+	  if (backend != NULL)
+	    backend_resolved (server, backend);
+	  else if (ev->data == &server->handoff_fd)
+	    server_handoff_ready (server);
+	  else if (ev->data == server)
+	    admin_accept (server);
+	  else if (admin != NULL)
+	    {
+	      if (admin->fd != -1)
+		admin_input (admin);
+	    }
+	  else if (spare != NULL)
+	    spare_event (server, spare);
+	  else if (stream != NULL)
+	    {
+	      session = stream->session;
+	      if (!session->active || session->closed || stream->fd == -1)
+		continue;
+	      if (stream->connecting)
+		stream_connected (server, stream);
+	      else
+		stream_event (server, stream, ev->revents);
+	    }
+	  else if (ev->data == NULL)
+	    server_accept (server);
+	  else if (!session->active || session->closed)
+	    continue;
+	  else if (ev->fd == session->fd && session->connecting)
+	    session_connected (server, session);
+	  else if (ev->fd == session->fd)
+	    {
+	      int revents = ev->revents;
+	      int m = 0;
+
+	      if (session->fd_full)
+		revents &= ~POLLOUT;
+	      if (revents != 0)
+		{
+		  PROBE2 (device__input__start, SLOT (session), revents);
+		  m = session_device_input (server, session, revents);
+		  PROBE2 (device__input__done, SLOT (session), m);
+		  session_charge (server, session, m);
+		}
+
+	      if (m > 0 && arg->content_length_auto)
+		adapt_sent (session, m);
+	      if (revents & POLLIN)
+		session->last_tunnel_write = session->last_activity
+		  = timer_now ();
+	      session_backpressure (server, session);
+	    }
+	  else
+	    {
+	      if ((ev->revents & POLLIN) && arg->content_length_auto)
+		adapt_received (session, arg);
+	      session_tunnel_input (server, session, ev->revents);
+	      session->last_activity = timer_now ();
+	    }
+	}
+
+      /* Don't close sessions until every event of this round has been
+	 looked at, since a descriptor number may be reused at once.  */
+      for (i = 0; i < n; i++)
+	{
+	  Session *session = server_session (server, server->events[i].data);
+	  Stream *stream = server_stream (server, server->events[i].data);
+
+	  if (stream != NULL)
+	    session = stream->session;
+	  if (session != NULL && session->active && session->closed)
+	    session_close (server, session);
+	}
+
+      server->stats->active = server->nactive;
+      timer_run (server->timers, timer_now ());
+      stats_record (&server->stats->hist[HIST_TURNAROUND],
+		    timer_now_usec () - server->wakeup_usec);
+      PROBE1 (loop__done, timer_now_usec () - server->wakeup_usec);
+    }
+}
+
+static void
+server_destroy (Server *server)
+{
+  int i;
+
+  log_debug ("destroying tunnel");
+  for (i = 0; i < server->arg->max_sessions; i++)
+    {
+      if (server->sessions[i].tunnel != NULL)
+	tunnel_destroy (server->sessions[i].tunnel);
+      if (server->pool != NULL)
+	session_buffer_put (server, &server->sessions[i]);
+    }
+  if (server->loop != NULL)
+    event_loop_destroy (server->loop);
+  if (server->pool != NULL)
+    pool_destroy (server->pool);
+  if (server->timers != NULL)
+    timer_wheel_destroy (server->timers);
+  for (i = 0; i < server->npipes; i++)
+    {
+      close (server->pipes[i][0]);
+      close (server->pipes[i][1]);
+    }
+  for (i = 0; i < server->arg->forward_pool && server->spares != NULL; i++)
+    if (server->spares[i].fd != -1)
+      close (server->spares[i].fd);
+  free (server->spares);
+  free (server->streams);
+  for (i = 0; i < ADMIN_MAX; i++)
+    if (server->admins[i].fd != -1)
+      close (server->admins[i].fd);
+  for (i = 0; i < server->arg->nforwards && server->backends != NULL; i++)
+    if (server->backends[i].resolver_fd != -1)
+      close (server->backends[i].resolver_fd);
+  free (server->backends);
+  free (server->pipes);
+  free (server->events);
+  free (server->sessions);
+  if (server->handoff_fd != -1)
+    close (server->handoff_fd);
+}
+
+/* Whether the tunnels can be handed connections that hts has accepted
+   from the shared socket itself.  Setting "accept_fd" to -1 hands
+   nothing.  */
+
+static void
+server_probe_accept (Server *server, Tunnel *tunnel)
+{
+  int fd = -1;
+
+  server->accept_fd = server->server_fd != -1
+    && tunnel_setopt (tunnel, "accept_fd", &fd) == 0;
+  if (server->server_fd != -1 && !server->accept_fd)
+    log_debug ("tunnel_setopt accept_fd error: %s", strerror (errno));
+}
+
+/* Create the tunnel for the first session slot.  If SERVER_FD is -1,
+   the tunnel binds the listening socket by itself, and shares it with
+   the other slots if it can.  */
+
+static int
+server_start (Server *server, int server_fd)
+{
+  Arguments *arg = server->arg;
+  Session *session = &server->sessions[0];
+
+  if (server_fd != -1)
+    {
+      server->server_fd = server_fd;
+      session->tunnel = session_tunnel_new (arg, server_fd);
+      if (session->tunnel == NULL)
+	return -1;
+      server_probe_accept (server, session->tunnel);
+      return 0;
+    }
+
+  session->tunnel = tunnel_new_server (arg->port, arg->content_length);
+  if (session->tunnel == NULL)
+    return -1;
+  tunnel_configure (session->tunnel, arg);
+
+  if (arg->max_sessions > 1
+      && tunnel_getopt (session->tunnel, "server_socket",
+			&server->server_fd) == -1)
+    {
+      log_notice ("tunnel can't share its socket, serving one session "
+		  "at a time: %s", strerror (errno));
+      arg->max_sessions = 1;
+      server->server_fd = -1;
+    }
+  server_probe_accept (server, session->tunnel);
+  return 0;
+}
+
+/* Bind a listening socket to PORT which other workers can bind too.  */
+
+static int
+reuseport_socket (int port)
+{
+  struct sockaddr_in addr;
+  int s, one = 1;
+
+  s = socket (AF_INET, SOCK_STREAM, 0);
+  if (s == -1)
+    return -1;
+
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (port);
+  addr.sin_addr.s_addr = htonl (INADDR_ANY);
+
+  if (setsockopt (s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) == -1
+#ifdef SO_REUSEPORT
+      || setsockopt (s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) == -1
+#endif
+      || bind (s, (struct sockaddr *)&addr, sizeof addr) == -1
+      || listen (s, SOMAXCONN) == -1)
+    {
+      int saved_errno = errno;
+      close (s);
+      errno = saved_errno;
+      return -1;
+    }
+
+  return s;
+}
+
+/* The PUT and GET connections of one client arrive as separate TCP
+   connections, and both must reach the same worker.  The kernel
+   spreads connections by hashing the full address and port tuple, so
+   make it pick the socket by the client's address alone.  Sockets
+   are numbered in the order they were bound.  */
+
+static int
+reuseport_steer (int s, int workers)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+  struct sock_filter code[] =
+  {
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+    BPF_STMT (BPF_ALU | BPF_MOD | BPF_K, workers),
+    BPF_STMT (BPF_RET | BPF_A, 0)
+  };
+  struct sock_fprog prog;
+
+  prog.len = sizeof code / sizeof code[0];
+  prog.filter = code;
+  return setsockopt (s, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+		     &prog, sizeof prog);
+#else
+  errno = ENOPROTOOPT;
+  return -1;
+#endif
+}
+
+/* Detach once the listening sockets are bound, and without --workers
+   the backends looked up, so that whoever started hts sees those
+   errors and the exit status.  Then say that hts is up.  */
+
+static void
+server_detach (Arguments *arg)
+{
+  FILE *pid_file;
+
+  if (!arg->foreground && (debug_level == 0 || debug_file != NULL))
+    daemon (0, 1);
+
+  if(arg->pid_filename != NULL)
+    {
+      pid_file = fopen (arg->pid_filename, "w+");
       if (pid_file == NULL)
         {
           fprintf (stderr, "Couldn't open pid file %s: %s\n",
-		   arg.pid_filename, strerror (errno));
+		   arg->pid_filename, strerror (errno));
         }
       else
 	{
@@ -315,107 +4344,379 @@ main (int argc, char **argv)
          }
      }
 
-  for (;;)
+  handoff_ready ();
+}
+
+static void
+worker_main (Arguments *arg, int server_fd, int n)
+{
+  Server server;
+
+  log_notice ("worker %d started", n);
+
+  if (server_init (&server, arg, n) == -1)
+    {
+      log_error ("worker %d: couldn't set up server: %s",
+		 n, strerror (errno));
+      log_exit (1);
+    }
+
+  if (server_start (&server, server_fd) == -1)
+    {
+      log_error ("worker %d: couldn't create tunnel: %s",
+		 n, strerror (errno));
+      log_exit (1);
+    }
+
+  server_run (&server);
+  server_destroy (&server);
+  log_exit (0);
+}
+
+static volatile sig_atomic_t workers_stop = 0;
+
+static void
+workers_signal (int sig)
+{
+  (void)sig;
+  workers_stop = 1;
+}
+
+/* Not restarted either, or wait () would go on waiting for a worker
+   to exit and never look at workers_stop.  */
+
+static void
+workers_catch (void)
+{
+  struct sigaction sa;
+
+  memset (&sa, 0, sizeof sa);
+  sa.sa_handler = workers_signal;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = 0;
+  sigaction (SIGTERM, &sa, NULL);
+  sigaction (SIGINT, &sa, NULL);
+}
+
+/* Start a new hts on the listening sockets, and wait until it is up.
+   Nothing else needs this process meanwhile.  */
+
+static int
+workers_handoff (Arguments *arg, int *fds)
+{
+  pid_t pid;
+  ssize_t n;
+  int ready;
+  char c;
+
+  pid = handoff_exec (arg->exe, arg->argv, fds, arg->workers,
+		      arg->admin_fd, &ready);
+  if (pid == -1)
+    {
+      log_error ("couldn't start %s: %s", arg->exe, strerror (errno));
+      return -1;
+    }
+  log_notice ("started %s as process %d", arg->exe, (int)pid);
+
+  do
+    n = read (ready, &c, 1);
+  while (n == -1 && errno == EINTR && !workers_stop);
+  close (ready);
+  waitpid (pid, NULL, WNOHANG);
+
+  if (n != 1)
     {
-      time_t last_tunnel_write;
+      log_error ("process %d didn't start, still serving", (int)pid);
+      return -1;
+    }
+  log_notice ("process %d took over, draining workers", (int)pid);
+  return 0;
+}
+
+/* Run one worker process per listening socket, and start a new one
+   when a worker dies.  The sockets all stay open in this process, so
+   connections steered to a dead worker wait in its backlog for the
+   replacement.  */
 
-      log_debug ("waiting for tunnel connection");
+static void
+workers_run (Arguments *arg)
+{
+  int *fds;
+  pid_t *pids;
+  int handed_over = FALSE;
+  int i, j, sig;
+
+  fds = malloc (arg->workers * sizeof *fds);
+  pids = malloc (arg->workers * sizeof *pids);
+  if (fds == NULL || pids == NULL)
+    {
+      log_error ("couldn't allocate worker table");
+      log_exit (1);
+    }
 
-      if (arg.device != NULL)
+  /* Sockets from an old process are steered already, but steering
+     them again does no harm.  */
+  if (arg->nlisten_fds > 0)
+    {
+      if (arg->nlisten_fds != arg->workers)
+	{
+	  log_error ("%d listening sockets were passed to hts, but there "
+		     "are %d workers", arg->nlisten_fds, arg->workers);
+	  log_exit (1);
+	}
+      for (i = 0; i < arg->workers; i++)
+	{
+	  fds[i] = arg->listen_fds[i];
+	  pids[i] = -1;
+	}
+    }
+  else
+    {
+      for (i = 0; i < arg->workers; i++)
 	{
-	  fd = open_device (arg.device);
-	  log_debug ("open_device (\"%s\") = %d", arg.device, fd);
-	  if (fd == -1)
+	  fds[i] = reuseport_socket (arg->port);
+	  if (fds[i] == -1)
 	    {
-	      log_error ("couldn't open %s: %s",
-			 arg.device, strerror (errno));
+	      log_error ("couldn't listen on port %d: %s",
+			 arg->port, strerror (errno));
 	      log_exit (1);
 	    }
+	  pids[i] = -1;
 	}
+    }
+
+  if (reuseport_steer (fds[0], arg->workers) == -1)
+    {
+      log_error ("couldn't steer clients to workers: %s", strerror (errno));
+      log_exit (1);
+    }
+
+  workers_catch ();
+  server_detach (arg);
+
+  while (!workers_stop)
+    {
+      time_t started = 0;
+      int status;
+      pid_t pid;
 
-      if (tunnel_accept (tunnel) == -1)
+      if (handoff_requested)
 	{
-	  log_notice ("couldn't accept connection: %s", strerror (errno));
-	  continue;
+	  handoff_requested = 0;
+	  if (workers_handoff (arg, fds) == 0)
+	    {
+	      handed_over = TRUE;
+	      break;
+	    }
 	}
-      log_notice ("connected to FIXME:hostname:port");
 
-      if (arg.forward_port != -1)
+      for (i = 0; i < arg->workers; i++)
 	{
-	  struct sockaddr_in addr;
+	  if (pids[i] != -1)
+	    continue;
 
-	  if (set_address (&addr, arg.forward_host, arg.forward_port) == -1)
+	  pids[i] = fork ();
+	  if (pids[i] == 0)
 	    {
-	      log_error ("couldn't forward port to %s:%d: %s\n",
-			 arg.forward_host, arg.forward_port, strerror (errno));
-	      log_exit (1);
+	      signal (SIGTERM, SIG_DFL);
+	      signal (SIGINT, SIG_DFL);
+	      handoff_requested = 0;
+	      for (j = 0; j < arg->workers; j++)
+		if (j != i)
+		  close (fds[j]);
+	      worker_main (arg, fds[i], i);
 	    }
+	  else if (pids[i] == -1)
+	    log_error ("couldn't fork worker %d: %s", i, strerror (errno));
+	  time (&started);
+	}
 
-	  fd = do_connect (&addr);
-	  log_debug ("do_connect (\"%s:%d\") = %d",
-		 arg.forward_host, arg.forward_port, fd);
-	  if (fd == -1)
-	    {
-	      log_error ("couldn't connect to %s:%d: %s\n",
-			 arg.forward_host, arg.forward_port, strerror (errno));
-	      log_exit (1);
-	    }
+      pid = wait (&status);
+      if (pid == -1)
+	{
+	  if (errno != EINTR)
+	    sleep (1);
+	  continue;
 	}
 
-      closed = FALSE;
-      time (&last_tunnel_write);
-      while (!closed)
-	{
-	  struct pollfd pollfd[2];
-	  int timeout;
-	  time_t t;
-	  int n;
-      
-	  pollfd[0].fd = fd;
-	  pollfd[0].events = POLLIN;
-	  pollfd[1].fd = tunnel_pollin_fd (tunnel);
-	  pollfd[1].events = POLLIN;
-
-	  time (&t);
-	  timeout = 1000 * (arg.keep_alive - (t - last_tunnel_write));
-	  if (timeout < 0)
-	    timeout = 0;
-
-	  log_annoying ("poll () ...");
-	  n = poll (pollfd, 2, timeout);
-	  log_annoying ("... = %d", n);
-	  if (n == -1)
-	    {
-	      log_error ("poll error: %s\n", strerror (errno));
-	      log_exit (1);
-	    }
-	  else if (n == 0)
-	    {
-	      log_verbose ("poll() timed out");
-	      tunnel_padding (tunnel, 1);
-	      time (&last_tunnel_write);
-	      continue;
-	    }
+      for (i = 0; i < arg->workers; i++)
+	if (pids[i] == pid)
+	  {
+	    log_error ("worker %d exited with status %d", i, status);
+	    pids[i] = -1;
+	  }
 
-	  log_annoying ("revents[0] = %x, revents[1] = %x, POLLIN = %x",
-			pollfd[0].revents, pollfd[1].revents, POLLIN);
-	  handle_input ("device or port", tunnel, fd, pollfd[0].revents,
-			handle_device_input, &closed);
-	  handle_input ("tunnel", tunnel, fd, pollfd[1].revents,
-			handle_tunnel_input, &closed);
+      /* Don't spin if workers die right after they start.  */
+      if (time (NULL) - started < 1)
+	sleep (1);
+    }
 
-	  if (pollfd[0].revents & POLLIN)
-	    time (&last_tunnel_write);
+  /* Waiting for draining workers, SIGTERM still stops them.  */
+  sig = handed_over ? SIGUSR2 : SIGTERM;
+  for (i = 0; i < arg->workers; i++)
+    if (pids[i] > 0)
+      kill (pids[i], sig);
+  for (;;)
+    {
+      if (wait (NULL) > 0)
+	continue;
+      if (errno != EINTR)
+	break;
+      if (workers_stop && sig != SIGTERM)
+	{
+	  sig = SIGTERM;
+	  for (i = 0; i < arg->workers; i++)
+	    if (pids[i] > 0)
+	      kill (pids[i], sig);
 	}
+    }
 
-      log_debug ("closing tunnel");
-      close (fd);
-      tunnel_close (tunnel);
-      log_notice ("disconnected from FIXME:hostname:port");
+  free (pids);
+  free (fds);
+}
+
+int
+main (int argc, char **argv)
+{
+  Arguments arg;
+  Server server;
+  char *exe;
+  int i, admin_fd;
+
+  parse_arguments (argc, argv, &arg);
+
+  /* daemon () changes to the root directory.  */
+  arg.argv = argv;
+  arg.exe = argv[0];
+  if (strchr (argv[0], '/') != NULL
+      && (exe = realpath (argv[0], NULL)) != NULL)
+    arg.exe = exe;
+
+  /* Before daemon () forks, while the pid is the one they were
+     handed to.  A service manager which passes sockets also watches
+     the process it started.  */
+  arg.nlisten_fds = handoff_inherit (&arg.listen_fds, &admin_fd);
+  if (arg.nlisten_fds == 0)
+    {
+      if (arg.inetd)
+	arg.nlisten_fds = handoff_inetd (&arg.listen_fds);
+      else if ((arg.nlisten_fds = handoff_activated (&arg.listen_fds)) > 0)
+	arg.foreground = TRUE;
+    }
+  if (arg.nlisten_fds == -1)
+    {
+      fprintf (stderr, "%s: bad listening sockets passed to hts: %s\n",
+	       arg.me, strerror (errno));
+      exit (1);
     }
 
-  log_debug ("destroying tunnel");
-  tunnel_destroy (tunnel);
+#ifdef DEBUG_MODE
+  if (debug_level != 0 && debug_file == NULL)
+    debug_file = stdout;
+#else
+  openlog ("hts", LOG_PID, LOG_DAEMON);
+#endif
+
+  log_notice ("hts (%s) %s started with arguments:", PACKAGE, VERSION);
+  log_notice ("  me = %s", arg.me);
+  log_notice ("  device = %s", arg.device ? arg.device : "(null)");
+  log_notice ("  port = %d", arg.port);
+  log_notice ("  forward_port = %d", arg.forward_port);
+  log_notice ("  forward_host = %s",
+	      arg.forward_host ? arg.forward_host : "(null)");
+  log_notice ("  content_length = %lu%s",
+	      (unsigned long)arg.content_length,
+	      arg.content_length_auto ? " (auto)" : "");
+  log_notice ("  max_sessions = %d", arg.session_limit);
+  log_notice ("  max_client_sessions = %d", arg.max_client_sessions);
+  log_notice ("  session_rate = %lu", arg.session_rate);
+  log_notice ("  workers = %d", arg.workers);
+  log_notice ("  splice = %d", arg.splice);
+  log_notice ("  buffer_memory = %lu", (unsigned long)arg.buffer_memory);
+  log_notice ("  idle_timeout = %d", arg.idle_timeout);
+  log_notice ("  drain_timeout = %d", arg.drain_timeout);
+  log_notice ("  foreground = %d", arg.foreground);
+  log_notice ("  inetd = %d", arg.inetd);
+  log_notice ("  listen_fds = %d", arg.nlisten_fds);
+  log_notice ("  dns_ttl = %d", arg.dns_ttl);
+  log_notice ("  forward_pool = %d", arg.forward_pool);
+  for (i = 1; i < arg.nforwards; i++)
+    log_notice ("  forward_port[%d] = %s:%d", i,
+		arg.forward_hosts[i], arg.forward_ports[i]);
+  log_notice ("  balance = %d", arg.balance);
+  log_notice ("  persistent = %d", arg.persistent);
+  log_notice ("  chunked = %d", arg.chunked);
+  log_notice ("  compress = %s", arg.compress ? arg.compress : "(null)");
+  log_notice ("  coalesce_usec = %d", arg.coalesce_usec);
+  log_notice ("  coalesce_bytes = %lu", (unsigned long)arg.coalesce_bytes);
+  log_notice ("  jumbo = %lu", (unsigned long)arg.jumbo);
+  log_notice ("  max_streams = %d", arg.max_streams);
+  log_notice ("  high_water = %lu", (unsigned long)arg.high_water);
+  log_notice ("  stats_port = %d", arg.stats_port);
+  log_notice ("  log_rate = %d", arg.log_rate);
+  log_notice ("  debug_level = %d", debug_level);
+  log_notice ("  pid_filename = %s",
+	      arg.pid_filename ? arg.pid_filename : "(null)");
+
+#ifdef DEBUG_MODE
+  signal (SIGPIPE, log_sigpipe);
+#else
+  signal (SIGPIPE, SIG_IGN);
+#endif
+  handoff_catch ();
+
+  arg.stats = stats_new (arg.workers, arg.max_sessions);
+  if (arg.stats == NULL)
+    {
+      log_error ("couldn't map counters: %s", strerror (errno));
+      log_exit (1);
+    }
+
+  if (arg.stats_port != -1 && admin_fd != -1)
+    arg.admin_fd = admin_fd;
+  else if (arg.stats_port != -1)
+    {
+      arg.admin_fd = admin_socket (arg.stats_host, arg.stats_port);
+      if (arg.admin_fd == -1)
+	{
+	  log_error ("couldn't listen on %s:%d: %s", arg.stats_host,
+		     arg.stats_port, strerror (errno));
+	  log_exit (1);
+	}
+    }
+  else if (admin_fd != -1)
+    close (admin_fd);
+
+  if (arg.workers > 1)
+    {
+      workers_run (&arg);
+      log_exit (0);
+    }
+
+  if (server_init (&server, &arg, 0) == -1)
+    {
+      log_error ("couldn't set up server: %s", strerror (errno));
+      log_exit (1);
+    }
+
+  if (arg.nlisten_fds > 1)
+    {
+      log_error ("%d listening sockets were passed to hts, but there "
+		 "are no --workers", arg.nlisten_fds);
+      log_exit (1);
+    }
+
+  if (server_start (&server,
+		    arg.nlisten_fds > 0 ? arg.listen_fds[0] : -1) == -1)
+    {
+      log_error ("couldn't create tunnel", argv[0]);
+      log_exit (1);
+    }
+  server_detach (&arg);
+  server.stats->pid = getpid ();
+
+  server_run (&server);
+  server_destroy (&server);
  
   log_exit (0);
 }
@@ -0,0 +1,137 @@
+/*
+logring.c
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+
+Messages are formatted straight into fixed slots.  head and tail count
+slots written and read, so head - tail is the number queued.  A token
+bucket, refilled every millisecond, limits the rate.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include "common.h"
+#include "timer.h"
+#include "logring.h"
+
+static struct
+{
+  char (*slot)[LOG_RING_LINE];	/* NULL until started */
+  FILE *file;
+  unsigned long head;
+  unsigned long tail;
+  int rate;			/* messages a second, or 0 */
+  long tokens;			/* in thousandths of a message */
+  unsigned long refilled;	/* timer_now () */
+  unsigned long dropped;
+} ring;
+
+static void
+log_ring_exit (void)
+{
+  log_ring_drain (0);
+}
+
+int
+log_ring_start (FILE *file, int rate)
+{
+  if (ring.slot == NULL)
+    {
+      ring.slot = malloc (LOG_RING_SLOTS * sizeof *ring.slot);
+      if (ring.slot == NULL)
+	return -1;
+      atexit (log_ring_exit);
+    }
+
+  ring.file = file;
+  ring.head = ring.tail = 0;
+  ring.rate = rate;
+  ring.tokens = 1000L * rate;
+  ring.refilled = timer_now ();
+  ring.dropped = 0;
+  return 0;
+}
+
+/* Whether the token bucket lets one more message through.  A second's
+   worth of messages may come in a burst.  */
+
+static int
+log_ring_admit (void)
+{
+  unsigned long now;
+
+  if (ring.rate == 0)
+    return TRUE;
+
+  if (ring.tokens < 1000)
+    {
+      now = timer_now ();
+      ring.tokens += (long)(now - ring.refilled) * ring.rate;
+      ring.refilled = now;
+      if (ring.tokens > 1000L * ring.rate)
+	ring.tokens = 1000L * ring.rate;
+      if (ring.tokens < 1000)
+	return FALSE;
+    }
+
+  ring.tokens -= 1000;
+  return TRUE;
+}
+
+void
+log_ring (FILE *file, const char *format, ...)
+{
+  va_list ap;
+
+  if (ring.slot == NULL)
+    {
+      if (file == NULL)
+	file = stderr;
+      va_start (ap, format);
+      vfprintf (file, format, ap);
+      va_end (ap);
+      fputc ('\n', file);
+      fflush (file);
+      return;
+    }
+
+  if (ring.head - ring.tail == LOG_RING_SLOTS || !log_ring_admit ())
+    {
+      ring.dropped++;
+      return;
+    }
+
+  va_start (ap, format);
+  vsnprintf (ring.slot[ring.head % LOG_RING_SLOTS], LOG_RING_LINE,
+	     format, ap);
+  va_end (ap);
+  ring.head++;
+}
+
+int
+log_ring_drain (int max)
+{
+  int n;
+
+  if (ring.slot == NULL || (ring.head == ring.tail && ring.dropped == 0))
+    return 0;
+
+  for (n = 0; ring.tail != ring.head && (max == 0 || n < max); n++)
+    {
+      fputs (ring.slot[ring.tail % LOG_RING_SLOTS], ring.file);
+      fputc ('\n', ring.file);
+      ring.tail++;
+    }
+
+  /* Say so after the messages that did get through.  */
+  if (ring.dropped > 0 && ring.tail == ring.head)
+    {
+      fprintf (ring.file, "(%lu debug messages dropped)\n", ring.dropped);
+      ring.dropped = 0;
+    }
+
+  fflush (ring.file);
+  return (int)(ring.head - ring.tail);
+}
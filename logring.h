@@ -0,0 +1,37 @@
+/*
+logring.h
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+
+A ring of debug messages, so that logging from the event loop costs a
+vsnprintf () rather than a write to the log file.  The loop drains the
+ring between rounds.  Each process has its own ring, which is written
+and read by the same thread, so it needs no locking.
+*/
+
+#ifndef LOGRING_H
+#define LOGRING_H
+
+#include <stdio.h>
+
+#define LOG_RING_SLOTS	4096
+#define LOG_RING_LINE	256	/* longer messages are cut short */
+
+/* Keep messages for FILE at most RATE a second, or any number of them
+   if RATE is 0.  Messages over the rate, or that don't fit in the
+   ring, are dropped and counted.  Returns -1 if out of memory, and
+   then messages are still written at once.  */
+extern int log_ring_start (FILE *file, int rate);
+
+/* Queue a message, or write it to FILE if the ring isn't started.  */
+extern void log_ring (FILE *file, const char *format, ...)
+#ifdef __GNUC__
+  __attribute__ ((format (printf, 2, 3)))
+#endif
+  ;
+
+/* Write MAX messages, or all of them if MAX is 0.  Returns the number
+   still queued.  */
+extern int log_ring_drain (int max);
+
+#endif /* LOGRING_H */
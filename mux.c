@@ -0,0 +1,121 @@
+/*
+mux.c
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+*/
+
+#include <string.h>
+
+#include "mux.h"
+
+/* The header length of a frame of TYPE, or 0 if it's unknown.  */
+
+static size_t
+header_length (int type)
+{
+  switch (type)
+    {
+    case MUX_OPEN:
+    case MUX_CLOSE:
+      return 5;
+    case MUX_DATA:
+      return 7;
+    case MUX_WINDOW:
+      return 9;
+    default:
+      return 0;
+    }
+}
+
+static unsigned long
+get_long (const unsigned char *p)
+{
+  return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16)
+    | ((unsigned long)p[2] << 8) | p[3];
+}
+
+static void
+put_long (char *p, unsigned long x)
+{
+  p[0] = (x >> 24) & 0xff;
+  p[1] = (x >> 16) & 0xff;
+  p[2] = (x >> 8) & 0xff;
+  p[3] = x & 0xff;
+}
+
+void
+mux_parser_init (MuxParser *parser)
+{
+  memset (parser, 0, sizeof *parser);
+}
+
+int
+mux_parse (MuxParser *parser, const char *buf, size_t len, MuxFrame *frame)
+{
+  size_t need, n;
+
+  frame->type = 0;
+  if (len == 0)
+    return 0;
+
+  /* In the middle of a data frame.  */
+  if (parser->left > 0)
+    {
+      n = len < parser->left ? len : parser->left;
+      parser->left -= n;
+      frame->type = MUX_DATA;
+      frame->id = parser->id;
+      frame->data = buf;
+      frame->len = n;
+      return n;
+    }
+
+  if (parser->have == 0)
+    parser->type = (unsigned char)buf[0];
+  need = header_length (parser->type);
+  if (need == 0)
+    return -1;
+
+  n = need - parser->have;
+  if (n > len)
+    n = len;
+  memcpy (parser->head + parser->have, buf, n);
+  parser->have += n;
+  if (parser->have < need)
+    return n;
+
+  parser->have = 0;
+  parser->id = get_long (parser->head + 1);
+  frame->id = parser->id;
+  switch (parser->type)
+    {
+    case MUX_DATA:
+      parser->left = (parser->head[5] << 8) | parser->head[6];
+      /* An empty data frame tells nothing.  */
+      return n;
+    case MUX_WINDOW:
+      frame->value = get_long (parser->head + 5);
+      break;
+    }
+
+  frame->type = parser->type;
+  return n;
+}
+
+size_t
+mux_header (char *buf, int type, unsigned long id, unsigned long value)
+{
+  buf[0] = type;
+  put_long (buf + 1, id);
+  switch (type)
+    {
+    case MUX_DATA:
+      buf[5] = (value >> 8) & 0xff;
+      buf[6] = value & 0xff;
+      break;
+    case MUX_WINDOW:
+      put_long (buf + 5, value);
+      break;
+    }
+  return header_length (type);
+}
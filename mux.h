@@ -0,0 +1,61 @@
+/*
+mux.h
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+
+Frames of the stream multiplexing protocol, which runs inside the
+TUNNEL_DATA payload of a tunnel.  See HACKING for the format.  The
+parser takes the tunnel's byte stream in pieces of any size, and hands
+data frames on in slices, so nothing has to be buffered.
+*/
+
+#ifndef MUX_H
+#define MUX_H
+
+#include <stddef.h>
+
+#define MUX_OPEN	0x01
+#define MUX_DATA	0x02
+#define MUX_CLOSE	0x03
+#define MUX_WINDOW	0x04
+
+#define MUX_HEADER_MAX	9	/* type, stream id, and length or value */
+#define MUX_DATA_MAX	65535
+
+/* Every stream may have this many bytes in flight in each direction
+   before the receiver has sent MUX_WINDOW.  */
+#define MUX_WINDOW_INITIAL (256 * 1024)
+
+typedef struct
+{
+  int type;			/* a MUX_* frame, or 0 for nothing yet */
+  unsigned long id;
+  unsigned long value;		/* MUX_WINDOW increment */
+  const char *data;		/* part of a MUX_DATA payload */
+  size_t len;
+} MuxFrame;
+
+typedef struct
+{
+  unsigned char head[MUX_HEADER_MAX];
+  size_t have;			/* bytes of head read */
+  size_t left;			/* payload left of the current frame */
+  int type;
+  unsigned long id;
+} MuxParser;
+
+extern void mux_parser_init (MuxParser *parser);
+
+/* Parse at most one frame, or a slice of a MUX_DATA payload, from the
+   LEN bytes at BUF into FRAME.  Returns the number of bytes used,
+   which is more than 0 if LEN is, or -1 if the frame type is unknown.
+   FRAME->type is 0 if more bytes are needed.  */
+extern int mux_parse (MuxParser *parser, const char *buf, size_t len,
+		      MuxFrame *frame);
+
+/* Write the header of a frame to BUF and return its length.  VALUE is
+   the payload length of MUX_DATA, or the increment of MUX_WINDOW.  */
+extern size_t mux_header (char *buf, int type, unsigned long id,
+			  unsigned long value);
+
+#endif /* MUX_H */
@@ -0,0 +1,155 @@
+/*
+pool.c
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+*/
+
+#include <stdlib.h>
+
+#include "common.h"
+#include "pool.h"
+
+/* Number of buffers allocated from the heap at once.  */
+#define SLAB_BUFFERS 16
+
+typedef struct slab Slab;
+
+struct slab
+{
+  Slab *next;
+};
+
+typedef union free_buffer
+{
+  union free_buffer *next;
+  double align;
+} FreeBuffer;
+
+struct buffer_pool
+{
+  size_t size;
+  size_t limit;
+  size_t bytes;
+  size_t in_use;
+  Slab *slabs;
+  FreeBuffer *free;
+};
+
+BufferPool *
+pool_new (size_t size, size_t limit)
+{
+  BufferPool *pool;
+
+  pool = malloc (sizeof (BufferPool));
+  if (pool == NULL)
+    return NULL;
+
+  /* Keep every buffer aligned.  */
+  if (size < sizeof (FreeBuffer))
+    size = sizeof (FreeBuffer);
+  size = (size + sizeof (FreeBuffer) - 1) & ~(sizeof (FreeBuffer) - 1);
+
+  pool->size = size;
+  pool->limit = limit;
+  pool->bytes = 0;
+  pool->in_use = 0;
+  pool->slabs = NULL;
+  pool->free = NULL;
+  return pool;
+}
+
+void
+pool_destroy (BufferPool *pool)
+{
+  Slab *slab, *next;
+
+  for (slab = pool->slabs; slab != NULL; slab = next)
+    {
+      next = slab->next;
+      free (slab);
+    }
+  free (pool);
+}
+
+/* Allocate a slab of as many buffers as the limit allows.  */
+
+static int
+pool_grow (BufferPool *pool)
+{
+  size_t header, n, i;
+  Slab *slab;
+  char *p;
+
+  header = (sizeof (Slab) + sizeof (FreeBuffer) - 1)
+    & ~(sizeof (FreeBuffer) - 1);
+
+  n = SLAB_BUFFERS;
+  if (pool->limit != 0)
+    {
+      if (pool->bytes + header + pool->size > pool->limit)
+	return -1;
+      if (pool->bytes + header + n * pool->size > pool->limit)
+	n = (pool->limit - pool->bytes - header) / pool->size;
+    }
+
+  slab = malloc (header + n * pool->size);
+  if (slab == NULL)
+    return -1;
+  slab->next = pool->slabs;
+  pool->slabs = slab;
+  pool->bytes += header + n * pool->size;
+
+  p = (char *)slab + header;
+  for (i = 0; i < n; i++, p += pool->size)
+    {
+      FreeBuffer *buffer = (FreeBuffer *)p;
+      buffer->next = pool->free;
+      pool->free = buffer;
+    }
+
+  return 0;
+}
+
+void *
+pool_get (BufferPool *pool)
+{
+  FreeBuffer *buffer;
+
+  if (pool->free == NULL && pool_grow (pool) == -1)
+    return NULL;
+
+  buffer = pool->free;
+  pool->free = buffer->next;
+  pool->in_use++;
+  return buffer;
+}
+
+void
+pool_put (BufferPool *pool, void *buffer)
+{
+  FreeBuffer *b = buffer;
+
+  if (b == NULL)
+    return;
+  b->next = pool->free;
+  pool->free = b;
+  pool->in_use--;
+}
+
+size_t
+pool_buffer_size (BufferPool *pool)
+{
+  return pool->size;
+}
+
+size_t
+pool_bytes (BufferPool *pool)
+{
+  return pool->bytes;
+}
+
+size_t
+pool_in_use (BufferPool *pool)
+{
+  return pool->in_use;
+}
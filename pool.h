@@ -0,0 +1,31 @@
+/*
+pool.h
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+
+A pool of fixed-size buffers, carved out of large slabs and kept on a
+free list, so that sessions coming and going don't touch the heap.
+Each worker process has a pool of its own, so no locking is needed.
+*/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+typedef struct buffer_pool BufferPool;
+
+/* Create a pool of SIZE byte buffers.  The pool never holds more than
+   LIMIT bytes in all, or is unbounded if LIMIT is 0.  */
+extern BufferPool *pool_new (size_t size, size_t limit);
+extern void pool_destroy (BufferPool *pool);
+
+/* Return a buffer, or NULL if the limit has been reached.  */
+extern void *pool_get (BufferPool *pool);
+extern void pool_put (BufferPool *pool, void *buffer);
+
+extern size_t pool_buffer_size (BufferPool *pool);
+extern size_t pool_bytes (BufferPool *pool);	/* allocated from heap */
+extern size_t pool_in_use (BufferPool *pool);	/* buffers handed out */
+
+#endif /* POOL_H */
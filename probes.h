@@ -0,0 +1,39 @@
+/*
+probes.h
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+
+Static tracepoints for bpftrace, perf, SystemTap and DTrace, in the
+"hts" provider.  With <sys/sdt.h> (HAVE_SYS_SDT_H) a probe is a nop and
+a note in the ELF file, and costs next to nothing until a tracer
+attaches to it.  Without it, or if NO_PROBES is defined, probes
+compile to nothing at all.  The probes are listed in HACKING.
+
+Two underscores in a name become a dash for the tracer, so
+PROBE1 (input__start, ...) is hts:input-start.
+*/
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#if defined HAVE_SYS_SDT_H && !defined NO_PROBES
+
+#include <sys/sdt.h>
+
+#define PROBE0(name)			DTRACE_PROBE (hts, name)
+#define PROBE1(name, a)			DTRACE_PROBE1 (hts, name, a)
+#define PROBE2(name, a, b)		DTRACE_PROBE2 (hts, name, a, b)
+#define PROBE3(name, a, b, c)		DTRACE_PROBE3 (hts, name, a, b, c)
+#define PROBE4(name, a, b, c, d)	DTRACE_PROBE4 (hts, name, a, b, c, d)
+
+#else
+
+#define PROBE0(name)			do { } while (0)
+#define PROBE1(name, a)			do { } while (0)
+#define PROBE2(name, a, b)		do { } while (0)
+#define PROBE3(name, a, b, c)		do { } while (0)
+#define PROBE4(name, a, b, c, d)	do { } while (0)
+
+#endif
+
+#endif /* PROBES_H */
@@ -0,0 +1,738 @@
+/*
+replay.c
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+
+A reader of classic pcap files.  TCP segments are taken in sequence
+order as they come, and retransmitted bytes are dropped.  A stream with
+a hole in it is given up, and so is one that the capture joins in the
+middle of an HTTP message.  Each stream is parsed as HTTP while its
+bytes arrive, so that a tunnel request gets the time of the packet
+that completed it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "common.h"
+#include "replay.h"
+
+#define PCAP_MAGIC		0xa1b2c3d4UL
+#define PCAP_MAGIC_NSEC		0xa1b23c4dUL
+#define PCAPNG_MAGIC		0x0a0d0d0aUL
+
+#define LINKTYPE_NULL		0
+#define LINKTYPE_ETHERNET	1
+#define LINKTYPE_RAW		101
+#define LINKTYPE_LINUX_SLL	113
+#define LINKTYPE_IPV4		228
+#define LINKTYPE_LINUX_SLL2	276
+
+#define SNAP_MAX	262144
+#define HEAD_MAX	8192	/* the longest HTTP header followed */
+#define BUCKETS		1021
+
+#define TCP_SYN		0x02
+
+/* Requests of the tunnel protocol, see HACKING.  */
+#define TUNNEL_OPEN		0x01
+#define TUNNEL_DATA		0x02
+#define TUNNEL_ZDATA		0x05
+#define TUNNEL_JDATA		0x06
+#define TUNNEL_SIMPLE		0x40
+#define TUNNEL_PAD1		0x45
+#define TUNNEL_DISCONNECT	0x47
+
+enum
+{
+  ST_HEAD,			/* reading an HTTP header */
+  ST_TUNNEL,			/* a body of tunnel requests */
+  ST_SKIP,			/* any other body */
+  ST_DEAD			/* not followed any more */
+};
+
+/* Where a chunked body is.  */
+enum
+{
+  CH_SIZE,			/* the chunk size */
+  CH_EXT,			/* the rest of its line */
+  CH_DATA,			/* the chunk */
+  CH_END,			/* the line end after it */
+  CH_TRAILER			/* trailers after the last chunk */
+};
+
+/* One direction of a TCP connection.  */
+typedef struct stream
+{
+  struct stream *next;		/* in its bucket */
+  unsigned long src, dst;
+  int sport, dport;
+  unsigned long seq;		/* of the next byte */
+  int synced;
+  int get;			/* sent a GET: the other way is its reply */
+  int state;
+  char *head;			/* [HEAD_MAX + 1] */
+  size_t head_len;
+  long body_left;		/* or -1 until the connection ends */
+  int chunked;			/* Transfer-Encoding: chunked */
+  int chunk;			/* CH_... */
+  unsigned long chunk_left;
+  size_t chunk_line;		/* characters in this trailer line */
+  int session;			/* for ST_TUNNEL ... */
+  int up;			/* ... and which way it goes */
+  unsigned char req[5];		/* header of the request being read */
+  size_t req_len;
+  unsigned long data_left;	/* of its data */
+  int data;			/* it carries payload */
+  size_t frame_len;
+} Stream;
+
+typedef struct
+{
+  Replay *replay;
+  int sessions_size;
+  Stream *bucket[BUCKETS];
+  int big;			/* big endian file */
+  int linktype;
+  int failed;			/* out of memory */
+} Loader;
+
+static unsigned long
+get32 (Loader *l, const unsigned char *p)
+{
+  if (l->big)
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16)
+      | ((unsigned long)p[2] << 8) | p[3];
+  return ((unsigned long)p[3] << 24) | ((unsigned long)p[2] << 16)
+    | ((unsigned long)p[1] << 8) | p[0];
+}
+
+static unsigned long
+get_be32 (const unsigned char *p)
+{
+  return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16)
+    | ((unsigned long)p[2] << 8) | p[3];
+}
+
+static int
+get_be16 (const unsigned char *p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+/* The index of the session of client ADDR, or -1 if out of memory.  */
+
+static int
+session_for (Loader *l, unsigned long addr)
+{
+  Replay *replay = l->replay;
+  ReplaySession *session;
+  int i;
+
+  for (i = 0; i < replay->nsessions; i++)
+    if (replay->session[i].addr == addr)
+      return i;
+
+  if (replay->nsessions == l->sessions_size)
+    {
+      int size = l->sessions_size ? 2 * l->sessions_size : 16;
+
+      session = realloc (replay->session, size * sizeof *session);
+      if (session == NULL)
+	{
+	  l->failed = TRUE;
+	  return -1;
+	}
+      replay->session = session;
+      l->sessions_size = size;
+    }
+  session = &replay->session[replay->nsessions];
+  memset (session, 0, sizeof *session);
+  session->addr = addr;
+  return replay->nsessions++;
+}
+
+static void
+add_frame (Loader *l, Stream *s, unsigned long usec)
+{
+  ReplaySession *session = &l->replay->session[s->session];
+  ReplayFrame **frame = s->up ? &session->up : &session->down;
+  int *n = s->up ? &session->nup : &session->ndown;
+  int *size = &session->sizes[s->up ? 0 : 1];
+
+  if (s->frame_len == 0)
+    return;
+  if (*n == *size)
+    {
+      ReplayFrame *p;
+
+      p = realloc (*frame, (*size ? 2 * *size : 64) * sizeof *p);
+      if (p == NULL)
+	{
+	  l->failed = TRUE;
+	  return;
+	}
+      *frame = p;
+      *size = *size ? 2 * *size : 64;
+    }
+  (*frame)[*n].usec = usec;
+  (*frame)[*n].len = s->frame_len;
+  (*n)++;
+}
+
+static Stream *
+stream_find (Loader *l, unsigned long src, int sport,
+	     unsigned long dst, int dport, int create)
+{
+  unsigned long h = (src ^ dst ^ ((unsigned long)sport << 16) ^ dport)
+    % BUCKETS;
+  Stream *s;
+
+  for (s = l->bucket[h]; s != NULL; s = s->next)
+    if (s->src == src && s->dst == dst
+	&& s->sport == sport && s->dport == dport)
+      return s;
+  if (!create)
+    return NULL;
+
+  s = calloc (1, sizeof *s);
+  if (s == NULL)
+    {
+      l->failed = TRUE;
+      return NULL;
+    }
+  s->src = src;
+  s->dst = dst;
+  s->sport = sport;
+  s->dport = dport;
+  s->next = l->bucket[h];
+  l->bucket[h] = s;
+  return s;
+}
+
+/* A new connection on the same addresses and ports.  */
+
+static void
+stream_reset (Stream *s)
+{
+  s->synced = FALSE;
+  s->get = FALSE;
+  s->state = ST_HEAD;
+  s->head_len = 0;
+  s->body_left = 0;
+  s->chunked = FALSE;
+  s->req_len = 0;
+  s->data_left = 0;
+}
+
+/* Decide what follows the header just read.  PUT and POST bodies
+   from a client, and replies to its GETs, are tunnel requests.  */
+
+static void
+stream_head (Loader *l, Stream *s)
+{
+  Stream *reverse;
+  long length = -1;
+  int chunked = FALSE;
+  char *line;
+
+  for (line = strstr (s->head, "\r\n"); line != NULL;
+       line = strstr (line, "\r\n"))
+    {
+      line += 2;
+      if (strncasecmp (line, "Content-Length:", 15) == 0)
+	length = atol (line + 15);
+      else if (strncasecmp (line, "Transfer-Encoding:", 18) == 0)
+	{
+	  line += 18;
+	  line += strspn (line, " \t");
+	  chunked = strncasecmp (line, "chunked", 7) == 0;
+	}
+    }
+
+  s->req_len = 0;
+  s->data_left = 0;
+  if (strncmp (s->head, "PUT ", 4) == 0 || strncmp (s->head, "POST ", 5) == 0)
+    {
+      s->session = session_for (l, s->src);
+      s->up = TRUE;
+      s->state = ST_TUNNEL;
+      s->body_left = length < 0 ? 0 : length;
+    }
+  else if (strncmp (s->head, "GET ", 4) == 0)
+    {
+      s->get = TRUE;
+      s->state = ST_SKIP;
+      s->body_left = length < 0 ? 0 : length;
+    }
+  else if (strncmp (s->head, "HTTP/", 5) == 0)
+    {
+      reverse = stream_find (l, s->dst, s->dport, s->src, s->sport, FALSE);
+      if (reverse != NULL && reverse->get)
+	{
+	  s->session = session_for (l, s->dst);
+	  s->up = FALSE;
+	  s->state = ST_TUNNEL;
+	}
+      else
+	s->state = ST_SKIP;
+      s->body_left = length;
+    }
+  else
+    s->state = ST_DEAD;
+
+  if (s->state == ST_TUNNEL && s->session == -1)
+    s->state = ST_DEAD;
+
+  /* The chunks end the body, whatever Content-Length says.  */
+  s->chunked = chunked && s->state != ST_DEAD;
+  if (s->chunked)
+    {
+      s->body_left = -1;
+      s->chunk = CH_SIZE;
+      s->chunk_left = 0;
+    }
+  if (s->state != ST_DEAD && s->body_left == 0)
+    s->state = ST_HEAD;
+}
+
+/* Part of a body of tunnel requests.  Anything that isn't a request
+   means it's some other kind of body after all.  */
+
+static void
+tunnel_input (Loader *l, Stream *s, const unsigned char *p, size_t len,
+	      unsigned long usec)
+{
+  while (len > 0 && s->state == ST_TUNNEL)
+    {
+      size_t head, n;
+
+      if (s->data_left > 0)
+	{
+	  n = len < s->data_left ? len : s->data_left;
+	  s->data_left -= n;
+	  p += n;
+	  len -= n;
+	  if (s->data_left == 0 && s->data)
+	    add_frame (l, s, usec);
+	  continue;
+	}
+
+      if (s->req_len == 0 && (p[0] & TUNNEL_SIMPLE))
+	{
+	  if (p[0] < TUNNEL_PAD1 || p[0] > TUNNEL_DISCONNECT)
+	    s->state = ST_SKIP;
+	  p++;
+	  len--;
+	  continue;
+	}
+      if (s->req_len == 0 && (p[0] < TUNNEL_OPEN || p[0] > TUNNEL_JDATA))
+	{
+	  s->state = ST_SKIP;
+	  return;
+	}
+
+      s->req[s->req_len++] = *p++;
+      len--;
+      head = s->req[0] == TUNNEL_JDATA ? 5 : 3;
+      if (s->req_len < head)
+	continue;
+      s->req_len = 0;
+      if (head == 5)
+	s->data_left = get_be32 (s->req + 1);
+      else
+	s->data_left = get_be16 (s->req + 1);
+      s->data = s->req[0] == TUNNEL_DATA || s->req[0] == TUNNEL_ZDATA
+	|| s->req[0] == TUNNEL_JDATA;
+      s->frame_len = s->data_left;
+    }
+}
+
+/* Part of a chunked body.  The chunks are passed on without their
+   framing, and the body ends after the last one.  Returns the number
+   of bytes that belonged to the body.  */
+
+static size_t
+chunk_input (Loader *l, Stream *s, const unsigned char *p, size_t len,
+	     unsigned long usec)
+{
+  size_t i = 0, n;
+  int c;
+
+  while (i < len && (s->state == ST_TUNNEL || s->state == ST_SKIP))
+    {
+      if (s->chunk == CH_DATA)
+	{
+	  n = len - i;
+	  if (n > s->chunk_left)
+	    n = s->chunk_left;
+	  if (s->state == ST_TUNNEL)
+	    tunnel_input (l, s, p + i, n, usec);
+	  i += n;
+	  if ((s->chunk_left -= n) == 0)
+	    s->chunk = CH_END;
+	  continue;
+	}
+
+      c = p[i++];
+      switch (s->chunk)
+	{
+	case CH_SIZE:
+	  if (isxdigit (c))
+	    {
+	      if (s->chunk_left > 0x7ffffffUL)
+		{
+		  s->state = ST_DEAD;
+		  break;
+		}
+	      s->chunk_left = 16 * s->chunk_left
+		+ (isdigit (c) ? c - '0' : tolower (c) - 'a' + 10);
+	      break;
+	    }
+	  s->chunk = CH_EXT;
+	  /* Fall through.  */
+	case CH_EXT:
+	  if (c != '\n')
+	    break;
+	  s->chunk = s->chunk_left > 0 ? CH_DATA : CH_TRAILER;
+	  s->chunk_line = 0;
+	  break;
+	case CH_END:
+	  if (c == '\n')
+	    {
+	      s->chunk = CH_SIZE;
+	      s->chunk_left = 0;
+	    }
+	  break;
+	case CH_TRAILER:
+	  if (c == '\n' && s->chunk_line == 0)
+	    {
+	      s->chunked = FALSE;
+	      s->state = ST_HEAD;
+	    }
+	  else if (c == '\n')
+	    s->chunk_line = 0;
+	  else if (c != '\r')
+	    s->chunk_line++;
+	  break;
+	}
+    }
+  return i;
+}
+
+static void
+stream_input (Loader *l, Stream *s, const unsigned char *p, size_t len,
+	      unsigned long usec)
+{
+  while (len > 0 && s->state != ST_DEAD && !l->failed)
+    {
+      size_t n;
+
+      if (s->state == ST_HEAD)
+	{
+	  size_t old = s->head_len;
+	  char *end;
+
+	  if (s->head == NULL && (s->head = malloc (HEAD_MAX + 1)) == NULL)
+	    {
+	      l->failed = TRUE;
+	      return;
+	    }
+	  n = HEAD_MAX - old;
+	  if (n > len)
+	    n = len;
+	  memcpy (s->head + old, p, n);
+	  s->head_len += n;
+	  s->head[s->head_len] = 0;
+	  end = strstr (s->head + (old < 3 ? 0 : old - 3), "\r\n\r\n");
+	  if (end == NULL)
+	    {
+	      if (s->head_len == HEAD_MAX)
+		s->state = ST_DEAD;
+	      return;
+	    }
+
+	  *end = 0;
+	  n = end + 4 - s->head - old;
+	  stream_head (l, s);
+	  s->head_len = 0;
+	  p += n;
+	  len -= n;
+	  continue;
+	}
+
+      if (s->chunked)
+	{
+	  n = chunk_input (l, s, p, len, usec);
+	  p += n;
+	  len -= n;
+	  continue;
+	}
+
+      n = len;
+      if (s->body_left >= 0 && (long)n > s->body_left)
+	n = s->body_left;
+      if (s->state == ST_TUNNEL)
+	tunnel_input (l, s, p, n, usec);
+      if (s->body_left >= 0 && (s->body_left -= n) == 0)
+	s->state = ST_HEAD;
+      p += n;
+      len -= n;
+    }
+}
+
+static void
+packet (Loader *l, const unsigned char *p, size_t len, unsigned long usec)
+{
+  unsigned long src, dst, seq, ahead, behind;
+  int sport, dport, flags, proto;
+  size_t off = 0, n;
+  Stream *s;
+
+  switch (l->linktype)
+    {
+    case LINKTYPE_ETHERNET:
+      if (len < 14)
+	return;
+      proto = get_be16 (p + 12);
+      off = 14;
+      while ((proto == 0x8100 || proto == 0x88a8) && len >= off + 4)
+	{
+	  proto = get_be16 (p + off + 2);
+	  off += 4;
+	}
+      if (proto != 0x0800)
+	return;
+      break;
+    case LINKTYPE_LINUX_SLL:
+      if (len < 16 || get_be16 (p + 14) != 0x0800)
+	return;
+      off = 16;
+      break;
+    case LINKTYPE_LINUX_SLL2:
+      if (len < 20 || get_be16 (p) != 0x0800)
+	return;
+      off = 20;
+      break;
+    case LINKTYPE_NULL:
+      /* AF_INET, in the byte order of the capturing host.  */
+      if (len < 4 || get32 (l, p) != 2)
+	return;
+      off = 4;
+      break;
+    }
+  p += off;
+  len -= off;
+
+  /* IPv4, without options that matter, and not fragmented.  */
+  if (len < 20 || (p[0] >> 4) != 4 || p[9] != 6
+      || (get_be16 (p + 6) & 0x3fff) != 0)
+    return;
+  if ((size_t)get_be16 (p + 2) < len)
+    len = get_be16 (p + 2);
+  n = (p[0] & 15) * 4;
+  if (n < 20 || len < n + 20)
+    return;
+  src = get_be32 (p + 12);
+  dst = get_be32 (p + 16);
+  p += n;
+  len -= n;
+
+  sport = get_be16 (p);
+  dport = get_be16 (p + 2);
+  seq = get_be32 (p + 4);
+  flags = p[13];
+  n = (p[12] >> 4) * 4;
+  if (n < 20 || len < n)
+    return;
+  p += n;
+  len -= n;
+
+  s = stream_find (l, src, sport, dst, dport, TRUE);
+  if (s == NULL)
+    return;
+  if (flags & TCP_SYN)
+    {
+      stream_reset (s);
+      s->seq = (seq + 1) & 0xffffffffUL;
+      s->synced = TRUE;
+      return;
+    }
+  if (len == 0)
+    return;
+  if (!s->synced)
+    {
+      s->seq = seq;
+      s->synced = TRUE;
+    }
+
+  ahead = (seq - s->seq) & 0xffffffffUL;
+  if (ahead != 0 && ahead < 0x80000000UL)
+    {
+      s->state = ST_DEAD;
+      return;
+    }
+  behind = (s->seq - seq) & 0xffffffffUL;
+  if (behind >= len)
+    return;
+  p += behind;
+  len -= behind;
+
+  stream_input (l, s, p, len, usec);
+  s->seq = (s->seq + len) & 0xffffffffUL;
+}
+
+Replay *
+replay_load (const char *file, const char **why)
+{
+  unsigned char header[24], record[16];
+  unsigned char *data;
+  unsigned long magic, sec0 = 0, frac0 = 0;
+  Replay *replay;
+  Loader l;
+  FILE *f = NULL;
+  int nsec, first = TRUE;
+  int i, j;
+
+  memset (&l, 0, sizeof l);
+  l.replay = replay = calloc (1, sizeof *replay);
+  data = malloc (SNAP_MAX);
+  if (replay == NULL || data == NULL)
+    {
+      *why = strerror (ENOMEM);
+      goto fail;
+    }
+
+  f = fopen (file, "rb");
+  if (f == NULL)
+    {
+      *why = strerror (errno);
+      goto fail;
+    }
+  if (fread (header, sizeof header, 1, f) != 1)
+    {
+      *why = "not a pcap file";
+      goto fail;
+    }
+  magic = get32 (&l, header);
+  if (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC)
+    {
+      l.big = TRUE;
+      magic = get32 (&l, header);
+    }
+  if (magic == PCAPNG_MAGIC)
+    {
+      *why = "pcapng is not supported, convert it with editcap -F pcap";
+      goto fail;
+    }
+  if (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC)
+    {
+      *why = "not a pcap file";
+      goto fail;
+    }
+  nsec = magic == PCAP_MAGIC_NSEC;
+
+  l.linktype = get32 (&l, header + 20) & 0xffff;
+  if (l.linktype != LINKTYPE_NULL && l.linktype != LINKTYPE_ETHERNET
+      && l.linktype != LINKTYPE_RAW && l.linktype != LINKTYPE_LINUX_SLL
+      && l.linktype != LINKTYPE_IPV4 && l.linktype != LINKTYPE_LINUX_SLL2)
+    {
+      *why = "unsupported link type";
+      goto fail;
+    }
+
+  /* A truncated last record is just the end.  */
+  while (fread (record, sizeof record, 1, f) == 1)
+    {
+      unsigned long sec = get32 (&l, record);
+      unsigned long frac = get32 (&l, record + 4);
+      size_t len = get32 (&l, record + 8);
+
+      if (len > SNAP_MAX || fread (data, 1, len, f) != len)
+	break;
+      if (nsec)
+	frac /= 1000;
+      if (first)
+	{
+	  sec0 = sec;
+	  frac0 = frac;
+	  first = FALSE;
+	}
+      packet (&l, data, len, (sec - sec0) * 1000000UL + frac - frac0);
+      if (l.failed)
+	{
+	  *why = strerror (ENOMEM);
+	  goto fail;
+	}
+    }
+
+  /* Keep the sessions that had any data.  */
+  for (i = j = 0; i < replay->nsessions; i++)
+    {
+      ReplaySession *session = &replay->session[i];
+      int k;
+
+      if (session->nup + session->ndown == 0)
+	{
+	  free (session->up);
+	  free (session->down);
+	  continue;
+	}
+      for (k = 0; k < session->nup + session->ndown; k++)
+	{
+	  ReplayFrame *frame = k < session->nup
+	    ? &session->up[k] : &session->down[k - session->nup];
+
+	  if (frame->usec > replay->usec)
+	    replay->usec = frame->usec;
+	  replay->frames++;
+	  replay->bytes += frame->len;
+	}
+      replay->session[j++] = *session;
+    }
+  replay->nsessions = j;
+  if (replay->nsessions == 0)
+    {
+      *why = "no tunnel sessions in the capture";
+      goto fail;
+    }
+  goto out;
+
+ fail:
+  replay_free (replay);
+  replay = NULL;
+ out:
+  if (f != NULL)
+    fclose (f);
+  free (data);
+  for (i = 0; i < BUCKETS; i++)
+    while (l.bucket[i] != NULL)
+      {
+	Stream *s = l.bucket[i];
+
+	l.bucket[i] = s->next;
+	free (s->head);
+	free (s);
+      }
+  return replay;
+}
+
+void
+replay_free (Replay *replay)
+{
+  int i;
+
+  if (replay == NULL)
+    return;
+  for (i = 0; i < replay->nsessions; i++)
+    {
+      free (replay->session[i].up);
+      free (replay->session[i].down);
+    }
+  free (replay->session);
+  free (replay);
+}
@@ -0,0 +1,49 @@
+/*
+replay.h
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+
+Tunnel sessions taken from a packet capture, for hts-bench --replay.
+Only the sizes and times of DATA requests are kept, never what they
+carried.
+*/
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stddef.h>
+
+typedef struct
+{
+  unsigned long usec;		/* since the capture started */
+  size_t len;			/* of the payload */
+} ReplayFrame;
+
+/* The frames a tunnel client sent in PUT requests and got back in GET
+   replies, in order.  A client is an IPv4 address.  */
+typedef struct
+{
+  unsigned long addr;		/* host order */
+  ReplayFrame *up;
+  int nup;
+  ReplayFrame *down;
+  int ndown;
+  int sizes[2];			/* of up and down */
+} ReplaySession;
+
+typedef struct
+{
+  ReplaySession *session;
+  int nsessions;
+  unsigned long usec;		/* when the last frame was seen */
+  unsigned long frames;
+  unsigned long bytes;
+} Replay;
+
+/* Read FILE, a pcap capture.  Returns NULL with a reason in WHY if it
+   can't be read or has no tunnel sessions.  */
+extern Replay *replay_load (const char *file, const char **why);
+
+extern void replay_free (Replay *replay);
+
+#endif /* REPLAY_H */
@@ -0,0 +1,386 @@
+/*
+stats.c
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "stats.h"
+
+#if !defined (MAP_ANONYMOUS) && defined (MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+struct stats
+{
+  int workers;
+  int sessions;
+  WorkerStats *worker;		/* [workers] */
+  SessionStats *session;	/* [workers * sessions] */
+};
+
+typedef struct
+{
+  char *data;
+  size_t len;
+  size_t size;
+  int failed;
+} Text;
+
+Stats *
+stats_new (int workers, int sessions)
+{
+  Stats *stats;
+  size_t size;
+  void *p;
+
+  stats = malloc (sizeof *stats);
+  if (stats == NULL)
+    return NULL;
+
+  size = workers * sizeof (WorkerStats)
+    + (size_t)workers * sessions * sizeof (SessionStats);
+  p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    {
+      free (stats);
+      return NULL;
+    }
+
+  /* Anonymous mappings start out zeroed.  */
+  stats->workers = workers;
+  stats->sessions = sessions;
+  stats->worker = p;
+  stats->session = (SessionStats *)(stats->worker + workers);
+  return stats;
+}
+
+WorkerStats *
+stats_worker (Stats *stats, int worker)
+{
+  return &stats->worker[worker];
+}
+
+SessionStats *
+stats_session (Stats *stats, int worker, int session)
+{
+  return &stats->session[worker * stats->sessions + session];
+}
+
+static const char *hist_names[HIST_MAX] =
+{
+  "device_to_tunnel",
+  "tunnel_to_device",
+  "reconnect_gap",
+  "turnaround",
+  "tunnel_rtt",
+  "forward_rtt"
+};
+
+static int
+hist_index (unsigned long v)
+{
+  int e;
+
+  if (v < HIST_SUB)
+    return v;
+  if (v > 0xffffffffUL)
+    return HIST_BUCKETS - 1;
+  for (e = HIST_SUB_BITS; (v >> e) > 1; e++)
+    ;
+  /* Now 2^e <= v < 2^(e+1).  */
+  return (e - HIST_SUB_BITS + 1) * HIST_SUB
+    + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* The largest value counted in bucket I.  */
+
+static unsigned long
+hist_upper (int i)
+{
+  int e = i / HIST_SUB + HIST_SUB_BITS - 1;
+
+  if (i < HIST_SUB)
+    return i + 1;
+  return (unsigned long)(HIST_SUB + i % HIST_SUB + 1) << (e - HIST_SUB_BITS);
+}
+
+void
+stats_record (Histogram *hist, unsigned long usec)
+{
+  /* Bucket I counts the values up to and including hist_upper (I),
+     as Prometheus expects of le.  */
+  hist->bucket[hist_index (usec > 0 ? usec - 1 : 0)]++;
+  hist->sum += usec;
+  hist->count++;
+}
+
+/* Histograms are recorded per worker and added up when asked for.  */
+
+static void
+hist_merge (Stats *stats, int h, Histogram *total)
+{
+  int i, j;
+
+  memset (total, 0, sizeof *total);
+  for (i = 0; i < stats->workers; i++)
+    {
+      Histogram *hist = &stats->worker[i].hist[h];
+
+      total->count += hist->count;
+      total->sum += hist->sum;
+      for (j = 0; j < HIST_BUCKETS; j++)
+	total->bucket[j] += hist->bucket[j];
+    }
+}
+
+/* An upper bound of the value at quantile Q.  */
+
+static unsigned long
+hist_quantile (Histogram *hist, double q)
+{
+  unsigned long rank, seen = 0;
+  int i;
+
+  if (hist->count == 0)
+    return 0;
+  rank = (unsigned long)(q * hist->count);
+  for (i = 0; i < HIST_BUCKETS; i++)
+    {
+      seen += hist->bucket[i];
+      if (seen > rank)
+	return hist_upper (i);
+    }
+  return hist_upper (HIST_BUCKETS - 1);
+}
+
+static void
+text_printf (Text *t, const char *format, ...)
+{
+  va_list ap;
+  char *p;
+  int n;
+
+  if (t->failed)
+    return;
+
+  for (;;)
+    {
+      va_start (ap, format);
+      n = vsnprintf (t->data + t->len, t->size - t->len, format, ap);
+      va_end (ap);
+      if (n >= 0 && t->len + n < t->size)
+	{
+	  t->len += n;
+	  return;
+	}
+
+      /* Keep the old buffer on failure, text_finish () frees it.  */
+      p = realloc (t->data, t->size == 0 ? 4096 : 2 * t->size);
+      if (p == NULL)
+	{
+	  t->failed = TRUE;
+	  return;
+	}
+      t->data = p;
+      t->size = t->size == 0 ? 4096 : 2 * t->size;
+    }
+}
+
+static char *
+text_finish (Text *t)
+{
+  if (t->failed)
+    {
+      free (t->data);
+      return NULL;
+    }
+  return t->data;
+}
+
+/* One Prometheus counter, with a line for each worker.  */
+
+#define PROMETHEUS(name, type, help, field)				\
+  do									\
+    {									\
+      text_printf (&t, "# HELP hts_" name " " help "\n"			\
+		   "# TYPE hts_" name " " type "\n");			\
+      for (i = 0; i < stats->workers; i++)				\
+	text_printf (&t, "hts_" name "{worker=\"%d\"} %lu\n",		\
+		     i, stats->worker[i].field);			\
+    }									\
+  while (0)
+
+char *
+stats_prometheus (Stats *stats)
+{
+  Text t = { NULL, 0, 0, FALSE };
+  Histogram hist;
+  int i, h;
+
+  PROMETHEUS ("wakeups_total", "counter",
+	      "Returns from waiting for events.", wakeups);
+  PROMETHEUS ("events_total", "counter",
+	      "Ready descriptors handled.", events);
+  PROMETHEUS ("sessions_accepted_total", "counter",
+	      "Tunnels accepted.", accepted);
+  PROMETHEUS ("sessions_failed_total", "counter",
+	      "Tunnels closed because they couldn't be set up.", failed);
+  PROMETHEUS ("sessions_rejected_total", "counter",
+	      "Clients turned away by admission limits.", rejected);
+  PROMETHEUS ("rate_limited_total", "counter",
+	      "Times a session was paused by --session-rate.", rate_limited);
+  PROMETHEUS ("sessions_active", "gauge",
+	      "Tunnels open.", active);
+  PROMETHEUS ("connect_failures_total", "counter",
+	      "Failed connects to --forward-port backends.",
+	      connect_failures);
+  PROMETHEUS ("spare_hits_total", "counter",
+	      "Sessions given a connection from --forward-pool.",
+	      spare_hits);
+  PROMETHEUS ("received_bytes_total", "counter",
+	      "Bytes of data from clients.", bytes_in);
+  PROMETHEUS ("sent_bytes_total", "counter",
+	      "Bytes of data to clients.", bytes_out);
+  PROMETHEUS ("data_frames_total", "counter",
+	      "TUNNEL_DATA requests sent.", frames_out);
+  PROMETHEUS ("mux_frames_total", "counter",
+	      "Stream frames sent.", mux_frames_out);
+  PROMETHEUS ("keepalive_paddings_total", "counter",
+	      "Keep-alive TUNNEL_PADDING requests sent.", paddings);
+  PROMETHEUS ("padding_bytes_total", "counter",
+	      "Bytes of keep-alive padding sent.", padding_bytes);
+  PROMETHEUS ("reconnects_total", "counter",
+	      "Clients opening a new PUT connection.", reconnects);
+  PROMETHEUS ("slow_sessions_total", "counter",
+	      "Sessions found limited by their tunnel.", slow_sessions);
+
+  /* Buckets at powers of two are enough for Prometheus.  */
+  for (h = 0; h < HIST_MAX; h++)
+    {
+      unsigned long count = 0;
+      int e = 0;
+
+      hist_merge (stats, h, &hist);
+      text_printf (&t, "# HELP hts_%s_seconds Latency of %s.\n"
+		   "# TYPE hts_%s_seconds histogram\n",
+		   hist_names[h], hist_names[h], hist_names[h]);
+      for (i = 0; i < HIST_BUCKETS; i++)
+	{
+	  count += hist.bucket[i];
+	  if (hist_upper (i) == 1UL << e)
+	    {
+	      text_printf (&t, "hts_%s_seconds_bucket{le=\"%g\"} %lu\n",
+			   hist_names[h], (double)(1UL << e) / 1e6, count);
+	      e++;
+	    }
+	}
+      text_printf (&t, "hts_%s_seconds_bucket{le=\"+Inf\"} %lu\n"
+		   "hts_%s_seconds_sum %g\n"
+		   "hts_%s_seconds_count %lu\n",
+		   hist_names[h], hist.count,
+		   hist_names[h], hist.sum / 1e6,
+		   hist_names[h], hist.count);
+    }
+
+  return text_finish (&t);
+}
+
+static void
+json_tcp (Text *t, const char *name, TcpSample *tcp)
+{
+  text_printf (t, ",\"%s\":{\"rtt_usec\":%lu,\"rttvar_usec\":%lu,"
+	       "\"retransmits\":%lu,\"cwnd\":%lu,\"send_queue\":%lu}",
+	       name, tcp->rtt_usec, tcp->rttvar_usec, tcp->retransmits,
+	       tcp->cwnd, tcp->send_queue);
+}
+
+static void
+json_string (Text *t, const char *s)
+{
+  text_printf (t, "\"");
+  for (; *s != 0; s++)
+    if (*s == '"' || *s == '\\')
+      text_printf (t, "\\%c", *s);
+    else if ((unsigned char)*s >= ' ')
+      text_printf (t, "%c", *s);
+  text_printf (t, "\"");
+}
+
+char *
+stats_json (Stats *stats, unsigned long now)
+{
+  Text t = { NULL, 0, 0, FALSE };
+  Histogram hist;
+  int i, j, h, first;
+
+  text_printf (&t, "{\"workers\":[");
+  for (i = 0; i < stats->workers; i++)
+    {
+      WorkerStats *w = &stats->worker[i];
+
+      text_printf (&t, "%s{\"worker\":%d,\"pid\":%d,"
+		   "\"wakeups\":%lu,\"events\":%lu,"
+		   "\"accepted\":%lu,\"failed\":%lu,\"active\":%lu,"
+		   "\"rejected\":%lu,\"rate_limited\":%lu,"
+		   "\"connect_failures\":%lu,\"spare_hits\":%lu,"
+		   "\"bytes_in\":%lu,\"bytes_out\":%lu,"
+		   "\"frames_out\":%lu,\"mux_frames_out\":%lu,"
+		   "\"paddings\":%lu,\"padding_bytes\":%lu,"
+		   "\"reconnects\":%lu,\"slow_sessions\":%lu,"
+		   "\"sessions\":[",
+		   i == 0 ? "" : ",", i, (int)w->pid,
+		   w->wakeups, w->events, w->accepted, w->failed, w->active,
+		   w->rejected, w->rate_limited,
+		   w->connect_failures, w->spare_hits,
+		   w->bytes_in, w->bytes_out, w->frames_out, w->mux_frames_out,
+		   w->paddings, w->padding_bytes, w->reconnects,
+		   w->slow_sessions);
+
+      first = TRUE;
+      for (j = 0; j < stats->sessions; j++)
+	{
+	  SessionStats *s = stats_session (stats, i, j);
+
+	  if (!s->active)
+	    continue;
+	  text_printf (&t, "%s{\"slot\":%d,\"peer\":", first ? "" : ",", j);
+	  json_string (&t, s->peer);
+	  text_printf (&t, ",\"backend\":");
+	  json_string (&t, s->backend);
+	  text_printf (&t, ",\"age_msec\":%lu,"
+		       "\"bytes_in\":%lu,\"bytes_out\":%lu,"
+		       "\"frames_out\":%lu,\"paddings\":%lu,"
+		       "\"reconnects\":%lu,\"slow\":%s",
+		       now - s->started, s->bytes_in, s->bytes_out,
+		       s->frames_out, s->paddings, s->reconnects,
+		       s->slow ? "true" : "false");
+	  json_tcp (&t, "tunnel_tcp", &s->tunnel);
+	  json_tcp (&t, "forward_tcp", &s->forward);
+	  text_printf (&t, "}");
+	  first = FALSE;
+	}
+      text_printf (&t, "]}");
+    }
+  text_printf (&t, "],\"latency_usec\":{");
+
+  for (h = 0; h < HIST_MAX; h++)
+    {
+      hist_merge (stats, h, &hist);
+      text_printf (&t, "%s\"%s\":{\"count\":%lu,\"sum\":%lu,"
+		   "\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu}",
+		   h == 0 ? "" : ",", hist_names[h], hist.count, hist.sum,
+		   hist_quantile (&hist, 0.5), hist_quantile (&hist, 0.9),
+		   hist_quantile (&hist, 0.99), hist_quantile (&hist, 0.999));
+    }
+  text_printf (&t, "}}\n");
+
+  return text_finish (&t);
+}
@@ -0,0 +1,112 @@
+/*
+stats.h
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+
+Counters for hts.  They live in memory shared by all worker
+processes.  Each worker writes only its own slots, so no locking is
+needed, and whichever process is asked adds them up.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define STATS_PEER_MAX 48
+
+/* Latency histograms, in microseconds.  Like HDR histograms, values
+   below 16 are counted exactly, and above that every power of two is
+   split into 16 buckets, so a bucket is at most 1/16 too coarse.
+   Values of 2^32 and more go in the last bucket.  */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((32 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum
+{
+  HIST_DEVICE_TO_TUNNEL,	/* read from fd until written to tunnel */
+  HIST_TUNNEL_TO_DEVICE,	/* PUT data seen until written to fd */
+  HIST_RECONNECT_GAP,		/* client's PUT connection missing */
+  HIST_TURNAROUND,		/* handling one wakeup of the loop */
+  HIST_TUNNEL_RTT,		/* TCP_INFO samples of the GET connection */
+  HIST_FORWARD_RTT,		/* and of the forwarded port */
+  HIST_MAX
+};
+
+typedef struct
+{
+  unsigned long count;
+  unsigned long sum;
+  unsigned long bucket[HIST_BUCKETS];
+} Histogram;
+
+/* The last TCP_INFO sample of a connection.  All zero if there is
+   none.  */
+typedef struct
+{
+  unsigned long rtt_usec;	/* smoothed round trip time */
+  unsigned long rttvar_usec;
+  unsigned long retransmits;	/* in the connection's lifetime */
+  unsigned long cwnd;		/* congestion window, in segments */
+  unsigned long send_queue;	/* bytes not yet acknowledged */
+} TcpSample;
+
+typedef struct
+{
+  int active;
+  char peer[STATS_PEER_MAX];	/* client address and port */
+  char backend[STATS_PEER_MAX];
+  unsigned long started;	/* timer_now () */
+  unsigned long bytes_in;	/* from the client */
+  unsigned long bytes_out;	/* to the client */
+  unsigned long frames_out;	/* TUNNEL_DATA requests */
+  unsigned long paddings;	/* keep-alive TUNNEL_PADDING requests */
+  unsigned long reconnects;	/* new PUT connections */
+  TcpSample tunnel;		/* GET connection */
+  TcpSample forward;		/* forwarded port */
+  int slow;			/* the tunnel is the bottleneck */
+} SessionStats;
+
+typedef struct
+{
+  pid_t pid;
+  unsigned long wakeups;	/* returns from event_wait () */
+  unsigned long events;
+  unsigned long accepted;	/* sessions */
+  unsigned long failed;		/* sessions that couldn't be opened */
+  unsigned long rejected;	/* clients turned away with a 503 */
+  unsigned long rate_limited;	/* times a session used up --session-rate */
+  unsigned long active;
+  unsigned long connect_failures;
+  unsigned long spare_hits;	/* sessions given a --forward-pool socket */
+  unsigned long bytes_in;
+  unsigned long bytes_out;
+  unsigned long frames_out;
+  unsigned long mux_frames_out;
+  unsigned long paddings;
+  unsigned long padding_bytes;
+  unsigned long reconnects;
+  unsigned long slow_sessions;	/* times a tunnel became the bottleneck */
+  Histogram hist[HIST_MAX];
+} WorkerStats;
+
+typedef struct stats Stats;
+
+/* Map counters for WORKERS processes with SESSIONS sessions each.
+   Call this before forking.  */
+extern Stats *stats_new (int workers, int sessions);
+
+extern WorkerStats *stats_worker (Stats *stats, int worker);
+extern SessionStats *stats_session (Stats *stats, int worker, int session);
+
+extern void stats_record (Histogram *hist, unsigned long usec);
+
+/* Format all counters as Prometheus text or as JSON.  NOW is
+   timer_now (), for session ages.  Returns a string to be freed by
+   the caller, or NULL if out of memory.  */
+extern char *stats_prometheus (Stats *stats);
+extern char *stats_json (Stats *stats, unsigned long now);
+
+#endif /* STATS_H */
@@ -0,0 +1,285 @@
+/*
+timer.c
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+
+The wheel has LEVELS levels of SLOTS slots each.  Level 0 has one slot
+per millisecond, and each slot on level N spans all of level N - 1.
+When level 0 comes round, the next slot on level 1 is emptied into
+level 0, and so on upwards.  A bitmap per level records which slots
+are in use.
+*/
+
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "common.h"
+#include "timer.h"
+
+#define BITS 5
+#define SLOTS (1 << BITS)
+#define MASK (SLOTS - 1)
+#define LEVELS 6		/* 2^30 ms, about 12 days */
+
+struct timer_wheel
+{
+  unsigned long base;		/* next millisecond to run */
+  unsigned long used[LEVELS];	/* bitmap of non-empty slots */
+  Timer slot[LEVELS][SLOTS];	/* list heads */
+};
+
+unsigned long
+timer_now (void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+#endif
+  {
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec * 1000UL + tv.tv_usec / 1000;
+  }
+}
+
+unsigned long
+timer_now_usec (void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+#endif
+  {
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec * 1000000UL + tv.tv_usec;
+  }
+}
+
+TimerWheel *
+timer_wheel_new (unsigned long now)
+{
+  TimerWheel *wheel;
+  int i, j;
+
+  wheel = malloc (sizeof (TimerWheel));
+  if (wheel == NULL)
+    return NULL;
+
+  wheel->base = now;
+  for (i = 0; i < LEVELS; i++)
+    {
+      wheel->used[i] = 0;
+      for (j = 0; j < SLOTS; j++)
+	wheel->slot[i][j].next = wheel->slot[i][j].prev = &wheel->slot[i][j];
+    }
+
+  return wheel;
+}
+
+void
+timer_wheel_destroy (TimerWheel *wheel)
+{
+  free (wheel);
+}
+
+void
+timer_init (Timer *timer, void (*func) (void *), void *data)
+{
+  timer->next = timer->prev = NULL;
+  timer->func = func;
+  timer->data = data;
+}
+
+int
+timer_pending (Timer *timer)
+{
+  return timer->next != NULL;
+}
+
+static void
+timer_insert (TimerWheel *wheel, Timer *timer)
+{
+  unsigned long delta = timer->expires - wheel->base;
+  Timer *head;
+  int level;
+
+  if ((long)delta < 0)
+    {
+      /* Already expired: run it at the next tick.  */
+      timer->expires = wheel->base;
+      delta = 0;
+    }
+  else if (delta >= 1UL << (BITS * LEVELS))
+    {
+      delta = (1UL << (BITS * LEVELS)) - 1;
+      timer->expires = wheel->base + delta;
+    }
+
+  for (level = 0; level < LEVELS - 1; level++)
+    if (delta < 1UL << (BITS * (level + 1)))
+      break;
+
+  timer->level = level;
+  timer->slot = (timer->expires >> (BITS * level)) & MASK;
+  head = &wheel->slot[level][timer->slot];
+  timer->next = head;
+  timer->prev = head->prev;
+  head->prev->next = timer;
+  head->prev = timer;
+  wheel->used[level] |= 1UL << timer->slot;
+}
+
+void
+timer_add (TimerWheel *wheel, Timer *timer, unsigned long expires)
+{
+  if (timer_pending (timer))
+    timer_del (wheel, timer);
+  timer->expires = expires;
+  timer_insert (wheel, timer);
+}
+
+void
+timer_del (TimerWheel *wheel, Timer *timer)
+{
+  Timer *head;
+
+  if (!timer_pending (timer))
+    return;
+
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = timer->prev = NULL;
+
+  head = &wheel->slot[timer->level][timer->slot];
+  if (head->next == head)
+    wheel->used[timer->level] &= ~(1UL << timer->slot);
+}
+
+/* Return how many slots after slot FROM the first used slot in BITMAP
+   is, counting FROM itself as 0, or -1 if none is used.  */
+
+static int
+first_used (unsigned long bitmap, int from)
+{
+  int i;
+
+  for (i = 0; i < SLOTS; i++)
+    if (bitmap & (1UL << ((from + i) & MASK)))
+      return i;
+  return -1;
+}
+
+long
+timer_next (TimerWheel *wheel, unsigned long now)
+{
+  unsigned long when = 0;
+  int found = FALSE;
+  int level, k;
+
+  for (level = 0; level < LEVELS; level++)
+    {
+      unsigned long index, t;
+
+      if (wheel->used[level] == 0)
+	continue;
+
+      index = wheel->base >> (BITS * level);
+      k = first_used (wheel->used[level], index & MASK);
+
+      /* The current slot of a higher level is emptied into the level
+	 below when the wheel enters it.  Once that has happened, a
+	 timer in it is a full round away.  */
+      if (level > 0 && k == 0
+	  && (wheel->base & ((1UL << (BITS * level)) - 1)) != 0)
+	k = SLOTS;
+
+      t = (index + k) << (BITS * level);
+      if (level > 0 && t < wheel->base)
+	t = wheel->base;
+      if (!found || t < when)
+	when = t;
+      found = TRUE;
+    }
+
+  if (!found)
+    return -1;
+  if ((long)(when - now) < 0)
+    return 0;
+  return when - now;
+}
+
+/* Move the timers of the current slot on LEVEL down to lower levels.
+   Returns the index of that slot.  */
+
+static int
+cascade (TimerWheel *wheel, int level)
+{
+  int index = (wheel->base >> (BITS * level)) & MASK;
+  Timer *head = &wheel->slot[level][index];
+  Timer *timer, *next;
+  Timer list;
+
+  if (head->next == head)
+    return index;
+
+  /* Detach the list first, since timer_insert () may link timers back
+     into this very slot.  */
+  list.next = head->next;
+  list.prev = head->prev;
+  list.next->prev = list.prev->next = &list;
+  head->next = head->prev = head;
+  wheel->used[level] &= ~(1UL << index);
+
+  for (timer = list.next; timer != &list; timer = next)
+    {
+      next = timer->next;
+      timer_insert (wheel, timer);
+    }
+
+  return index;
+}
+
+void
+timer_run (TimerWheel *wheel, unsigned long now)
+{
+  while ((long)(now - wheel->base) >= 0)
+    {
+      int index = wheel->base & MASK;
+      Timer *head = &wheel->slot[0][index];
+      int level;
+
+      if (index == 0)
+	for (level = 1; level < LEVELS; level++)
+	  if (cascade (wheel, level) != 0)
+	    break;
+
+      /* Skip ahead over empty slots, but stop at the end of a round
+	 so that the next level gets cascaded.  */
+      if ((wheel->used[0] >> index) == 0)
+	{
+	  unsigned long next = (wheel->base | MASK) + 1;
+
+	  if ((long)(next - now) > 0)
+	    next = now + 1;
+	  wheel->base = next;
+	  continue;
+	}
+
+      while (head->next != head)
+	{
+	  Timer *timer = head->next;
+
+	  timer_del (wheel, timer);
+	  timer->func (timer->data);
+	}
+
+      wheel->base++;
+    }
+}
@@ -0,0 +1,51 @@
+/*
+timer.h
+
+Copyright (C) 1999 Lars Brinkhoff.  See COPYING for terms and conditions.
+
+A hierarchical timer wheel.  Adding and removing a timer takes
+constant time no matter how many are pending, and the time until the
+next one expires is found by looking at a few bitmaps.  Times are in
+milliseconds from timer_now (), which doesn't jump when the wall
+clock is set.
+*/
+
+#ifndef TIMER_H
+#define TIMER_H
+
+typedef struct timer Timer;
+typedef struct timer_wheel TimerWheel;
+
+struct timer
+{
+  Timer *next, *prev;
+  unsigned long expires;
+  int level, slot;
+  void (*func) (void *data);
+  void *data;
+};
+
+extern unsigned long timer_now (void);
+
+/* The same clock in microseconds, for measuring.  It wraps around,
+   so only differences are meaningful.  */
+extern unsigned long timer_now_usec (void);
+
+extern TimerWheel *timer_wheel_new (unsigned long now);
+extern void timer_wheel_destroy (TimerWheel *wheel);
+
+extern void timer_init (Timer *timer, void (*func) (void *), void *data);
+extern void timer_add (TimerWheel *wheel, Timer *timer,
+		       unsigned long expires);
+extern void timer_del (TimerWheel *wheel, Timer *timer);
+extern int timer_pending (Timer *timer);
+
+/* Return the number of milliseconds after NOW when the next timer may
+   expire, or -1 if none is pending.  The wheel might wake up early,
+   but never late.  */
+extern long timer_next (TimerWheel *wheel, unsigned long now);
+
+/* Call the functions of all timers expiring at NOW or earlier.  */
+extern void timer_run (TimerWheel *wheel, unsigned long now);
+
+#endif /* TIMER_H */